@@ -0,0 +1,559 @@
+/*
+ * tcinject.bpf.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+    tc-BPF datapath, loaded by src/tcbpf.c with option -E.
+
+    The first UDP packet of a flow is cloned back to the egress hook of the
+    same interface. The clone carries a private skb->priority, is rewritten
+    there into the fake payload with the configured TTL and leaves before
+    the original packet, which is released unchanged.
+
+    Build: clang -O2 -g -target bpf -Iinclude -c bpf/tcinject.bpf.c
+*/
+#include <stddef.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/pkt_cls.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "tcinject.h"
+
+#define IP4_OFF  ETH_HLEN
+#define UDP4_OFF (IP4_OFF + sizeof(struct iphdr))
+#define IP6_OFF  ETH_HLEN
+#define UDP6_OFF (IP6_OFF + sizeof(struct ipv6hdr))
+
+struct scratch {
+    __u8 buf[FS_TC_CHUNK + 4];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct fs_tc_config);
+} fs_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, FS_TC_PAYLOAD_SLOTS);
+    __type(key, __u32);
+    __type(value, struct fs_tc_payload);
+} fs_payload SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, FS_TC_FLOWS_MAX);
+    __type(key, struct fs_tc_flow);
+    __type(value, __u64);
+} fs_flows SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, FS_TC_BYPASS_MAX);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct fs_tc_lpm4);
+    __type(value, __u8);
+} fs_bypass4 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, FS_TC_BYPASS_MAX);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct fs_tc_lpm6);
+    __type(value, __u8);
+} fs_bypass6 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, FS_TC_STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+} fs_stats SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct scratch);
+} fs_scratch SEC(".maps");
+
+
+static __always_inline void stat_inc(__u32 idx)
+{
+    __u64 *val;
+
+    val = bpf_map_lookup_elem(&fs_stats, &idx);
+    if (val) {
+        (*val)++;
+    }
+}
+
+
+/*
+    Checksum difference between the old UDP data and the new payload, or -1.
+    csum_diff() needs 4-byte multiples, so the old data is copied into a
+    zero-padded scratch buffer one chunk at a time.
+
+    BPF functions take at most 5 arguments, and __always_inline may be only
+    a hint, as defined by <linux/stddef.h>. Lengths are 64-bit, so that the
+    verifier sees the bounds checked on the register passed to the helpers.
+*/
+static __always_inline __s64 payload_diff(struct __sk_buff *skb, __u32 off,
+                                          __u32 old_len,
+                                          const struct fs_tc_payload *pl,
+                                          __u32 new_len)
+{
+    int i;
+    __u64 n, size, pos;
+    __u32 zero;
+    __s64 sum;
+    struct scratch *sc;
+
+    zero = 0;
+    sc = bpf_map_lookup_elem(&fs_scratch, &zero);
+    if (!sc) {
+        return -1;
+    }
+
+    sum = 0;
+
+#pragma unroll
+    for (i = 0; i < FS_TC_CHUNKS_OLD; i++) {
+        pos = i * FS_TC_CHUNK;
+        if (pos >= old_len) {
+            break;
+        }
+        n = old_len - pos;
+        if (n > FS_TC_CHUNK) {
+            n = FS_TC_CHUNK;
+        }
+        if (n < 1) {
+            return -1;
+        }
+
+        *(__u32 *) &sc->buf[n & ~3U] = 0;
+        if (bpf_skb_load_bytes(skb, off + pos, sc->buf, n) < 0) {
+            return -1;
+        }
+
+        size = (n + 3) & ~3U;
+        if (size > FS_TC_CHUNK) {
+            return -1;
+        }
+        sum = bpf_csum_diff((__be32 *) sc->buf, size, NULL, 0, sum);
+        if (sum < 0) {
+            return -1;
+        }
+    }
+
+#pragma unroll
+    for (i = 0; i < (FS_TC_PAYLOAD_MAX + FS_TC_CHUNK - 1) / FS_TC_CHUNK;
+         i++) {
+        pos = i * FS_TC_CHUNK;
+        if (pos >= new_len) {
+            break;
+        }
+        n = new_len - pos;
+        if (n > FS_TC_CHUNK) {
+            n = FS_TC_CHUNK;
+        }
+
+        size = (n + 3) & ~3U;
+        if (size < 4 || size > FS_TC_CHUNK ||
+            size > FS_TC_PAYLOAD_MAX - pos) {
+            return -1;
+        }
+        sum = bpf_csum_diff(NULL, 0, (__be32 *) &pl->data[pos], size, sum);
+        if (sum < 0) {
+            return -1;
+        }
+    }
+
+    return (__u32) sum;
+}
+
+
+/* swap the two adjacent halves of a header field, e.g. saddr and daddr */
+static __always_inline int swap_field(struct __sk_buff *skb, __u32 off,
+                                      __u32 half)
+{
+    __u32 i;
+    __u8 buf[32], tmp;
+
+    if (half > 16) {
+        return -1;
+    }
+
+    if (bpf_skb_load_bytes(skb, off, buf, half * 2) < 0) {
+        return -1;
+    }
+
+#pragma unroll
+    for (i = 0; i < 16; i++) {
+        if (i < half) {
+            tmp = buf[i];
+            buf[i] = buf[i + half];
+            buf[i + half] = tmp;
+        }
+    }
+
+    return bpf_skb_store_bytes(skb, off, buf, half * 2, 0);
+}
+
+
+/* turn the clone of a received packet into a reply; checksums are kept */
+static __always_inline int swap_headers(struct __sk_buff *skb, int ipv6)
+{
+    __u32 ip_off, ip_half, l4off;
+
+    if (ipv6) {
+        ip_off = IP6_OFF + offsetof(struct ipv6hdr, saddr);
+        ip_half = 16;
+        l4off = UDP6_OFF;
+    } else {
+        ip_off = IP4_OFF + offsetof(struct iphdr, saddr);
+        ip_half = 4;
+        l4off = UDP4_OFF;
+    }
+
+    if (swap_field(skb, 0, ETH_ALEN) < 0 ||
+        swap_field(skb, ip_off, ip_half) < 0 ||
+        swap_field(skb, l4off, 2) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Rewrite a pending clone into the fake packet. The UDP checksum is
+    updated incrementally, which also keeps CHECKSUM_PARTIAL packets valid.
+*/
+static __always_inline int rewrite(struct __sk_buff *skb,
+                                   const struct fs_tc_config *cfg, int reply)
+{
+    int ipv6;
+    __u32 slot, l4off, csum_off, plen, old_len, flags;
+    __s64 diff;
+    __be16 old_word, new_word;
+    __u8 hop[2];
+    struct ethhdr eth;
+    struct iphdr ip4;
+    struct udphdr udp;
+    const struct fs_tc_payload *pl;
+
+    skb->priority = 0;
+
+    slot = cfg->payload_slot;
+    pl = bpf_map_lookup_elem(&fs_payload, &slot);
+    if (!pl) {
+        goto drop;
+    }
+
+    plen = pl->len;
+    if (plen < 1 || plen > FS_TC_PAYLOAD_MAX) {
+        goto drop;
+    }
+
+    if (bpf_skb_load_bytes(skb, 0, &eth, sizeof(eth)) < 0) {
+        goto drop;
+    }
+
+    if (eth.h_proto == bpf_htons(ETH_P_IP)) {
+        if (bpf_skb_load_bytes(skb, IP4_OFF, &ip4, sizeof(ip4)) < 0) {
+            goto drop;
+        }
+        ipv6 = 0;
+        l4off = UDP4_OFF;
+        flags = BPF_F_MARK_MANGLED_0;
+    } else if (eth.h_proto == bpf_htons(ETH_P_IPV6)) {
+        ipv6 = 1;
+        l4off = UDP6_OFF;
+        flags = 0;
+    } else {
+        goto drop;
+    }
+
+    if (bpf_skb_load_bytes(skb, l4off, &udp, sizeof(udp)) < 0) {
+        goto drop;
+    }
+
+    old_len = bpf_ntohs(udp.len);
+    if (old_len < sizeof(udp) ||
+        old_len - sizeof(udp) > FS_TC_CHUNK * FS_TC_CHUNKS_OLD) {
+        goto drop;
+    }
+    old_len -= sizeof(udp);
+
+    diff = payload_diff(skb, l4off + sizeof(udp), old_len, pl, plen);
+    if (diff < 0) {
+        goto drop;
+    }
+
+    if (reply && swap_headers(skb, ipv6) < 0) {
+        goto drop;
+    }
+
+    if (bpf_skb_change_tail(skb, l4off + sizeof(udp) + plen, 0) < 0 ||
+        bpf_skb_store_bytes(skb, l4off + sizeof(udp), pl->data, plen, 0) <
+            0) {
+        goto drop;
+    }
+
+    /* UDP length is in the pseudo header and in the UDP header */
+    csum_off = l4off + offsetof(struct udphdr, check);
+    old_word = udp.len;
+    new_word = bpf_htons(sizeof(udp) + plen);
+    if (bpf_l4_csum_replace(skb, csum_off, old_word, new_word,
+                            flags | BPF_F_PSEUDO_HDR | sizeof(new_word)) <
+            0 ||
+        bpf_l4_csum_replace(skb, csum_off, old_word, new_word,
+                            flags | sizeof(new_word)) < 0 ||
+        bpf_l4_csum_replace(skb, csum_off, 0, diff, flags) < 0 ||
+        bpf_skb_store_bytes(skb, l4off + offsetof(struct udphdr, len),
+                            &new_word, sizeof(new_word), 0) < 0) {
+        goto drop;
+    }
+
+    if (ipv6) {
+        new_word = bpf_htons(sizeof(udp) + plen);
+        if (bpf_skb_store_bytes(skb,
+                                IP6_OFF +
+                                    offsetof(struct ipv6hdr, payload_len),
+                                &new_word, sizeof(new_word), 0) < 0 ||
+            bpf_skb_store_bytes(skb,
+                                IP6_OFF + offsetof(struct ipv6hdr, hop_limit),
+                                &cfg->ttl, sizeof(cfg->ttl), 0) < 0) {
+            goto drop;
+        }
+        goto done;
+    }
+
+    csum_off = IP4_OFF + offsetof(struct iphdr, check);
+
+    old_word = ip4.tot_len;
+    new_word = bpf_htons(sizeof(ip4) + sizeof(udp) + plen);
+    if (bpf_l3_csum_replace(skb, csum_off, old_word, new_word,
+                            sizeof(new_word)) < 0 ||
+        bpf_skb_store_bytes(skb, IP4_OFF + offsetof(struct iphdr, tot_len),
+                            &new_word, sizeof(new_word), 0) < 0) {
+        goto drop;
+    }
+
+    /* the fake must not share the IP ID of the original packet */
+    old_word = ip4.id;
+    new_word = (__be16) bpf_get_prandom_u32();
+    if (bpf_l3_csum_replace(skb, csum_off, old_word, new_word,
+                            sizeof(new_word)) < 0 ||
+        bpf_skb_store_bytes(skb, IP4_OFF + offsetof(struct iphdr, id),
+                            &new_word, sizeof(new_word), 0) < 0) {
+        goto drop;
+    }
+
+    /* TTL shares a 16-bit checksum word with the protocol */
+    __builtin_memcpy(&old_word, &ip4.ttl, sizeof(old_word));
+    hop[0] = cfg->ttl;
+    hop[1] = ip4.protocol;
+    __builtin_memcpy(&new_word, hop, sizeof(new_word));
+    if (bpf_l3_csum_replace(skb, csum_off, old_word, new_word,
+                            sizeof(new_word)) < 0 ||
+        bpf_skb_store_bytes(skb, IP4_OFF + offsetof(struct iphdr, ttl),
+                            &new_word, sizeof(new_word), 0) < 0) {
+        goto drop;
+    }
+
+done:
+    stat_inc(FS_TC_STAT_FAKES);
+    return TC_ACT_OK;
+
+drop:
+    stat_inc(FS_TC_STAT_ERRORS);
+    return TC_ACT_SHOT;
+}
+
+
+static __always_inline int bypassed(const struct fs_tc_flow *flow)
+{
+    struct fs_tc_lpm4 key4;
+    struct fs_tc_lpm6 key6;
+
+    if (flow->family == 4) {
+        key4.plen = 32;
+        __builtin_memcpy(key4.addr, flow->remote, sizeof(key4.addr));
+        return !!bpf_map_lookup_elem(&fs_bypass4, &key4);
+    }
+
+    key6.plen = 128;
+    __builtin_memcpy(key6.addr, flow->remote, sizeof(key6.addr));
+    return !!bpf_map_lookup_elem(&fs_bypass6, &key6);
+}
+
+
+static __always_inline int handle(struct __sk_buff *skb, int ingress)
+{
+    int i;
+    __u32 zero, mark, prio, l4off;
+    __u64 now;
+    __u8 *src, *dst;
+    struct ethhdr eth;
+    struct iphdr ip4;
+    struct ipv6hdr ip6;
+    struct udphdr udp;
+    struct fs_tc_flow flow;
+    const struct fs_tc_config *cfg;
+
+    zero = 0;
+    cfg = bpf_map_lookup_elem(&fs_config, &zero);
+    if (!cfg) {
+        return TC_ACT_OK;
+    }
+
+    if ((skb->mark & cfg->fwmask) == cfg->fwmark) {
+        if (ingress) {
+            return TC_ACT_OK;
+        } else if (skb->priority == FS_TC_PRIO_OUT) {
+            return rewrite(skb, cfg, 0);
+        } else if (skb->priority == FS_TC_PRIO_IN) {
+            return rewrite(skb, cfg, 1);
+        }
+        return TC_ACT_OK;
+    }
+
+    if ((ingress && !cfg->inbound) || (!ingress && !cfg->outbound)) {
+        return TC_ACT_OK;
+    }
+
+    /* GSO packets carry bulk data, never the first packet of a flow */
+    if (skb->gso_segs > 1) {
+        return TC_ACT_OK;
+    }
+
+    if (bpf_skb_load_bytes(skb, 0, &eth, sizeof(eth)) < 0) {
+        return TC_ACT_OK;
+    }
+
+    __builtin_memset(&flow, 0, sizeof(flow));
+    src = ingress ? flow.remote : flow.local;
+    dst = ingress ? flow.local : flow.remote;
+
+    if (eth.h_proto == bpf_htons(ETH_P_IP)) {
+        if (!cfg->use_ipv4 ||
+            bpf_skb_load_bytes(skb, IP4_OFF, &ip4, sizeof(ip4)) < 0) {
+            return TC_ACT_OK;
+        }
+        /* the rewrite assumes a fixed header and a complete datagram */
+        if (ip4.ihl != 5 || ip4.protocol != IPPROTO_UDP ||
+            (ip4.frag_off & bpf_htons(0x3fff))) {
+            return TC_ACT_OK;
+        }
+        __builtin_memcpy(src, &ip4.saddr, 4);
+        __builtin_memcpy(dst, &ip4.daddr, 4);
+        flow.family = 4;
+        l4off = UDP4_OFF;
+    } else if (eth.h_proto == bpf_htons(ETH_P_IPV6)) {
+        if (!cfg->use_ipv6 ||
+            bpf_skb_load_bytes(skb, IP6_OFF, &ip6, sizeof(ip6)) < 0) {
+            return TC_ACT_OK;
+        }
+        if (ip6.nexthdr != IPPROTO_UDP) {
+            return TC_ACT_OK;
+        }
+        __builtin_memcpy(src, &ip6.saddr, 16);
+        __builtin_memcpy(dst, &ip6.daddr, 16);
+        flow.family = 6;
+        l4off = UDP6_OFF;
+    } else {
+        return TC_ACT_OK;
+    }
+
+    if (bpf_skb_load_bytes(skb, l4off, &udp, sizeof(udp)) < 0) {
+        return TC_ACT_OK;
+    }
+
+    if (ingress) {
+        flow.local_port = udp.dest;
+        flow.remote_port = udp.source;
+    } else {
+        flow.local_port = udp.source;
+        flow.remote_port = udp.dest;
+    }
+
+    if (bypassed(&flow)) {
+        return TC_ACT_OK;
+    }
+
+    stat_inc(FS_TC_STAT_PKTS);
+
+    /* a lookup refreshes the LRU position of a known flow */
+    if (bpf_map_lookup_elem(&fs_flows, &flow)) {
+        return TC_ACT_OK;
+    }
+
+    now = bpf_ktime_get_ns();
+    if (bpf_map_update_elem(&fs_flows, &flow, &now, BPF_NOEXIST) < 0) {
+        return TC_ACT_OK;
+    }
+
+    stat_inc(FS_TC_STAT_FLOWS);
+
+    mark = skb->mark;
+    prio = skb->priority;
+    skb->mark = (mark & ~cfg->fwmask) | cfg->fwmark;
+    skb->priority = ingress ? FS_TC_PRIO_IN : FS_TC_PRIO_OUT;
+
+#pragma unroll
+    for (i = 0; i < FS_TC_REPEAT_MAX; i++) {
+        if (i >= cfg->repeat) {
+            break;
+        }
+        if (bpf_clone_redirect(skb, skb->ifindex, 0) < 0) {
+            stat_inc(FS_TC_STAT_ERRORS);
+            break;
+        }
+    }
+
+    skb->mark = mark;
+    skb->priority = prio;
+
+    return TC_ACT_OK;
+}
+
+
+SEC("tc")
+int fs_tc_egress(struct __sk_buff *skb)
+{
+    return handle(skb, 0);
+}
+
+
+SEC("tc")
+int fs_tc_ingress(struct __sk_buff *skb)
+{
+    return handle(skb, 1);
+}
+
+
+char _license[] SEC("license") = "GPL";
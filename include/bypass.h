@@ -0,0 +1,54 @@
+/*
+ * bypass.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_BYPASS_H
+#define FS_BYPASS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+    Addresses are in network order. IPv4 uses the first 4 bytes only.
+*/
+struct fs_bypass_net {
+    uint8_t addr[16];
+    uint8_t plen;
+};
+
+struct fs_bypass_range {
+    uint8_t start[16];
+    uint8_t end[16];
+};
+
+int fs_bypass_setup(void);
+
+void fs_bypass_cleanup(void);
+
+int fs_bypass_reload(void);
+
+void fs_bypass_nets(int family, const struct fs_bypass_net **nets,
+                    size_t *cnt);
+
+void fs_bypass_ranges(int family, const struct fs_bypass_range **ranges,
+                      size_t *cnt);
+
+int fs_bypass_match(const struct sockaddr *addr);
+
+#endif /* FS_BYPASS_H */
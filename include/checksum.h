@@ -0,0 +1,31 @@
+/*
+ * checksum.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_CHECKSUM_H
+#define FS_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t fs_csum_partial(uint32_t sum, size_t offset, const uint8_t *data,
+                         size_t len);
+
+uint16_t fs_csum_fold(uint32_t sum);
+
+#endif /* FS_CHECKSUM_H */
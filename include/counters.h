@@ -0,0 +1,68 @@
+/*
+ * counters.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FS_COUNTERS_H
+#define FS_COUNTERS_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum fs_latency {
+    FS_LATENCY_10US = 0,
+    FS_LATENCY_100US,
+    FS_LATENCY_1MS,
+    FS_LATENCY_10MS,
+    FS_LATENCY_SLOW,
+    FS_LATENCY_MAX
+};
+
+/*
+    One block per worker, written by that worker only. It starts on a cache
+    line of its own, so that workers never share one.
+*/
+struct fs_counters {
+    uint64_t pkts[2][2]; /* [inbound, outbound][IPv4, IPv6] */
+    uint64_t parse_errors;
+    uint64_t local_skips;
+    uint64_t fakes;
+    uint64_t send_errors;
+    uint64_t srcinfo_hits;
+    uint64_t srcinfo_misses;
+    uint64_t latency[FS_LATENCY_MAX];
+} __attribute__((aligned(64)));
+
+extern struct fs_counters *fs_ctr;
+
+/*
+    With a single writer, a relaxed load and store is enough, and avoids the
+    locked instruction of an atomic add.
+*/
+#define FS_COUNT(field)                                                      \
+    __atomic_store_n(&fs_ctr->field,                                         \
+                     __atomic_load_n(&fs_ctr->field, __ATOMIC_RELAXED) + 1,  \
+                     __ATOMIC_RELAXED)
+
+int fs_counters_setup(void);
+
+void fs_counters_cleanup(void);
+
+void fs_counters_latency(const struct timespec *start);
+
+int fs_counters_print(void);
+
+#endif /* FS_COUNTERS_H */
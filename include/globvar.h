@@ -27,24 +27,45 @@
 
 struct fs_context {
     int exit;
+    int showstats;
+    int reload;
     FILE *logfp;
-    /* -b, -e, -h */ struct payload_info *plinfo;
+    /* -b, -e, -u */ struct payload_info *plinfo;
     /* -0 */ int inbound;
     /* -1 */ int outbound;
     /* -4 */ int use_ipv4;
     /* -6 */ int use_ipv6;
     /* -a */ int alliface;
+    /* -B */ const char *bypasspath;
+    /* -c */ const char *cachepath;
+    /* -C */ const char *cgroups;
     /* -d */ int daemon;
+    /* -D */ const char *dports;
+    /* -E */ int use_bpf;
     /* -f */ int skipfw;
     /* -g */ int nohopest;
     /* -i */ const char **iface;
     /* -k */ int killproc;
+    /* -K */ int keeprules;
+    /* -l */ uint32_t rate_global;
+    /* -L */ uint32_t rate_prefix;
     /* -m */ uint32_t fwmark;
     /* -n */ uint32_t nfqnum;
+    /* -N */ int ctevents;
+    /* -o */ const char *protos;
+    /* -p */ int probe_rate;
+    /* -P */ int showcounters;
+    /* -q */ uint32_t shed_pkts;
     /* -r */ int repeat;
+    /* -R */ int pktring;
     /* -s */ int silent;
+    /* -S */ const char *sports;
     /* -t */ uint8_t ttl;
+    /* -U */ const char *uids;
     /* -w */ const char *logpath;
+    /* -W */ uint32_t win_first;
+    /* -W */ uint32_t win_last;
+    /* -W */ int win_dir;
     /* -x */ uint32_t fwmask;
     /* -y */ int dynamic_pct;
     /* -z */ int use_iptables;
@@ -0,0 +1,43 @@
+/*
+ * ifmon.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_IFMON_H
+#define FS_IFMON_H
+
+#include <stddef.h>
+#include <net/if.h>
+
+struct fs_iflink {
+    int index;
+    char name[IFNAMSIZ];
+};
+
+int fs_ifmon_setup(void);
+
+void fs_ifmon_cleanup(void);
+
+int fs_ifmon_is_pattern(const char *name);
+
+void fs_ifmon_links(const struct fs_iflink **list, size_t *cnt);
+
+int fs_ifmon_fd(void);
+
+void fs_ifmon_update(void);
+
+#endif /* FS_IFMON_H */
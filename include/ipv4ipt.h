@@ -22,6 +22,8 @@
 
 int fs_ipt4_setup(void);
 
+int fs_ipt4_reload(void);
+
 void fs_ipt4_cleanup(void);
 
 #endif /* FS_IPV4IPT_H */
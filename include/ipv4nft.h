@@ -22,6 +22,10 @@
 
 int fs_nft4_setup(void);
 
+void fs_nft4_reload(void);
+
+void fs_nft4_iface(const char *name, int add);
+
 void fs_nft4_cleanup(void);
 
 #endif /* FS_IPV4NFT_H */
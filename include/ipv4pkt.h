@@ -32,6 +32,6 @@ int fs_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
 int fs_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint8_t *udp_payload,
-                 size_t udp_payload_size);
+                 size_t udp_payload_size, uint32_t udp_payload_sum);
 
 #endif /* FS_IPV4PKT_H */
@@ -22,6 +22,8 @@
 
 int fs_ipt6_setup(void);
 
+int fs_ipt6_reload(void);
+
 void fs_ipt6_cleanup(void);
 
 #endif /* FS_IPV6IPT_H */
@@ -22,6 +22,10 @@
 
 int fs_nft6_setup(void);
 
+void fs_nft6_reload(void);
+
+void fs_nft6_iface(const char *name, int add);
+
 void fs_nft6_cleanup(void);
 
 #endif /* FS_IPV6NFT_H */
@@ -20,8 +20,53 @@
 #ifndef FS_NFRULES_H
 #define FS_NFRULES_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* the limit of iptables multiport, where a range counts twice */
+#define FS_PORTSET_MAX 15
+
+enum fs_ct_dir {
+    FS_CT_DIR_BOTH = 0,
+    FS_CT_DIR_ORIGINAL,
+    FS_CT_DIR_REPLY
+};
+
+struct fs_portset {
+    int invert;
+    size_t cnt;
+    uint16_t first[FS_PORTSET_MAX];
+    uint16_t last[FS_PORTSET_MAX];
+};
+
+/* -U and -C entries */
+#define FS_SCOPE_MAX 16
+
+struct fs_scope {
+    size_t uid_cnt;
+    uint32_t uid[FS_SCOPE_MAX];
+    size_t cgroup_cnt;
+    uint64_t cgroup_id[FS_SCOPE_MAX];
+    uint32_t cgroup_level[FS_SCOPE_MAX];
+};
+
+int fs_portset_parse(const char *spec, struct fs_portset *set);
+
+int fs_portset_multiport(const struct fs_portset *set, char *buff,
+                         size_t size);
+
+int fs_portset_match(const struct fs_portset *set, uint16_t port);
+
+int fs_scope_uids(const char *spec, struct fs_scope *scope);
+
 int fs_nfrules_setup(void);
 
+int fs_nfrules_reload(void);
+
+int fs_nfrules_iface(const char *name, int add);
+
+const struct fs_scope *fs_nfrules_scope(void);
+
 void fs_nfrules_cleanup(void);
 
 #endif /* FS_NFRULES_H */
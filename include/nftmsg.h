@@ -0,0 +1,90 @@
+/*
+ * nftmsg.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_NFTMSG_H
+#define FS_NFTMSG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/netlink.h>
+
+/* data types of nft, for set keys */
+#define FS_NFT_TYPE_IPADDR  7
+#define FS_NFT_TYPE_IP6ADDR 8
+#define FS_NFT_TYPE_INETSRV 13
+#define FS_NFT_TYPE_IFNAME  41
+
+int fs_nftmsg_available(void);
+
+int fs_nftmsg_begin(void);
+
+int fs_nftmsg_commit(void);
+
+void fs_nftmsg_table(uint8_t family, int create);
+
+void fs_nftmsg_chain(uint8_t family, const char *name, int hooknum,
+                     int priority);
+
+void fs_nftmsg_chainflush(uint8_t family, const char *name);
+
+void fs_nftmsg_set(uint8_t family, const char *name, uint32_t flags,
+                   uint32_t key_type, uint32_t key_len);
+
+void fs_nftmsg_setflush(uint8_t family, const char *name);
+
+void fs_nftmsg_setelem(uint8_t family, const char *name, const void *key,
+                       size_t len, int end);
+
+void fs_nftmsg_setdel(uint8_t family, const char *name, const void *key,
+                      size_t len);
+
+struct nlattr *fs_nftmsg_rule_start(uint8_t family, const char *chain,
+                                    struct nlmsghdr **nlh);
+
+void fs_nftmsg_rule_end(struct nlmsghdr *nlh, struct nlattr *exprs);
+
+void fs_nftexpr_payload(struct nlmsghdr *nlh, uint32_t base, uint32_t offset,
+                        uint32_t len);
+
+void fs_nftexpr_meta(struct nlmsghdr *nlh, uint32_t key);
+
+void fs_nftexpr_ct(struct nlmsghdr *nlh, uint32_t key);
+
+void fs_nftexpr_ctdir(struct nlmsghdr *nlh, uint32_t key, uint8_t dir);
+
+void fs_nftexpr_ctmark(struct nlmsghdr *nlh, uint32_t mark, uint32_t mask);
+
+void fs_nftexpr_socket(struct nlmsghdr *nlh, uint32_t key, uint32_t level);
+
+void fs_nftexpr_bitwise(struct nlmsghdr *nlh, const void *mask, size_t len);
+
+void fs_nftexpr_cmp(struct nlmsghdr *nlh, uint32_t op, const void *data,
+                    size_t len);
+
+void fs_nftexpr_range64(struct nlmsghdr *nlh, uint64_t from, uint64_t to);
+
+void fs_nftexpr_lookup(struct nlmsghdr *nlh, const char *set, int invert);
+
+void fs_nftexpr_counter(struct nlmsghdr *nlh);
+
+void fs_nftexpr_verdict(struct nlmsghdr *nlh, int code, const char *chain);
+
+void fs_nftexpr_queue(struct nlmsghdr *nlh, uint16_t num, int bypass);
+
+#endif /* FS_NFTMSG_H */
@@ -22,11 +22,15 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
+
+#define FS_PAYLOAD_MAX 1200
 
 enum payload_type {
     FS_PAYLOAD_END = 0,
     FS_PAYLOAD_SIP,
-    FS_PAYLOAD_CUSTOM
+    FS_PAYLOAD_CUSTOM,
+    FS_PAYLOAD_MATCH
 };
 
 struct payload_info {
@@ -38,6 +42,13 @@ int fs_payload_setup(void);
 
 void fs_payload_cleanup(void);
 
-void th_payload_get(uint8_t **payload_ptr, size_t *payload_len);
+int fs_payload_watchfd(void);
+
+void fs_payload_reload(void);
+
+void fs_payload_quiesce(void);
+
+void th_payload_get(struct sockaddr *peer, uint16_t port, uint8_t *buffer,
+                    size_t *payload_len, uint32_t *payload_sum);
 
 #endif /* FS_PAYLOAD_H */
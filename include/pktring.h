@@ -0,0 +1,38 @@
+/*
+ * pktring.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FS_PKTRING_H
+#define FS_PKTRING_H
+
+#include <stdint.h>
+
+int fs_pktring_setup(void);
+
+void fs_pktring_cleanup(void);
+
+int fs_pktring_fd(void);
+
+void fs_pktring_recv(void);
+
+int fs_pktring_treated(uint16_t ethertype, uint8_t *pkt_data, int pkt_len);
+
+void fs_pktring_treat(uint16_t ethertype, uint8_t *pkt_data, int pkt_len);
+
+void fs_pktring_stats(uint64_t *pkts, uint64_t *drops, uint64_t *treated);
+
+#endif /* FS_PKTRING_H */
@@ -0,0 +1,35 @@
+/*
+ * ratelimit.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FS_RATELIMIT_H
+#define FS_RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+int fs_ratelimit_setup(void);
+
+void fs_ratelimit_cleanup(void);
+
+int fs_ratelimit_allow(struct sockaddr *addr);
+
+void fs_ratelimit_stats(uint64_t *allowed, uint64_t *limited_global,
+                        uint64_t *limited_prefix);
+
+#endif /* FS_RATELIMIT_H */
@@ -21,6 +21,7 @@
 #define FS_RAWSEND_H
 
 #include <stdint.h>
+#include <sys/socket.h>
 #include <linux/if_packet.h>
 
 int fs_rawsend_setup(void);
@@ -28,6 +29,9 @@ int fs_rawsend_setup(void);
 void fs_rawsend_cleanup(void);
 
 int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
-                      int *modified);
+                      int *modified, int *treated);
+
+int fs_rawsend_flow(struct sockaddr *saddr, struct sockaddr *daddr,
+                    uint16_t sport_be, uint16_t dport_be);
 
 #endif /* FS_RAWSEND_H */
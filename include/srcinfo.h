@@ -20,15 +20,25 @@
 #ifndef FS_SRCINFO_H
 #define FS_SRCINFO_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
 
+/* the period of fs_srcinfo_sync(), which the loops have to call */
+#define FS_SRCINFO_SYNC_SEC 10
+
 int fs_srcinfo_setup(void);
 
 void fs_srcinfo_cleanup(void);
 
+void fs_srcinfo_sync(void);
+
 int fs_srcinfo_put(struct sockaddr *addr, uint8_t ttl, uint8_t hwaddr[8]);
 
 int fs_srcinfo_get(struct sockaddr *addr, uint8_t *ttl, uint8_t hwaddr[8]);
 
+void fs_srcinfo_stats(size_t *peers, size_t *lowconf);
+
+uint64_t fs_srcinfo_retries(void);
+
 #endif /* FS_SRCINFO_H */
@@ -0,0 +1,98 @@
+/*
+ * tcinject.h - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef FS_TCINJECT_H
+#define FS_TCINJECT_H
+
+/*
+    Shared between the tc-BPF program (bpf/tcinject.bpf.c) and its loader
+    (src/tcbpf.c). Keep this header free of libc types.
+*/
+#include <linux/types.h>
+
+#define FS_TC_PAYLOAD_MAX   1280
+#define FS_TC_PAYLOAD_SLOTS 2
+#define FS_TC_REPEAT_MAX    10
+#define FS_TC_CHUNK         512
+#define FS_TC_CHUNKS_OLD    4
+#define FS_TC_FLOWS_MAX     65536
+#define FS_TC_BYPASS_MAX    262144
+
+/*
+    skb->priority of a pending clone on its way back to the egress hook.
+    The mark alone is not enough: it also tags the packets that must pass.
+*/
+#define FS_TC_PRIO_OUT 0x46530001
+#define FS_TC_PRIO_IN  0x46530002
+
+enum fs_tc_stat {
+    FS_TC_STAT_PKTS = 0,
+    FS_TC_STAT_FLOWS,
+    FS_TC_STAT_FAKES,
+    FS_TC_STAT_ERRORS,
+    FS_TC_STAT_MAX
+};
+
+struct fs_tc_config {
+    __u32 fwmark;
+    __u32 fwmask;
+    __u8 ttl;
+    __u8 repeat;
+    __u8 inbound;
+    __u8 outbound;
+    __u8 use_ipv4;
+    __u8 use_ipv6;
+    __u8 payload_slot;
+    __u8 pad;
+};
+
+/*
+    data is zero-padded up to FS_TC_PAYLOAD_MAX. The loader writes the slot
+    not in use, then points payload_slot of the config to it, so that the
+    program never reads a slot being written.
+*/
+struct fs_tc_payload {
+    __u32 len;
+    __u8 data[FS_TC_PAYLOAD_MAX];
+};
+
+/* addresses are in network order, IPv4 uses the first 4 bytes only */
+struct fs_tc_flow {
+    __u8 local[16];
+    __u8 remote[16];
+    __be16 local_port;
+    __be16 remote_port;
+    __u8 family;
+    __u8 pad[3];
+};
+
+/*
+    Keys of the bypass maps. The value is the generation of the list that
+    wrote the entry, for the loader; the program only looks for a match.
+*/
+struct fs_tc_lpm4 {
+    __u32 plen;
+    __u8 addr[4];
+};
+
+struct fs_tc_lpm6 {
+    __u32 plen;
+    __u8 addr[16];
+};
+
+#endif /* FS_TCINJECT_H */
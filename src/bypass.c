@@ -0,0 +1,458 @@
+/*
+ * bypass.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "bypass.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    Destinations and sources which are never queued. The list given with
+    -B holds one prefix per line, such as 192.0.2.0/24 or 2001:db8::/32,
+    with '#' starting a comment. It is combined with the built-in local
+    prefixes and merged into sorted, non-overlapping ranges, as required
+    by nftables interval sets. The prefixes of the file are also kept as
+    given, for ipset.
+*/
+
+#define BYPASS_MAX 1048576
+
+struct bypass_list {
+    size_t net_cnt;
+    size_t net_cap;
+    struct fs_bypass_net *nets;
+    size_t range_cnt;
+    struct fs_bypass_range *ranges;
+};
+
+static const char *local_nets4[] = {
+    "0.0.0.0/8",      "10.0.0.0/8",     "100.64.0.0/10",  "127.0.0.0/8",
+    "169.254.0.0/16", "172.16.0.0/12",  "192.168.0.0/16", "224.0.0.0/3",
+    NULL,
+};
+
+/* everything but 2000::/3 */
+static const char *local_nets6[] = {"::/3", "4000::/2", "8000::/1", NULL};
+
+/* 0: IPv4, 1: IPv6 */
+static struct bypass_list lists[2];
+
+static int parse_net(const char *str, int *family, struct fs_bypass_net *net)
+{
+    int res;
+    size_t i, alen;
+    unsigned long plen;
+    char buff[INET6_ADDRSTRLEN + 8], *slash, *end;
+
+    res = snprintf(buff, sizeof(buff), "%s", str);
+    if (res < 0 || (size_t) res >= sizeof(buff)) {
+        return -1;
+    }
+
+    slash = strchr(buff, '/');
+    if (slash) {
+        *slash = '\0';
+    }
+
+    memset(net, 0, sizeof(*net));
+    if (inet_pton(AF_INET, buff, net->addr) == 1) {
+        *family = AF_INET;
+        alen = 4;
+    } else if (inet_pton(AF_INET6, buff, net->addr) == 1) {
+        *family = AF_INET6;
+        alen = 16;
+    } else {
+        return -1;
+    }
+
+    plen = 8 * alen;
+    if (slash) {
+        errno = 0;
+        plen = strtoul(slash + 1, &end, 10);
+        if (errno || end == slash + 1 || *end || plen > 8 * alen) {
+            return -1;
+        }
+    }
+    net->plen = plen;
+
+    /* clear host bits */
+    for (i = 0; i < alen; i++) {
+        if (plen >= 8 * (i + 1)) {
+            continue;
+        } else if (plen > 8 * i) {
+            net->addr[i] &= 0xff << (8 * (i + 1) - plen);
+        } else {
+            net->addr[i] = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+static int list_add(struct bypass_list *list, const struct fs_bypass_net *net)
+{
+    size_t cap;
+    struct fs_bypass_net *nets;
+
+    if (list->net_cnt >= list->net_cap) {
+        if (list->net_cap >= BYPASS_MAX) {
+            E("ERROR: Too many bypass prefixes");
+            return -1;
+        }
+        cap = list->net_cap ? 2 * list->net_cap : 256;
+        nets = realloc(list->nets, cap * sizeof(*nets));
+        if (!nets) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            return -1;
+        }
+        list->nets = nets;
+        list->net_cap = cap;
+    }
+
+    list->nets[list->net_cnt++] = *net;
+
+    return 0;
+}
+
+
+static void list_free(struct bypass_list *list)
+{
+    free(list->nets);
+    free(list->ranges);
+    memset(list, 0, sizeof(*list));
+}
+
+
+static int load_file(const char *path, struct bypass_list *new_lists)
+{
+    int res, ret, family;
+    size_t lineno, n;
+    ssize_t len;
+    char *line, *p, *comment;
+    FILE *fp;
+    struct fs_bypass_net net;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        E("ERROR: fopen(): %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    ret = -1;
+    line = NULL;
+    n = 0;
+    lineno = 0;
+
+    while ((len = getline(&line, &n, fp)) >= 0) {
+        lineno++;
+
+        comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        p = line;
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+        len = strlen(p);
+        while (len && isspace((unsigned char) p[len - 1])) {
+            p[--len] = '\0';
+        }
+        if (!len) {
+            continue;
+        }
+
+        res = parse_net(p, &family, &net);
+        if (res < 0) {
+            E("ERROR: %s:%zu: invalid prefix: %s", path, lineno, p);
+            goto free_line;
+        }
+
+        res = list_add(&new_lists[family == AF_INET6], &net);
+        if (res < 0) {
+            E(T(list_add));
+            goto free_line;
+        }
+    }
+
+    if (ferror(fp)) {
+        E("ERROR: getline(): %s: %s", path, strerror(errno));
+        goto free_line;
+    }
+
+    ret = 0;
+
+free_line:
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+
+static void net_to_range(const struct fs_bypass_net *net, size_t alen,
+                         struct fs_bypass_range *range)
+{
+    size_t i;
+    uint8_t mask;
+
+    memset(range, 0, sizeof(*range));
+    for (i = 0; i < alen; i++) {
+        if (net->plen >= 8 * (i + 1)) {
+            mask = 0xff;
+        } else if (net->plen > 8 * i) {
+            mask = 0xff << (8 * (i + 1) - net->plen);
+        } else {
+            mask = 0;
+        }
+        range->start[i] = net->addr[i] & mask;
+        range->end[i] = net->addr[i] | (uint8_t) ~mask;
+    }
+}
+
+
+static int range_cmp(const void *a, const void *b)
+{
+    const struct fs_bypass_range *ra = a, *rb = b;
+
+    return memcmp(ra->start, rb->start, sizeof(ra->start));
+}
+
+
+/*
+    Returns whether addr directly follows end, i.e. addr == end + 1.
+*/
+static int range_adjacent(const uint8_t *end, const uint8_t *addr,
+                          size_t alen)
+{
+    size_t i;
+    uint8_t next[16];
+
+    memcpy(next, end, alen);
+    for (i = alen; i-- > 0;) {
+        if (++next[i]) {
+            break;
+        }
+    }
+
+    return memcmp(next, addr, alen) == 0;
+}
+
+
+static int build_ranges(struct bypass_list *list, const char **local_nets,
+                        size_t alen)
+{
+    int res, family;
+    size_t i, j, cnt;
+    struct fs_bypass_net net;
+    struct fs_bypass_range *ranges, *cur;
+
+    cnt = 0;
+    while (local_nets[cnt]) {
+        cnt++;
+    }
+    cnt += list->net_cnt;
+
+    ranges = malloc(cnt * sizeof(*ranges));
+    if (!ranges) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; local_nets[i]; i++) {
+        res = parse_net(local_nets[i], &family, &net);
+        if (res < 0) {
+            E("ERROR: invalid built-in prefix: %s", local_nets[i]);
+            free(ranges);
+            return -1;
+        }
+        net_to_range(&net, alen, &ranges[i]);
+    }
+    for (j = 0; j < list->net_cnt; j++) {
+        net_to_range(&list->nets[j], alen, &ranges[i + j]);
+    }
+
+    qsort(ranges, cnt, sizeof(*ranges), range_cmp);
+
+    cur = ranges;
+    for (i = 1; i < cnt; i++) {
+        if (memcmp(ranges[i].start, cur->end, alen) <= 0 ||
+            range_adjacent(cur->end, ranges[i].start, alen)) {
+            if (memcmp(ranges[i].end, cur->end, alen) > 0) {
+                memcpy(cur->end, ranges[i].end, alen);
+            }
+            continue;
+        }
+        *++cur = ranges[i];
+    }
+
+    list->ranges = ranges;
+    list->range_cnt = cur - ranges + 1;
+
+    return 0;
+}
+
+
+static int load_lists(struct bypass_list *new_lists)
+{
+    int res;
+
+    memset(new_lists, 0, 2 * sizeof(*new_lists));
+
+    if (g_ctx.bypasspath) {
+        res = load_file(g_ctx.bypasspath, new_lists);
+        if (res < 0) {
+            E(T(load_file));
+            goto free_lists;
+        }
+    }
+
+    res = build_ranges(&new_lists[0], local_nets4, 4);
+    if (res < 0) {
+        E(T(build_ranges));
+        goto free_lists;
+    }
+
+    res = build_ranges(&new_lists[1], local_nets6, 16);
+    if (res < 0) {
+        E(T(build_ranges));
+        goto free_lists;
+    }
+
+    return 0;
+
+free_lists:
+    list_free(&new_lists[0]);
+    list_free(&new_lists[1]);
+
+    return -1;
+}
+
+
+int fs_bypass_setup(void)
+{
+    int res;
+
+    res = load_lists(lists);
+    if (res < 0) {
+        E(T(load_lists));
+        return -1;
+    }
+
+    if (g_ctx.bypasspath) {
+        E("Bypass list: %zu IPv4 and %zu IPv6 prefixes.", lists[0].net_cnt,
+          lists[1].net_cnt);
+    }
+
+    return 0;
+}
+
+
+void fs_bypass_cleanup(void)
+{
+    list_free(&lists[0]);
+    list_free(&lists[1]);
+}
+
+
+/*
+    On failure, the current lists are kept.
+*/
+int fs_bypass_reload(void)
+{
+    int res;
+    struct bypass_list new_lists[2];
+
+    res = load_lists(new_lists);
+    if (res < 0) {
+        E(T(load_lists));
+        return -1;
+    }
+
+    fs_bypass_cleanup();
+    memcpy(lists, new_lists, sizeof(lists));
+
+    E("Bypass list reloaded: %zu IPv4 and %zu IPv6 prefixes.",
+      lists[0].net_cnt, lists[1].net_cnt);
+
+    return 0;
+}
+
+
+void fs_bypass_nets(int family, const struct fs_bypass_net **nets,
+                    size_t *cnt)
+{
+    *nets = lists[family == AF_INET6].nets;
+    *cnt = lists[family == AF_INET6].net_cnt;
+}
+
+
+void fs_bypass_ranges(int family, const struct fs_bypass_range **ranges,
+                      size_t *cnt)
+{
+    *ranges = lists[family == AF_INET6].ranges;
+    *cnt = lists[family == AF_INET6].range_cnt;
+}
+
+
+/*
+    Whether an address falls into the bypass list or the local prefixes, for
+    the packets which are filtered outside of the firewall rules.
+*/
+int fs_bypass_match(const struct sockaddr *addr)
+{
+    size_t lo, hi, mid, alen;
+    const uint8_t *a;
+    const struct bypass_list *list;
+
+    if (addr->sa_family == AF_INET) {
+        a = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+        alen = 4;
+    } else {
+        a = (const uint8_t *) &((const struct sockaddr_in6 *) addr)
+                ->sin6_addr;
+        alen = 16;
+    }
+    list = &lists[addr->sa_family == AF_INET6];
+
+    lo = 0;
+    hi = list->range_cnt;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (memcmp(a, list->ranges[mid].end, alen) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < list->range_cnt &&
+           memcmp(a, list->ranges[lo].start, alen) >= 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * checksum.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "checksum.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Internet checksum (RFC 1071) helpers. Sums are kept unfolded in host
+    order, so that the sum of a buffer can be computed once and updated for
+    the parts which change. `offset` is the position of `data` relative to
+    the start of the summed region, it decides which half of a 16-bit word
+    each byte goes to.
+*/
+
+uint32_t fs_csum_partial(uint32_t sum, size_t offset, const uint8_t *data,
+                         size_t len)
+{
+    size_t i;
+
+    i = 0;
+    if ((offset & 1) && len) {
+        sum += data[0];
+        i = 1;
+    }
+
+    for (; i + 1 < len; i += 2) {
+        sum += (uint32_t) data[i] << 8 | data[i + 1];
+    }
+
+    if (i < len) {
+        sum += (uint32_t) data[i] << 8;
+    }
+
+    return sum;
+}
+
+
+uint16_t fs_csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+}
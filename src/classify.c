@@ -0,0 +1,178 @@
+/*
+ * classify.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "classify.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    With -o, fakes are only injected before UDP payloads which look like the
+    first packet of a handshake. Each protocol is described by patterns
+    over the first CLS_PREFIX bytes of the payload: a payload matches if
+    its length is within [min_len, max_len] and (data & mask) == value.
+    The patterns of the selected protocols are copied into one table at
+    startup and compared as two 64-bit words each.
+*/
+
+#define CLS_PREFIX   16
+#define CLS_MAX_PATS 16
+
+struct cls_pattern {
+    const char *proto;
+    size_t min_len;
+    size_t max_len;
+    uint8_t mask[CLS_PREFIX];
+    uint8_t value[CLS_PREFIX];
+};
+
+struct cls_entry {
+    size_t min_len;
+    size_t max_len;
+    uint64_t mask[2];
+    uint64_t value[2];
+};
+
+static const struct cls_pattern patterns[] = {
+    /* QUIC v1 Initial: long header, type 0, padded to 1200 bytes */
+    {"quic",
+     1200,
+     SIZE_MAX,
+     {0xf0, 0xff, 0xff, 0xff, 0xff},
+     {0xc0, 0x00, 0x00, 0x00, 0x01}},
+    /* QUIC v2 Initial: long header, type 1 */
+    {"quic",
+     1200,
+     SIZE_MAX,
+     {0xf0, 0xff, 0xff, 0xff, 0xff},
+     {0xd0, 0x6b, 0x33, 0x43, 0xcf}},
+    /* WireGuard handshake initiation */
+    {"wireguard",
+     148,
+     148,
+     {0xff, 0xff, 0xff, 0xff},
+     {0x01, 0x00, 0x00, 0x00}},
+    /* DTLS 1.0/1.2 handshake record, epoch 0, ClientHello */
+    {"dtls",
+     25,
+     SIZE_MAX,
+     {0xff, 0xff, 0xfd, 0xff, 0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0xff},
+     {0x16, 0xfe, 0xfd, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0x01}},
+    /* STUN binding request with the RFC 5389 magic cookie */
+    {"stun",
+     20,
+     SIZE_MAX,
+     {0xff, 0xff, 0, 0, 0xff, 0xff, 0xff, 0xff},
+     {0x00, 0x01, 0, 0, 0x21, 0x12, 0xa4, 0x42}},
+};
+
+static size_t entry_cnt = 0;
+static struct cls_entry entries[CLS_MAX_PATS];
+
+static int add_proto(const char *proto, size_t len)
+{
+    int found;
+    size_t i;
+    struct cls_entry *entry;
+
+    found = 0;
+    for (i = 0; i < sizeof(patterns) / sizeof(*patterns); i++) {
+        if (strlen(patterns[i].proto) != len ||
+            strncmp(patterns[i].proto, proto, len) != 0) {
+            continue;
+        }
+
+        if (entry_cnt >= CLS_MAX_PATS) {
+            E("ERROR: Too many protocols");
+            return -1;
+        }
+
+        entry = &entries[entry_cnt++];
+        entry->min_len = patterns[i].min_len;
+        entry->max_len = patterns[i].max_len;
+        memcpy(entry->mask, patterns[i].mask, CLS_PREFIX);
+        memcpy(entry->value, patterns[i].value, CLS_PREFIX);
+        found = 1;
+    }
+
+    if (!found) {
+        E("ERROR: Unknown protocol: %.*s", (int) len, proto);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int fs_classify_setup(void)
+{
+    int res;
+    const char *p, *comma;
+
+    entry_cnt = 0;
+
+    if (!g_ctx.protos) {
+        return 0;
+    }
+
+    for (p = g_ctx.protos;; p = comma + 1) {
+        comma = strchr(p, ',');
+        res = add_proto(p, comma ? (size_t) (comma - p) : strlen(p));
+        if (res < 0) {
+            E(T(add_proto));
+            return -1;
+        }
+        if (!comma) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+int fs_classify_match(const uint8_t *data, size_t len)
+{
+    size_t i;
+    uint64_t word[2];
+    struct cls_entry *entry;
+
+    if (!g_ctx.protos) {
+        return 1;
+    }
+
+    memset(word, 0, sizeof(word));
+    memcpy(word, data, len < CLS_PREFIX ? len : CLS_PREFIX);
+
+    for (i = 0; i < entry_cnt; i++) {
+        entry = &entries[i];
+        if (len >= entry->min_len && len <= entry->max_len &&
+            (word[0] & entry->mask[0]) == entry->value[0] &&
+            (word[1] & entry->mask[1]) == entry->value[1]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * counters.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "counters.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    The counters live in a shared memory file named after the queue number,
+    which fakesip -P maps read-only and sums up. Updating them takes no
+    system call and no lock: each worker owns its block, see counters.h.
+    The daemon has a single worker for now.
+
+    The file stays open and locked with flock() for the lifetime of the
+    process, which makes it the owner of the file. Until the file is set
+    up, and if it cannot be, the counters go to a private block, so that
+    the hot path never checks.
+*/
+
+#define COUNTERS_MAGIC   0x46534331 /* "FSC1" */
+#define COUNTERS_WORKERS 1
+#define COUNTERS_PATH    "/dev/shm/fakesip-%" PRIu32
+
+struct segment {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t workers;
+    uint32_t pid;
+    uint64_t started;
+    struct fs_counters worker[COUNTERS_WORKERS];
+};
+
+static struct fs_counters fallback;
+static struct segment *seg = NULL;
+static int lock_fd = -1;
+static char path[64];
+
+struct fs_counters *fs_ctr = &fallback;
+
+/*
+    Opens the file of the queue and locks it. Another process holding the
+    lock runs on the same queue: its file is left alone, neither truncated
+    nor removed. The file may also be removed by its previous owner between
+    open() and flock(), in which case the lock is taken on a stale inode
+    and the open is retried.
+*/
+static int open_locked(void)
+{
+    int res, fd, i;
+    struct stat st_fd, st_path;
+
+    for (i = 0; i < 3; i++) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            E("ERROR: open(): %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        res = flock(fd, LOCK_EX | LOCK_NB);
+        if (res < 0) {
+            if (errno == EWOULDBLOCK) {
+                E("ERROR: %s: in use by another process", path);
+            } else {
+                E("ERROR: flock(): %s: %s", path, strerror(errno));
+            }
+            close(fd);
+            return -1;
+        }
+
+        res = fstat(fd, &st_fd);
+        if (res < 0) {
+            E("ERROR: fstat(): %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        res = stat(path, &st_path);
+        if (res == 0 && st_path.st_dev == st_fd.st_dev &&
+            st_path.st_ino == st_fd.st_ino) {
+            return fd;
+        }
+
+        close(fd);
+    }
+
+    E("ERROR: %s: %s", path, "removed while opening");
+
+    return -1;
+}
+
+
+int fs_counters_setup(void)
+{
+    int res;
+
+    res = snprintf(path, sizeof(path), COUNTERS_PATH, g_ctx.nfqnum);
+    if (res < 0 || (size_t) res >= sizeof(path)) {
+        E("ERROR: snprintf(): %s", "failure");
+        return -1;
+    }
+
+    lock_fd = open_locked();
+    if (lock_fd < 0) {
+        E(T(open_locked));
+        return -1;
+    }
+
+    /*
+        From here on the file is ours. Truncating it first zeroes the
+        counters left by a previous process.
+    */
+    res = ftruncate(lock_fd, 0);
+    if (res == 0) {
+        res = ftruncate(lock_fd, sizeof(*seg));
+    }
+    if (res < 0) {
+        E("ERROR: ftruncate(): %s: %s", path, strerror(errno));
+        goto remove_file;
+    }
+
+    seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED,
+               lock_fd, 0);
+    if (seg == MAP_FAILED) {
+        E("ERROR: mmap(): %s: %s", path, strerror(errno));
+        seg = NULL;
+        goto remove_file;
+    }
+
+    seg->size = sizeof(struct fs_counters);
+    seg->workers = COUNTERS_WORKERS;
+    seg->pid = getpid();
+    seg->started = time(NULL);
+    __atomic_store_n(&seg->magic, COUNTERS_MAGIC, __ATOMIC_RELEASE);
+
+    fs_ctr = &seg->worker[0];
+
+    return 0;
+
+remove_file:
+    unlink(path);
+    close(lock_fd);
+    lock_fd = -1;
+
+    return -1;
+}
+
+
+/*
+    The file is removed while it is still locked, so that the next process
+    on the queue never locks the inode being removed.
+*/
+void fs_counters_cleanup(void)
+{
+    fs_ctr = &fallback;
+
+    if (seg) {
+        munmap(seg, sizeof(*seg));
+        seg = NULL;
+    }
+
+    if (lock_fd >= 0) {
+        unlink(path);
+        close(lock_fd);
+        lock_fd = -1;
+    }
+}
+
+
+/*
+    CLOCK_MONOTONIC is read through the vDSO, without a system call.
+*/
+void fs_counters_latency(const struct timespec *start)
+{
+    int64_t us;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = ((int64_t) now.tv_sec - (int64_t) start->tv_sec) * 1000000 +
+         ((int64_t) now.tv_nsec - (int64_t) start->tv_nsec) / 1000;
+
+    if (us < 10) {
+        FS_COUNT(latency[FS_LATENCY_10US]);
+    } else if (us < 100) {
+        FS_COUNT(latency[FS_LATENCY_100US]);
+    } else if (us < 1000) {
+        FS_COUNT(latency[FS_LATENCY_1MS]);
+    } else if (us < 10000) {
+        FS_COUNT(latency[FS_LATENCY_10MS]);
+    } else {
+        FS_COUNT(latency[FS_LATENCY_SLOW]);
+    }
+}
+
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+/*
+    -P: prints the counters of the process running on the queue given by -n.
+*/
+int fs_counters_print(void)
+{
+    int res, fd, i, j;
+    uint32_t w;
+    const struct segment *s;
+    const struct fs_counters *c;
+    struct fs_counters sum;
+    struct stat st;
+
+    res = snprintf(path, sizeof(path), COUNTERS_PATH, g_ctx.nfqnum);
+    if (res < 0 || (size_t) res >= sizeof(path)) {
+        E("ERROR: snprintf(): %s", "failure");
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            E("ERROR: no process is running on queue %" PRIu32,
+              g_ctx.nfqnum);
+        } else {
+            E("ERROR: open(): %s: %s", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    res = fstat(fd, &st);
+    if (res < 0) {
+        E("ERROR: fstat(): %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(*s)) {
+        E("ERROR: %s: unknown format", path);
+        close(fd);
+        return -1;
+    }
+
+    s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        E("ERROR: mmap(): %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != COUNTERS_MAGIC ||
+        s->size != sizeof(struct fs_counters) ||
+        s->workers > COUNTERS_WORKERS) {
+        E("ERROR: %s: unknown format", path);
+        munmap((void *) s, sizeof(*s));
+        return -1;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    for (w = 0; w < s->workers; w++) {
+        c = &s->worker[w];
+        for (i = 0; i < 2; i++) {
+            for (j = 0; j < 2; j++) {
+                sum.pkts[i][j] += load(&c->pkts[i][j]);
+            }
+        }
+        sum.parse_errors += load(&c->parse_errors);
+        sum.local_skips += load(&c->local_skips);
+        sum.fakes += load(&c->fakes);
+        sum.send_errors += load(&c->send_errors);
+        sum.srcinfo_hits += load(&c->srcinfo_hits);
+        sum.srcinfo_misses += load(&c->srcinfo_misses);
+        for (i = 0; i < FS_LATENCY_MAX; i++) {
+            sum.latency[i] += load(&c->latency[i]);
+        }
+    }
+
+    printf("process %" PRIu32 "%s, queue %" PRIu32 ", up %" PRIu64
+           " seconds\n",
+           s->pid, kill(s->pid, 0) < 0 && errno == ESRCH ? " (gone)" : "",
+           g_ctx.nfqnum, (uint64_t) time(NULL) - s->started);
+    printf("packets:         %" PRIu64 " inbound IPv4, %" PRIu64
+           " inbound IPv6, %" PRIu64 " outbound IPv4, %" PRIu64
+           " outbound IPv6\n",
+           sum.pkts[0][0], sum.pkts[0][1], sum.pkts[1][0], sum.pkts[1][1]);
+    printf("parse failures:  %" PRIu64 "\n", sum.parse_errors);
+    printf("local skips:     %" PRIu64 "\n", sum.local_skips);
+    printf("fakes sent:      %" PRIu64 "\n", sum.fakes);
+    printf("send errors:     %" PRIu64 "\n", sum.send_errors);
+    printf("peer lookups:    %" PRIu64 " hits, %" PRIu64 " misses\n",
+           sum.srcinfo_hits, sum.srcinfo_misses);
+    printf("verdict latency: %" PRIu64 " <10us, %" PRIu64 " <100us, %" PRIu64
+           " <1ms, %" PRIu64 " <10ms, %" PRIu64 " slower\n",
+           sum.latency[FS_LATENCY_10US], sum.latency[FS_LATENCY_100US],
+           sum.latency[FS_LATENCY_1MS], sum.latency[FS_LATENCY_10MS],
+           sum.latency[FS_LATENCY_SLOW]);
+
+    munmap((void *) s, sizeof(*s));
+
+    return 0;
+}
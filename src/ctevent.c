@@ -0,0 +1,673 @@
+/*
+ * ctevent.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "ctevent.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "globvar.h"
+#include "hopcache.h"
+#include "ifmon.h"
+#include "logging.h"
+#include "nfrules.h"
+#include "payload.h"
+#include "rawsend.h"
+#include "srcinfo.h"
+
+/*
+    -N: the firewall rules tag the first packet of a flow with the fwmark
+    in its ct mark, instead of queueing it, and the flow is picked up from
+    the conntrack NEW event. No packet leaves the kernel, but the event is
+    only sent once the first packet has been accepted, so the fakes always
+    follow it.
+
+    Whether they still precede the rest of the flow is measured: right
+    after the fakes, the packet counters of the conntrack entry are read
+    back, for the direction of the fakes only. An outbound entry with more
+    original packets than the first one and the fakes, or an inbound entry
+    with more reply packets than the fakes, is an ordering miss. The
+    counters need net.netfilter.nf_conntrack_acct=1.
+*/
+
+#define EVENT_RCVBUF  4194304 /* 4 MB */
+#define LADDR_REFRESH 1       /* seconds */
+#define QUERY_SLOTS   256     /* queries in flight, by sequence number */
+
+struct ct_tuple {
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+    uint16_t sport_be;
+    uint16_t dport_be;
+    uint8_t proto;
+};
+
+struct ct_msg {
+    int family;
+    uint32_t mark;
+    int has_counters;
+    uint64_t pkts_orig;
+    uint64_t pkts_reply;
+    struct ct_tuple orig;
+    struct ct_tuple reply;
+    const struct nlattr *orig_attr;
+    const struct nlattr *zone_attr;
+};
+
+static struct mnl_socket *event_nl = NULL;
+static struct mnl_socket *query_nl = NULL;
+static int measure = 1;
+static uint32_t query_seq = 0;
+static uint8_t query_inbound[QUERY_SLOTS];
+
+static struct ifaddrs *laddrs = NULL;
+static time_t laddrs_time = 0;
+
+static uint64_t stat_flows, stat_treated, stat_measured, stat_misses;
+static uint64_t stat_lost;
+
+
+static int attr_cb(const struct nlattr *attr, void *data)
+{
+    const struct nlattr **tb = data;
+    int type;
+
+    type = mnl_attr_get_type(attr);
+    if (mnl_attr_type_valid(attr, CTA_MAX) < 0) {
+        return MNL_CB_OK;
+    }
+    tb[type] = attr;
+
+    return MNL_CB_OK;
+}
+
+
+static int parse_addr(const struct nlattr *attr, int family,
+                      struct sockaddr_storage *addr)
+{
+    size_t len;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+
+    len = family == AF_INET ? 4 : 16;
+    if (!attr || mnl_attr_get_payload_len(attr) != len) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if (family == AF_INET) {
+        sin = (struct sockaddr_in *) addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, mnl_attr_get_payload(attr), len);
+    } else {
+        sin6 = (struct sockaddr_in6 *) addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, mnl_attr_get_payload(attr), len);
+    }
+
+    return 0;
+}
+
+
+static int parse_tuple(const struct nlattr *nest, int family,
+                       struct ct_tuple *tuple)
+{
+    int res;
+    const struct nlattr *tb[CTA_MAX + 1];
+    const struct nlattr *ip_tb[CTA_MAX + 1];
+    const struct nlattr *proto_tb[CTA_MAX + 1];
+
+    memset(tb, 0, sizeof(tb));
+    memset(ip_tb, 0, sizeof(ip_tb));
+    memset(proto_tb, 0, sizeof(proto_tb));
+
+    res = mnl_attr_parse_nested(nest, attr_cb, tb);
+    if (res < 0 || !tb[CTA_TUPLE_IP] || !tb[CTA_TUPLE_PROTO]) {
+        return -1;
+    }
+
+    res = mnl_attr_parse_nested(tb[CTA_TUPLE_IP], attr_cb, ip_tb);
+    if (res < 0) {
+        return -1;
+    }
+
+    res = mnl_attr_parse_nested(tb[CTA_TUPLE_PROTO], attr_cb, proto_tb);
+    if (res < 0 || !proto_tb[CTA_PROTO_NUM]) {
+        return -1;
+    }
+
+    tuple->proto = mnl_attr_get_u8(proto_tb[CTA_PROTO_NUM]);
+    if (tuple->proto != IPPROTO_UDP) {
+        return 0;
+    }
+
+    if (!proto_tb[CTA_PROTO_SRC_PORT] || !proto_tb[CTA_PROTO_DST_PORT]) {
+        return -1;
+    }
+    tuple->sport_be = mnl_attr_get_u16(proto_tb[CTA_PROTO_SRC_PORT]);
+    tuple->dport_be = mnl_attr_get_u16(proto_tb[CTA_PROTO_DST_PORT]);
+
+    if (family == AF_INET) {
+        res = parse_addr(ip_tb[CTA_IP_V4_SRC], family, &tuple->src);
+        res |= parse_addr(ip_tb[CTA_IP_V4_DST], family, &tuple->dst);
+    } else {
+        res = parse_addr(ip_tb[CTA_IP_V6_SRC], family, &tuple->src);
+        res |= parse_addr(ip_tb[CTA_IP_V6_DST], family, &tuple->dst);
+    }
+
+    return res;
+}
+
+
+static uint64_t parse_pkts(const struct nlattr *nest)
+{
+    int res;
+    const struct nlattr *tb[CTA_MAX + 1];
+
+    memset(tb, 0, sizeof(tb));
+    res = mnl_attr_parse_nested(nest, attr_cb, tb);
+    if (res < 0 || !tb[CTA_COUNTERS_PACKETS]) {
+        return 0;
+    }
+
+    return be64toh(mnl_attr_get_u64(tb[CTA_COUNTERS_PACKETS]));
+}
+
+
+static int parse_msg(const struct nlmsghdr *nlh, struct ct_msg *msg)
+{
+    int res;
+    struct nfgenmsg *nfg;
+    const struct nlattr *tb[CTA_MAX + 1];
+
+    memset(msg, 0, sizeof(*msg));
+    memset(tb, 0, sizeof(tb));
+
+    nfg = mnl_nlmsg_get_payload(nlh);
+    msg->family = nfg->nfgen_family;
+    if (msg->family != AF_INET && msg->family != AF_INET6) {
+        return -1;
+    }
+
+    res = mnl_attr_parse(nlh, sizeof(*nfg), attr_cb, tb);
+    if (res < 0 || !tb[CTA_TUPLE_ORIG] || !tb[CTA_TUPLE_REPLY]) {
+        return -1;
+    }
+
+    if (tb[CTA_MARK]) {
+        msg->mark = ntohl(mnl_attr_get_u32(tb[CTA_MARK]));
+    }
+
+    if (tb[CTA_COUNTERS_ORIG] || tb[CTA_COUNTERS_REPLY]) {
+        msg->has_counters = 1;
+        if (tb[CTA_COUNTERS_ORIG]) {
+            msg->pkts_orig = parse_pkts(tb[CTA_COUNTERS_ORIG]);
+        }
+        if (tb[CTA_COUNTERS_REPLY]) {
+            msg->pkts_reply = parse_pkts(tb[CTA_COUNTERS_REPLY]);
+        }
+    }
+
+    res = parse_tuple(tb[CTA_TUPLE_ORIG], msg->family, &msg->orig);
+    if (res < 0) {
+        return -1;
+    }
+
+    res = parse_tuple(tb[CTA_TUPLE_REPLY], msg->family, &msg->reply);
+    if (res < 0) {
+        return -1;
+    }
+
+    msg->orig_attr = tb[CTA_TUPLE_ORIG];
+    msg->zone_attr = tb[CTA_ZONE];
+
+    return 0;
+}
+
+
+static int addr_equal(const struct sockaddr_storage *a,
+                      const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4, *b4;
+    const struct sockaddr_in6 *a6, *b6;
+
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+
+    if (a->ss_family == AF_INET) {
+        a4 = (const struct sockaddr_in *) a;
+        b4 = (const struct sockaddr_in *) b;
+        return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+
+    a6 = (const struct sockaddr_in6 *) a;
+    b6 = (const struct sockaddr_in6 *) b;
+    return memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) ==
+           0;
+}
+
+
+static int addr_local(const struct sockaddr_storage *addr)
+{
+    int res;
+    struct timespec now;
+    struct ifaddrs *ifa;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!laddrs || now.tv_sec - laddrs_time >= LADDR_REFRESH) {
+        freeifaddrs(laddrs);
+        laddrs = NULL;
+        res = getifaddrs(&laddrs);
+        if (res < 0) {
+            E("ERROR: getifaddrs(): %s", strerror(errno));
+            laddrs = NULL;
+            return 0;
+        }
+        laddrs_time = now.tv_sec;
+    }
+
+    for (ifa = laddrs; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr &&
+            addr_equal(addr, (struct sockaddr_storage *) ifa->ifa_addr)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    A flow is inbound if it was opened towards this host: its original
+    destination is a local address, or was rewritten by DNAT. Otherwise it
+    was opened from here or from a host behind, and goes out.
+*/
+static int flow_inbound(const struct ct_msg *msg)
+{
+    if (!addr_equal(&msg->orig.dst, &msg->reply.src) ||
+        msg->orig.dport_be != msg->reply.sport_be) {
+        return 1;
+    }
+
+    return addr_local(&msg->orig.dst);
+}
+
+
+static void query_counters(const struct ct_msg *msg, int inbound)
+{
+    char buff[MNL_SOCKET_BUFFER_SIZE];
+    ssize_t nbytes;
+    struct nlmsghdr *nlh;
+    struct nfgenmsg *nfg;
+
+    nlh = mnl_nlmsg_put_header(buff);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = ++query_seq;
+    query_inbound[query_seq % QUERY_SLOTS] = inbound;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+    nfg->nfgen_family = msg->family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = 0;
+
+    mnl_attr_put(nlh, CTA_TUPLE_ORIG | NLA_F_NESTED,
+                 mnl_attr_get_payload_len(msg->orig_attr),
+                 mnl_attr_get_payload(msg->orig_attr));
+    if (msg->zone_attr) {
+        mnl_attr_put_u16(nlh, CTA_ZONE, mnl_attr_get_u16(msg->zone_attr));
+    }
+
+    nbytes = mnl_socket_sendto(query_nl, nlh, nlh->nlmsg_len);
+    if (nbytes < 0) {
+        E("ERROR: mnl_socket_sendto(): %s", strerror(errno));
+    }
+}
+
+
+static int event_cb(const struct nlmsghdr *nlh, void *data)
+{
+    int res, inbound;
+    struct ct_msg msg;
+    struct ct_tuple *local;
+
+    (void) data;
+
+    if ((nlh->nlmsg_type & 0xff) != IPCTNL_MSG_CT_NEW) {
+        return MNL_CB_OK;
+    }
+
+    res = parse_msg(nlh, &msg);
+    if (res < 0 || msg.orig.proto != IPPROTO_UDP) {
+        return MNL_CB_OK;
+    }
+
+    /* tagged by the firewall rules */
+    if ((msg.mark & g_ctx.fwmask) != g_ctx.fwmark) {
+        return MNL_CB_OK;
+    }
+
+    if ((msg.family == AF_INET && !g_ctx.use_ipv4) ||
+        (msg.family == AF_INET6 && !g_ctx.use_ipv6)) {
+        return MNL_CB_OK;
+    }
+
+    stat_flows++;
+
+    inbound = flow_inbound(&msg);
+    if ((inbound && !g_ctx.inbound) || (!inbound && !g_ctx.outbound)) {
+        return MNL_CB_OK;
+    }
+
+    /*
+        The fakes follow the direction of the reply for inbound flows, so
+        that they go through the same NAT as the rest of the flow.
+    */
+    local = inbound ? &msg.reply : &msg.orig;
+    res = fs_rawsend_flow((struct sockaddr *) &local->src,
+                          (struct sockaddr *) &local->dst, local->sport_be,
+                          local->dport_be);
+    if (res < 0) {
+        E(T(fs_rawsend_flow));
+        return MNL_CB_OK;
+    } else if (!res) {
+        return MNL_CB_OK;
+    }
+
+    stat_treated++;
+
+    if (measure) {
+        query_counters(&msg, inbound);
+    }
+
+    return MNL_CB_OK;
+}
+
+
+static int query_cb(const struct nlmsghdr *nlh, void *data)
+{
+    int res, inbound;
+    struct ct_msg msg;
+
+    (void) data;
+
+    res = parse_msg(nlh, &msg);
+    if (res < 0) {
+        return MNL_CB_OK;
+    }
+
+    if (!msg.has_counters) {
+        if (!measure) {
+            return MNL_CB_OK;
+        }
+        E("WARNING: conntrack accounting is off, ordering misses are not "
+          "measured (sysctl net.netfilter.nf_conntrack_acct=1)");
+        measure = 0;
+        return MNL_CB_OK;
+    }
+
+    /*
+        The fakes themselves are counted too, in the original direction
+        along with the first packet, or in the reply direction.
+    */
+    stat_measured++;
+    inbound = query_inbound[nlh->nlmsg_seq % QUERY_SLOTS];
+    if (inbound ? msg.pkts_reply > (uint64_t) g_ctx.repeat
+                : msg.pkts_orig > 1 + (uint64_t) g_ctx.repeat) {
+        stat_misses++;
+    }
+
+    return MNL_CB_OK;
+}
+
+
+static void receive(struct mnl_socket *nl, mnl_cb_t cb)
+{
+    static char buff[MNL_SOCKET_BUFFER_SIZE];
+
+    int res;
+    ssize_t nbytes;
+
+    for (;;) {
+        nbytes = recv(mnl_socket_get_fd(nl), buff, sizeof(buff),
+                      MSG_DONTWAIT);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                /* flows opened meanwhile are not treated */
+                stat_lost++;
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                E("ERROR: recv(): %s", strerror(errno));
+            }
+            return;
+        }
+
+        res = mnl_cb_run(buff, nbytes, 0, 0, cb, NULL);
+        if (res < 0 && errno != ENOENT) {
+            /* ENOENT: the flow was gone before its counters were read */
+            E("ERROR: mnl_cb_run(): %s", strerror(errno));
+        }
+    }
+}
+
+
+static void show_stats(void)
+{
+    size_t peers, lowconf;
+    uint64_t evicted, failed;
+
+    fs_srcinfo_stats(&peers, &lowconf);
+    E("statistics: %zu peers known, %zu with low-confidence hop estimation",
+      peers, lowconf);
+
+    if (!g_ctx.nohopest) {
+        fs_hopcache_stats(&evicted, &failed);
+        E("statistics: %" PRIu64 " prefixes evicted from the hop cache, "
+          "%" PRIu64 " failed inserts", evicted, failed);
+    }
+
+    E("statistics: %" PRIu64 " flows from conntrack events, %" PRIu64
+      " treated, %" PRIu64 " event overruns",
+      stat_flows, stat_treated, stat_lost);
+
+    if (stat_measured) {
+        E("statistics: %" PRIu64 " ordering misses in %" PRIu64
+          " measured flows (%.2f%%)",
+          stat_misses, stat_measured, 100.0 * stat_misses / stat_measured);
+    }
+}
+
+
+int fs_ctevent_setup(void)
+{
+    int res, opt;
+    const char *err_hint;
+
+    event_nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!event_nl) {
+        E("ERROR: mnl_socket_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = mnl_socket_bind(event_nl, 0, MNL_SOCKET_AUTOPID);
+    if (res < 0) {
+        E("ERROR: mnl_socket_bind(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    opt = NFNLGRP_CONNTRACK_NEW;
+    res = mnl_socket_setsockopt(event_nl, NETLINK_ADD_MEMBERSHIP, &opt,
+                                sizeof(opt));
+    if (res < 0) {
+        switch (errno) {
+            case EPERM:
+                err_hint = " (Are you root?)";
+                break;
+            case ENOENT:
+                err_hint = " (Missing kernel module?)";
+                break;
+            default:
+                err_hint = "";
+        }
+        E("ERROR: setsockopt(): NETLINK_ADD_MEMBERSHIP: %s%s",
+          strerror(errno), err_hint);
+        goto cleanup;
+    }
+
+    /*
+        Bursts of new flows overrun the default buffer, and events lost are
+        flows left untreated.
+    */
+    opt = EVENT_RCVBUF;
+    res = setsockopt(mnl_socket_get_fd(event_nl), SOL_SOCKET,
+                     SO_RCVBUFFORCE, &opt, sizeof(opt));
+    if (res < 0 && errno == EPERM) {
+        /* in a container: as much as net.core.rmem_max allows */
+        res = setsockopt(mnl_socket_get_fd(event_nl), SOL_SOCKET,
+                         SO_RCVBUF, &opt, sizeof(opt));
+    }
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_RCVBUF: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    query_nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!query_nl) {
+        E("ERROR: mnl_socket_open(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    res = mnl_socket_bind(query_nl, 0, MNL_SOCKET_AUTOPID);
+    if (res < 0) {
+        E("ERROR: mnl_socket_bind(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    return 0;
+
+cleanup:
+    fs_ctevent_cleanup();
+
+    return -1;
+}
+
+
+void fs_ctevent_cleanup(void)
+{
+    if (event_nl) {
+        mnl_socket_close(event_nl);
+        event_nl = NULL;
+    }
+
+    if (query_nl) {
+        mnl_socket_close(query_nl);
+        query_nl = NULL;
+    }
+
+    freeifaddrs(laddrs);
+    laddrs = NULL;
+}
+
+
+int fs_ctevent_loop(void)
+{
+    int res;
+    struct pollfd pfd[4];
+
+    while (!g_ctx.exit) {
+        if (g_ctx.showstats) {
+            g_ctx.showstats = 0;
+            show_stats();
+        }
+
+        if (g_ctx.reload) {
+            g_ctx.reload = 0;
+            res = fs_nfrules_reload();
+            if (res < 0) {
+                E(T(fs_nfrules_reload));
+            }
+        }
+
+        fs_srcinfo_sync();
+        fs_payload_quiesce();
+
+        pfd[0].fd = mnl_socket_get_fd(event_nl);
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+
+        pfd[1].fd = mnl_socket_get_fd(query_nl);
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        /* payload files changed */
+        pfd[2].fd = fs_payload_watchfd();
+        pfd[2].events = POLLIN;
+        pfd[2].revents = 0;
+
+        /* interfaces matching -i patterns came or went */
+        pfd[3].fd = fs_ifmon_fd();
+        pfd[3].events = POLLIN;
+        pfd[3].revents = 0;
+
+        res = poll(pfd, 4, FS_SRCINFO_SYNC_SEC * 1000);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("ERROR: poll(): %s", strerror(errno));
+            return -1;
+        }
+
+        if (pfd[2].revents) {
+            fs_payload_reload();
+        }
+
+        if (pfd[3].revents) {
+            fs_ifmon_update();
+        }
+
+        if (pfd[0].revents) {
+            receive(event_nl, event_cb);
+        }
+
+        if (pfd[1].revents) {
+            receive(query_nl, query_cb);
+        }
+    }
+
+    return 0;
+}
@@ -24,25 +24,46 @@
 #include <stdio.h>
 
 struct fs_context g_ctx = {.exit = 0,
+                           .showstats = 0,
+                           .reload = 0,
                            .logfp = NULL,
 
-                           /* -b, -u */ .plinfo = NULL,
+                           /* -b, -e, -u */ .plinfo = NULL,
                            /* -0 */ .inbound = 0,
                            /* -1 */ .outbound = 0,
                            /* -4 */ .use_ipv4 = 0,
                            /* -6 */ .use_ipv6 = 0,
                            /* -a */ .alliface = 0,
+                           /* -B */ .bypasspath = NULL,
+                           /* -c */ .cachepath = NULL,
+                           /* -C */ .cgroups = NULL,
                            /* -d */ .daemon = 0,
+                           /* -D */ .dports = NULL,
+                           /* -E */ .use_bpf = 0,
                            /* -f */ .skipfw = 0,
                            /* -g */ .nohopest = 0,
                            /* -i */ .iface = NULL,
                            /* -k */ .killproc = 0,
+                           /* -K */ .keeprules = 0,
+                           /* -l */ .rate_global = 0,
+                           /* -L */ .rate_prefix = 0,
                            /* -m */ .fwmark = 0x10000,
                            /* -n */ .nfqnum = 513,
+                           /* -N */ .ctevents = 0,
+                           /* -o */ .protos = NULL,
+                           /* -p */ .probe_rate = 0,
+                           /* -P */ .showcounters = 0,
+                           /* -q */ .shed_pkts = 0,
                            /* -r */ .repeat = 2,
+                           /* -R */ .pktring = 0,
                            /* -s */ .silent = 0,
+                           /* -S */ .sports = NULL,
                            /* -t */ .ttl = 3,
+                           /* -U */ .uids = NULL,
                            /* -w */ .logpath = NULL,
+                           /* -W */ .win_first = 1,
+                           /* -W */ .win_last = 5,
+                           /* -W */ .win_dir = 0,
                            /* -x */ .fwmask = 0,
                            /* -y */ .dynamic_pct = 0,
                            /* -z */ .use_iptables = 0};
@@ -0,0 +1,434 @@
+/*
+ * hopcache.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "hopcache.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "logging.h"
+
+/*
+    Hop counts are aggregated per prefix, so that flows to hosts we have never
+    received from can still be matched against their neighbours.
+
+    IPv4 uses a DIR-16-8 layout: a flat table indexed by the upper 16 bits
+    holds the /16 aggregate and an index of a 256-entry chunk holding the /24
+    values. A lookup touches at most two cache lines.
+
+    IPv6 uses a multibit trie: a flat root indexed by the upper 16 bits,
+    followed by 8-bit stride nodes. The /32 aggregate is stored in the second
+    level and the /48 values in the fourth level.
+
+    Stored values are hops + 1, so that 0 means "unknown".
+
+    IPv4 chunks and IPv6 nodes come from fixed pools. Once a pool is full,
+    a clock hand sweeps it for a victim: the referenced bit, set by every
+    lookup or update, gives a block one more sweep, otherwise it is
+    detached from its parent and reused. An IPv6 node is only evicted once
+    it has no children left, so a subtree is reclaimed from its leaves.
+    The /16 aggregates of IPv4 are kept in the flat table and never evicted.
+*/
+
+#define V4_CHUNKS 1024
+#define V6_NODES  1024
+
+struct v4_entry {
+    uint16_t chunk;
+    uint8_t hops;
+};
+
+struct v4_chunk_info {
+    uint16_t owner; /* index in v4_tbl */
+    uint8_t ref;
+};
+
+struct v6_node {
+    uint16_t child[256];
+    uint8_t hops[256];
+    uint16_t parent; /* 0 for a slot of v6_root */
+    uint16_t key;    /* index of the slot in the parent */
+    uint16_t nchildren;
+    uint8_t ref;
+};
+
+static struct v4_entry *v4_tbl = NULL;
+static uint8_t (*v4_chunks)[256] = NULL;
+static struct v4_chunk_info *v4_info = NULL;
+static size_t v4_chunks_used = 0;
+static size_t v4_hand = 1;
+
+static uint16_t *v6_root = NULL;
+static struct v6_node *v6_nodes = NULL;
+static size_t v6_nodes_used = 0;
+static size_t v6_hand = 1;
+
+static uint64_t stat_evicted = 0;
+static uint64_t stat_failed = 0;
+
+static uint8_t merge_hops(uint8_t old, int hops)
+{
+    int val;
+
+    if (hops > UINT8_MAX - 1) {
+        hops = UINT8_MAX - 1;
+    }
+
+    if (!old) {
+        return hops + 1;
+    }
+
+    /*
+        Smooth the aggregate, a single outlier should not move it too far.
+    */
+    val = ((old - 1) * 3 + hops + 2) / 4;
+
+    return val + 1;
+}
+
+
+/*
+    Returns 0 if no chunk can be evicted, which two full sweeps rule out.
+*/
+static uint16_t v4_alloc(void)
+{
+    size_t i, idx;
+    struct v4_chunk_info *info;
+
+    if (v4_chunks_used < V4_CHUNKS) {
+        return v4_chunks_used++;
+    }
+
+    for (i = 0; i < 2 * V4_CHUNKS; i++) {
+        idx = v4_hand;
+        v4_hand = v4_hand + 1 < V4_CHUNKS ? v4_hand + 1 : 1;
+
+        info = &v4_info[idx];
+        if (info->ref) {
+            info->ref = 0;
+            continue;
+        }
+
+        v4_tbl[info->owner].chunk = 0;
+        memset(v4_chunks[idx], 0, sizeof(v4_chunks[idx]));
+        stat_evicted++;
+
+        return idx;
+    }
+
+    return 0;
+}
+
+
+static void v4_put(uint32_t addr, int hops)
+{
+    struct v4_entry *ent;
+
+    ent = &v4_tbl[addr >> 16];
+    ent->hops = merge_hops(ent->hops, hops);
+
+    if (!ent->chunk) {
+        ent->chunk = v4_alloc();
+        if (!ent->chunk) {
+            stat_failed++;
+            return;
+        }
+        v4_info[ent->chunk].owner = addr >> 16;
+    }
+    v4_info[ent->chunk].ref = 1;
+
+    v4_chunks[ent->chunk][(addr >> 8) & 0xff] =
+        merge_hops(v4_chunks[ent->chunk][(addr >> 8) & 0xff], hops);
+}
+
+
+static int v4_get(uint32_t addr, int *hops)
+{
+    struct v4_entry *ent;
+    uint8_t val;
+
+    ent = &v4_tbl[addr >> 16];
+
+    val = 0;
+    if (ent->chunk) {
+        val = v4_chunks[ent->chunk][(addr >> 8) & 0xff];
+        v4_info[ent->chunk].ref = 1;
+    }
+    if (!val) {
+        val = ent->hops;
+    }
+
+    if (!val) {
+        return 1;
+    }
+
+    *hops = val - 1;
+
+    return 0;
+}
+
+
+/*
+    The parent of the new node is never evicted for it, its ancestors have
+    at least one child each. Returns 0 if no node can be evicted.
+*/
+static uint16_t v6_alloc(uint16_t parent)
+{
+    size_t i, idx;
+    struct v6_node *node;
+
+    if (v6_nodes_used < V6_NODES) {
+        return v6_nodes_used++;
+    }
+
+    for (i = 0; i < 2 * V6_NODES; i++) {
+        idx = v6_hand;
+        v6_hand = v6_hand + 1 < V6_NODES ? v6_hand + 1 : 1;
+
+        node = &v6_nodes[idx];
+        if (idx == parent || node->nchildren) {
+            continue;
+        }
+        if (node->ref) {
+            node->ref = 0;
+            continue;
+        }
+
+        if (node->parent) {
+            v6_nodes[node->parent].child[node->key] = 0;
+            v6_nodes[node->parent].nchildren--;
+        } else {
+            v6_root[node->key] = 0;
+        }
+        memset(node, 0, sizeof(*node));
+        stat_evicted++;
+
+        return idx;
+    }
+
+    return 0;
+}
+
+
+static uint16_t v6_child(uint16_t parent, uint16_t *slot, uint16_t key)
+{
+    uint16_t idx;
+    struct v6_node *node;
+
+    if (!*slot) {
+        idx = v6_alloc(parent);
+        if (!idx) {
+            stat_failed++;
+            return 0;
+        }
+        node = &v6_nodes[idx];
+        node->parent = parent;
+        node->key = key;
+        if (parent) {
+            v6_nodes[parent].nchildren++;
+        }
+        *slot = idx;
+    }
+
+    v6_nodes[*slot].ref = 1;
+
+    return *slot;
+}
+
+
+static void v6_put(const uint8_t addr[16], int hops)
+{
+    uint16_t idx, key;
+    struct v6_node *node;
+
+    key = (addr[0] << 8) | addr[1];
+
+    /* bits 16-23 */
+    idx = v6_child(0, &v6_root[key], key);
+    if (!idx) {
+        return;
+    }
+    node = &v6_nodes[idx];
+
+    /* bits 24-31, /32 aggregate */
+    idx = v6_child(idx, &node->child[addr[2]], addr[2]);
+    if (!idx) {
+        return;
+    }
+    node = &v6_nodes[idx];
+    node->hops[addr[3]] = merge_hops(node->hops[addr[3]], hops);
+
+    /* bits 32-39 */
+    idx = v6_child(idx, &node->child[addr[3]], addr[3]);
+    if (!idx) {
+        return;
+    }
+    node = &v6_nodes[idx];
+
+    /* bits 40-47, /48 value */
+    idx = v6_child(idx, &node->child[addr[4]], addr[4]);
+    if (!idx) {
+        return;
+    }
+    node = &v6_nodes[idx];
+    node->hops[addr[5]] = merge_hops(node->hops[addr[5]], hops);
+}
+
+
+static int v6_get(const uint8_t addr[16], int *hops)
+{
+    int i;
+    uint16_t idx;
+    uint8_t val, found;
+    struct v6_node *node;
+
+    idx = v6_root[(addr[0] << 8) | addr[1]];
+    found = 0;
+
+    for (i = 2; i < 6 && idx; i++) {
+        node = &v6_nodes[idx];
+        node->ref = 1;
+        val = node->hops[addr[i]];
+        if (val) {
+            found = val;
+        }
+        idx = node->child[addr[i]];
+    }
+
+    if (!found) {
+        return 1;
+    }
+
+    *hops = found - 1;
+
+    return 0;
+}
+
+
+int fs_hopcache_setup(void)
+{
+    v4_tbl = calloc(UINT16_MAX + 1, sizeof(*v4_tbl));
+    if (!v4_tbl) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    v4_chunks = calloc(V4_CHUNKS, sizeof(*v4_chunks));
+    if (!v4_chunks) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    v4_info = calloc(V4_CHUNKS, sizeof(*v4_info));
+    if (!v4_info) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    v6_root = calloc(UINT16_MAX + 1, sizeof(*v6_root));
+    if (!v6_root) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    v6_nodes = calloc(V6_NODES, sizeof(*v6_nodes));
+    if (!v6_nodes) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    /* index 0 is reserved as "none" */
+    v4_chunks_used = v6_nodes_used = 1;
+    v4_hand = v6_hand = 1;
+    stat_evicted = stat_failed = 0;
+
+    return 0;
+
+cleanup:
+    fs_hopcache_cleanup();
+
+    return -1;
+}
+
+
+void fs_hopcache_cleanup(void)
+{
+    free(v4_tbl);
+    v4_tbl = NULL;
+
+    free(v4_chunks);
+    v4_chunks = NULL;
+
+    free(v4_info);
+    v4_info = NULL;
+
+    free(v6_root);
+    v6_root = NULL;
+
+    free(v6_nodes);
+    v6_nodes = NULL;
+
+    v4_chunks_used = v6_nodes_used = 0;
+}
+
+
+int fs_hopcache_put(struct sockaddr *addr, int hops)
+{
+    if (hops < 0) {
+        return 0;
+    }
+
+    if (addr->sa_family == AF_INET) {
+        v4_put(ntohl(((struct sockaddr_in *) addr)->sin_addr.s_addr), hops);
+    } else if (addr->sa_family == AF_INET6) {
+        v6_put(((struct sockaddr_in6 *) addr)->sin6_addr.s6_addr, hops);
+    } else {
+        E("ERROR: Unknown sa_family: %d", (int) addr->sa_family);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int fs_hopcache_get(struct sockaddr *addr, int *hops)
+{
+    if (addr->sa_family == AF_INET) {
+        return v4_get(ntohl(((struct sockaddr_in *) addr)->sin_addr.s_addr),
+                      hops);
+    } else if (addr->sa_family == AF_INET6) {
+        return v6_get(((struct sockaddr_in6 *) addr)->sin6_addr.s6_addr,
+                      hops);
+    }
+
+    return 1;
+}
+
+
+void fs_hopcache_stats(uint64_t *evicted, uint64_t *failed)
+{
+    *evicted = stat_evicted;
+    *failed = stat_failed;
+}
@@ -0,0 +1,456 @@
+/*
+ * ifmon.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "ifmon.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+#include <libmnl/libmnl.h>
+
+#include "globvar.h"
+#include "logging.h"
+#include "nfrules.h"
+
+/*
+    -i also accepts glob patterns, such as "ppp*" or "eth0.*". Interfaces
+    matching them come and go (PPPoE reconnects, new VLANs), so they are
+    followed through rtnetlink link notifications: each change adds or
+    removes one element of the interface set, while the rules and the
+    queue binding stay in place. Plain names need no tracking, they are
+    in the set from the start, whether the interface exists or not.
+*/
+
+#define DUMP_BUFFER_SIZE 32768
+
+static struct mnl_socket *nl = NULL;
+static struct fs_iflink *links = NULL;
+static size_t link_cnt = 0;
+static size_t link_cap = 0;
+
+int fs_ifmon_is_pattern(const char *name)
+{
+    return strpbrk(name, "*?[") != NULL;
+}
+
+
+static int name_match(const char *name)
+{
+    size_t i;
+    int matched;
+
+    matched = 0;
+    for (i = 0; g_ctx.iface[i]; i++) {
+        if (!fs_ifmon_is_pattern(g_ctx.iface[i])) {
+            if (strcmp(g_ctx.iface[i], name) == 0) {
+                /* always in the set */
+                return 0;
+            }
+        } else if (fnmatch(g_ctx.iface[i], name, 0) == 0) {
+            matched = 1;
+        }
+    }
+
+    return matched;
+}
+
+
+static struct fs_iflink *link_find(int index)
+{
+    size_t i;
+
+    for (i = 0; i < link_cnt; i++) {
+        if (links[i].index == index) {
+            return &links[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static int link_add(int index, const char *name)
+{
+    size_t cap;
+    struct fs_iflink *buf;
+
+    if (link_cnt >= link_cap) {
+        cap = link_cap ? 2 * link_cap : 16;
+        buf = realloc(links, cap * sizeof(*links));
+        if (!buf) {
+            E("ERROR: realloc(): %s", strerror(errno));
+            return -1;
+        }
+        links = buf;
+        link_cap = cap;
+    }
+
+    links[link_cnt].index = index;
+    memset(links[link_cnt].name, 0, sizeof(links[link_cnt].name));
+    strncpy(links[link_cnt].name, name, sizeof(links[link_cnt].name) - 1);
+    link_cnt++;
+
+    return 0;
+}
+
+
+static void link_remove(struct fs_iflink *link)
+{
+    link_cnt--;
+    *link = links[link_cnt];
+}
+
+
+static void link_update(int index, const char *name, int notify)
+{
+    int res;
+    struct fs_iflink *link;
+
+    link = link_find(index);
+    if (link && name && strcmp(link->name, name) == 0) {
+        return;
+    }
+
+    /*
+        Gone or renamed.
+    */
+    if (link) {
+        if (notify) {
+            E("interface %s is gone", link->name);
+            res = fs_nfrules_iface(link->name, 0);
+            if (res < 0) {
+                E(T(fs_nfrules_iface));
+            }
+        }
+        link_remove(link);
+    }
+
+    if (!name || !name_match(name)) {
+        return;
+    }
+
+    res = link_add(index, name);
+    if (res < 0) {
+        E(T(link_add));
+        return;
+    }
+
+    if (notify) {
+        E("interface %s appeared", name);
+        res = fs_nfrules_iface(name, 1);
+        if (res < 0) {
+            E(T(fs_nfrules_iface));
+        }
+    }
+}
+
+
+static int link_cb(const struct nlmsghdr *nlh, void *data)
+{
+    int notify;
+    const char *name;
+    struct nlattr *attr;
+    struct ifinfomsg *ifi;
+
+    notify = *(int *) data;
+
+    if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK) {
+        return MNL_CB_OK;
+    }
+
+    if (mnl_nlmsg_get_payload_len(nlh) < sizeof(*ifi)) {
+        return MNL_CB_OK;
+    }
+    ifi = mnl_nlmsg_get_payload(nlh);
+
+    name = NULL;
+    mnl_attr_for_each(attr, nlh, sizeof(*ifi)) {
+        if (mnl_attr_get_type(attr) == IFLA_IFNAME &&
+            mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) >= 0) {
+            name = mnl_attr_get_str(attr);
+        }
+    }
+    if (!name) {
+        return MNL_CB_OK;
+    }
+
+    if (nlh->nlmsg_type == RTM_NEWLINK) {
+        link_update(ifi->ifi_index, name, notify);
+    } else {
+        link_update(ifi->ifi_index, NULL, notify);
+    }
+
+    return MNL_CB_OK;
+}
+
+
+/*
+    Lists the current interfaces into links. A socket of its own keeps the
+    replies apart from notifications.
+*/
+static int dump_links(void)
+{
+    int res, ret, notify;
+    ssize_t nbytes;
+    uint32_t seq, portid;
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifi;
+    struct mnl_socket *dump_nl;
+    static uint8_t buff[DUMP_BUFFER_SIZE];
+
+    dump_nl = mnl_socket_open(NETLINK_ROUTE);
+    if (!dump_nl) {
+        E("ERROR: mnl_socket_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    ret = -1;
+
+    res = mnl_socket_bind(dump_nl, 0, MNL_SOCKET_AUTOPID);
+    if (res < 0) {
+        E("ERROR: mnl_socket_bind(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    seq = time(NULL);
+    nlh = mnl_nlmsg_put_header(buff);
+    nlh->nlmsg_type = RTM_GETLINK;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    nlh->nlmsg_seq = seq;
+    ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+    ifi->ifi_family = AF_UNSPEC;
+
+    nbytes = mnl_socket_sendto(dump_nl, nlh, nlh->nlmsg_len);
+    if (nbytes < 0) {
+        E("ERROR: mnl_socket_sendto(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    notify = 0;
+    portid = mnl_socket_get_portid(dump_nl);
+    for (;;) {
+        nbytes = mnl_socket_recvfrom(dump_nl, buff, sizeof(buff));
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("ERROR: mnl_socket_recvfrom(): %s", strerror(errno));
+            goto close_socket;
+        }
+
+        res = mnl_cb_run(buff, nbytes, seq, portid, &link_cb, &notify);
+        if (res < 0) {
+            E("ERROR: mnl_cb_run(): %s", strerror(errno));
+            goto close_socket;
+        } else if (res == MNL_CB_STOP) {
+            break;
+        }
+    }
+
+    ret = 0;
+
+close_socket:
+    mnl_socket_close(dump_nl);
+
+    return ret;
+}
+
+
+static int has_name(const struct fs_iflink *list, size_t cnt,
+                    const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < cnt; i++) {
+        if (strcmp(list[i].name, name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Notifications were lost: list the interfaces again, and apply the
+    difference.
+*/
+static void resync(void)
+{
+    int res;
+    size_t i, old_cnt, old_cap;
+    struct fs_iflink *old;
+
+    old = links;
+    old_cnt = link_cnt;
+    old_cap = link_cap;
+    links = NULL;
+    link_cnt = link_cap = 0;
+
+    res = dump_links();
+    if (res < 0) {
+        E(T(dump_links));
+        free(links);
+        links = old;
+        link_cnt = old_cnt;
+        link_cap = old_cap;
+        return;
+    }
+
+    for (i = 0; i < old_cnt; i++) {
+        if (!has_name(links, link_cnt, old[i].name)) {
+            E("interface %s is gone", old[i].name);
+            res = fs_nfrules_iface(old[i].name, 0);
+            if (res < 0) {
+                E(T(fs_nfrules_iface));
+            }
+        }
+    }
+
+    for (i = 0; i < link_cnt; i++) {
+        if (!has_name(old, old_cnt, links[i].name)) {
+            E("interface %s appeared", links[i].name);
+            res = fs_nfrules_iface(links[i].name, 1);
+            if (res < 0) {
+                E(T(fs_nfrules_iface));
+            }
+        }
+    }
+
+    free(old);
+}
+
+
+int fs_ifmon_setup(void)
+{
+    int res;
+    size_t i;
+
+    if (g_ctx.alliface) {
+        return 0;
+    }
+
+    i = 0;
+    while (g_ctx.iface[i] && !fs_ifmon_is_pattern(g_ctx.iface[i])) {
+        i++;
+    }
+    if (!g_ctx.iface[i]) {
+        return 0;
+    }
+
+    /*
+        Subscribe first, so that no change is missed between the listing
+        and the first notification.
+    */
+    nl = mnl_socket_open(NETLINK_ROUTE);
+    if (!nl) {
+        E("ERROR: mnl_socket_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = mnl_socket_bind(nl, RTMGRP_LINK, MNL_SOCKET_AUTOPID);
+    if (res < 0) {
+        E("ERROR: mnl_socket_bind(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    res = dump_links();
+    if (res < 0) {
+        E(T(dump_links));
+        goto cleanup;
+    }
+
+    E("%zu interfaces match the -i patterns", link_cnt);
+
+    return 0;
+
+cleanup:
+    fs_ifmon_cleanup();
+
+    return -1;
+}
+
+
+void fs_ifmon_cleanup(void)
+{
+    if (nl) {
+        mnl_socket_close(nl);
+        nl = NULL;
+    }
+
+    free(links);
+    links = NULL;
+    link_cnt = link_cap = 0;
+}
+
+
+void fs_ifmon_links(const struct fs_iflink **list, size_t *cnt)
+{
+    *list = links;
+    *cnt = link_cnt;
+}
+
+
+int fs_ifmon_fd(void)
+{
+    return nl ? mnl_socket_get_fd(nl) : -1;
+}
+
+
+void fs_ifmon_update(void)
+{
+    int res, notify;
+    ssize_t nbytes;
+    static uint8_t buff[MNL_SOCKET_BUFFER_SIZE];
+
+    if (!nl) {
+        return;
+    }
+
+    notify = 1;
+    for (;;) {
+        nbytes = recv(mnl_socket_get_fd(nl), buff, sizeof(buff),
+                      MSG_DONTWAIT);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                E("WARNING: interface notifications lost, resynchronizing");
+                resync();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                E("ERROR: recv(): %s", strerror(errno));
+            }
+            return;
+        }
+
+        res = mnl_cb_run(buff, nbytes, 0, 0, &link_cb, &notify);
+        if (res < 0) {
+            E("ERROR: mnl_cb_run(): %s", strerror(errno));
+        }
+    }
+}
@@ -28,10 +28,11 @@
 #include <netinet/udp.h>
 #include <sys/socket.h>
 #include <libnetfilter_queue/libnetfilter_queue_ipv4.h>
-#include <libnetfilter_queue/libnetfilter_queue_udp.h>
 
+#include "checksum.h"
 #include "globvar.h"
 #include "logging.h"
+#include "random.h"
 
 int fs_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
                   struct sockaddr *daddr, uint8_t *ttl,
@@ -89,9 +90,11 @@ int fs_pkt4_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
 int fs_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint8_t *udp_payload,
-                 size_t udp_payload_size)
+                 size_t udp_payload_size, uint32_t udp_payload_sum)
 {
     size_t pkt_len;
+    uint16_t csum;
+    uint32_t sum;
     struct iphdr *iph;
     struct udphdr *udph;
     uint8_t *udppl;
@@ -120,7 +123,7 @@ int fs_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     iph->ihl = sizeof(*iph) / 4;
     iph->tos = 0;
     iph->tot_len = htons(pkt_len);
-    iph->id = ((rand() & 0xff) << 8) | (rand() & 0xff);
+    iph->id = htons(fs_random_ipid(daddr_in->sin_addr.s_addr));
     iph->frag_off = htons(1 << 14 /* DF */);
     iph->ttl = ttl;
     iph->protocol = IPPROTO_UDP;
@@ -139,7 +142,19 @@ int fs_pkt4_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
     }
 
     nfq_ip_set_checksum(iph);
-    nfq_udp_compute_checksum_ipv4(udph, iph);
+
+    /*
+        The sum of the payload is provided by the caller, only the pseudo
+        header and the UDP header are summed here.
+    */
+    sum = udp_payload_sum;
+    sum = fs_csum_partial(sum, 0, (uint8_t *) &iph->saddr,
+                          sizeof(iph->saddr) + sizeof(iph->daddr));
+    sum += IPPROTO_UDP;
+    sum += sizeof(*udph) + udp_payload_size;
+    sum = fs_csum_partial(sum, 0, (uint8_t *) udph, sizeof(*udph));
+    csum = ~fs_csum_fold(sum);
+    udph->check = csum ? htons(csum) : 0xffff;
 
     return pkt_len;
 }
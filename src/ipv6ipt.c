@@ -20,199 +20,443 @@
 #define _GNU_SOURCE
 #include "ipv6ipt.h"
 
+#include <errno.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include <net/if.h>
+#include <sys/socket.h>
 
+#include "bypass.h"
 #include "globvar.h"
 #include "logging.h"
+#include "nfrules.h"
 #include "process.h"
 
-static int ipt6_iface_setup(void)
+/*
+    Applied with a single ip6tables-restore --noflush, as in ipv4ipt.c.
+*/
+
+#define IPT_IFACE_RULE_MAX (IFNAMSIZ + 64)
+#define IPT_BYPASS_MAXELEM 1048576
+#define IPT6_BYPASS_SET    "fakesip-bypass6"
+
+static char *ipt6_iface_rules(void)
 {
-    char iface_str[IFNAMSIZ];
-    size_t i;
+    char *buff;
+    size_t i, cnt, size, len;
     int res;
-    char *ipt_alliface_src_cmd[] = {"ip6tables", "-w",        "-t",
-                                    "mangle",    "-A",        "FAKESIP_S",
-                                    "-j",        "FAKESIP_R", NULL};
 
-    char *ipt_alliface_dst_cmd[] = {"ip6tables", "-w",        "-t",
-                                    "mangle",    "-A",        "FAKESIP_D",
-                                    "-j",        "FAKESIP_R", NULL};
-
-    char *ipt_iface_src_cmd[] = {"ip6tables", "-w",        "-t", "mangle",
-                                 "-A",        "FAKESIP_S", "-i", iface_str,
-                                 "-j",        "FAKESIP_R", NULL};
+    cnt = 0;
+    while (!g_ctx.alliface && g_ctx.iface[cnt]) {
+        cnt++;
+    }
 
-    char *ipt_iface_dst_cmd[] = {"ip6tables", "-w",        "-t", "mangle",
-                                 "-A",        "FAKESIP_D", "-o", iface_str,
-                                 "-j",        "FAKESIP_R", NULL};
+    size = 2 * (cnt + 1) * IPT_IFACE_RULE_MAX;
+    buff = malloc(size);
+    if (!buff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        return NULL;
+    }
 
     if (g_ctx.alliface) {
-        res = fs_execute_command(ipt_alliface_src_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
-        }
-        res = fs_execute_command(ipt_alliface_dst_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
+        res = snprintf(buff, size,
+                       "-A FAKESIP_S -j FAKESIP_R\n"
+                       "-A FAKESIP_D -j FAKESIP_R\n");
+        if (res < 0 || (size_t) res >= size) {
+            E("ERROR: snprintf(): %s", "failure");
+            free(buff);
+            return NULL;
         }
-        return 0;
+        return buff;
     }
 
-    for (i = 0; g_ctx.iface[i]; i++) {
-        res = snprintf(iface_str, sizeof(iface_str), "%s", g_ctx.iface[i]);
-        if (res < 0 || (size_t) res >= sizeof(iface_str)) {
+    len = 0;
+    buff[0] = '\0';
+    for (i = 0; i < cnt; i++) {
+        res = snprintf(buff + len, size - len,
+                       "-A FAKESIP_S -i %s -j FAKESIP_R\n"
+                       "-A FAKESIP_D -o %s -j FAKESIP_R\n",
+                       g_ctx.iface[i], g_ctx.iface[i]);
+        if (res < 0 || (size_t) res >= size - len) {
             E("ERROR: snprintf(): %s", "failure");
-            return -1;
+            free(buff);
+            return NULL;
         }
+        len += res;
+    }
 
-        res = fs_execute_command(ipt_iface_src_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
-        }
+    return buff;
+}
 
-        res = fs_execute_command(ipt_iface_dst_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
+
+/*
+    With -B, the bypass list is loaded into an ipset hash:net, built under a
+    temporary name and swapped in, so that rules never see a partial set.
+*/
+static int ipt6_ipset_update(void)
+{
+    int res, ret;
+    size_t i, cnt, size, len;
+    char *buff, addr_str[INET6_ADDRSTRLEN];
+    const struct fs_bypass_net *nets;
+    char *ipset_cmd[] = {"ipset", "restore", NULL};
+
+    fs_bypass_nets(AF_INET6, &nets, &cnt);
+
+    size = (cnt + 1) * (sizeof(IPT6_BYPASS_SET) + INET6_ADDRSTRLEN + 16) +
+           512;
+    buff = malloc(size);
+    if (!buff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    ret = -1;
+
+    res = snprintf(buff, size,
+                   "create " IPT6_BYPASS_SET " hash:net family inet6 "
+                   "maxelem %d -exist\n"
+                   "create " IPT6_BYPASS_SET "-new hash:net family inet6 "
+                   "maxelem %d -exist\n"
+                   "flush " IPT6_BYPASS_SET "-new\n",
+                   IPT_BYPASS_MAXELEM, IPT_BYPASS_MAXELEM);
+    if (res < 0 || (size_t) res >= size) {
+        E("ERROR: snprintf(): %s", "failure");
+        goto free_buff;
+    }
+    len = res;
+
+    for (i = 0; i < cnt; i++) {
+        if (!inet_ntop(AF_INET6, nets[i].addr, addr_str, sizeof(addr_str))) {
+            E("ERROR: inet_ntop(): %s", strerror(errno));
+            goto free_buff;
+        }
+        res = snprintf(buff + len, size - len,
+                       "add " IPT6_BYPASS_SET "-new %s/%u -exist\n",
+                       addr_str, nets[i].plen);
+        if (res < 0 || (size_t) res >= size - len) {
+            E("ERROR: snprintf(): %s", "failure");
+            goto free_buff;
         }
+        len += res;
     }
-    return 0;
+
+    res = snprintf(buff + len, size - len,
+                   "swap " IPT6_BYPASS_SET "-new " IPT6_BYPASS_SET "\n"
+                   "destroy " IPT6_BYPASS_SET "-new\n");
+    if (res < 0 || (size_t) res >= size - len) {
+        E("ERROR: snprintf(): %s", "failure");
+        goto free_buff;
+    }
+
+    res = fs_execute_command(ipset_cmd, 0, buff);
+    if (res < 0) {
+        E(T(fs_execute_command));
+        goto free_buff;
+    }
+
+    ret = 0;
+
+free_buff:
+    free(buff);
+
+    return ret;
 }
 
 
-int fs_ipt6_setup(void)
+static int ipt6_ports_match(const char *spec, const char *opt,
+                            char *buff, size_t size)
 {
-    char xmark_str[64], nfqnum_str[32];
-    size_t i, ipt_cmds_cnt;
     int res;
-    char *ipt_cmds[][32] = {
-        {"ip6tables", "-w", "-t", "mangle", "-N", "FAKESIP_S", NULL},
+    char list[128];
+    struct fs_portset ports;
+
+    buff[0] = '\0';
+    if (!spec) {
+        return 0;
+    }
+
+    res = fs_portset_parse(spec, &ports);
+    if (res < 0) {
+        E("ERROR: invalid port list: %s", spec);
+        return -1;
+    }
 
-        {"ip6tables", "-w", "-t", "mangle", "-N", "FAKESIP_D", NULL},
+    res = fs_portset_multiport(&ports, list, sizeof(list));
+    if (res < 0) {
+        E(T(fs_portset_multiport));
+        return -1;
+    }
+
+    res = snprintf(buff, size, "-m multiport %s--%s %s ",
+                   ports.invert ? "! " : "", opt, list);
+    if (res < 0 || (size_t) res >= size) {
+        E("ERROR: snprintf(): %s", "failure");
+        return -1;
+    }
 
-        {"ip6tables", "-w", "-t", "mangle", "-I", "PREROUTING", "-j",
-         "FAKESIP_S", NULL},
+    return 0;
+}
 
-        {"ip6tables", "-w", "-t", "mangle", "-I", "POSTROUTING", "-j",
-         "FAKESIP_D", NULL},
 
-        {"ip6tables", "-w", "-t", "mangle", "-N", "FAKESIP_R", NULL},
+static int ipt6_restore(char *script, int silent)
+{
+    int res;
+    char *ipt_restore_cmd[] = {"ip6tables-restore", "-w", "--noflush", NULL};
 
+    res = fs_execute_command(ipt_restore_cmd, silent, script);
+    if (res < 0) {
+        if (!silent) {
+            E(T(fs_execute_command));
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int fs_ipt6_setup(void)
+{
+    int res, ret;
+    size_t size;
+    char probe_rule[128], dports_match[192], sports_match[192];
+    char queue_target[192];
+    const char *win_dir, *inbound_rule;
+    char *iface_rules, *ipt_conf_buff, *bypass_rules;
+    char *ipt_conf_fmt =
+        "*mangle\n"
+        ":FAKESIP_S - [0:0]\n"
+        ":FAKESIP_D - [0:0]\n"
+        ":FAKESIP_R - [0:0]\n"
+        "%s"
+        "-I PREROUTING -j FAKESIP_S\n"
+        "-I POSTROUTING -j FAKESIP_D\n"
         /*
             drop time-exceeded ICMP packets
         */
-        {"iptables", "-w", "-t", "mangle", "-A", "FAKESIP_S", "-p", "icmp",
-         "--icmp-type", "11", "-j", "DROP", NULL},
-
+        "-A FAKESIP_S -p icmp --icmp-type 11 -j DROP\n"
         /*
             exclude non-GUA IPv6 addresses (from source)
         */
-        {"ip6tables", "-w", "-t", "mangle", "-A", "FAKESIP_S", "!", "-s",
-         "2000::/3", "-j", "RETURN", NULL},
-
+        "-A FAKESIP_S ! -s 2000::/3 -j RETURN\n"
+        /*
+            divert time-exceeded ICMPv6 packets to the hop prober
+        */
+        "%s"
+        /*
+            with -R, inbound packets are observed from a ring instead
+        */
+        "%s"
         /*
             exclude non-GUA IPv6 addresses (to destination)
         */
-        {"ip6tables", "-w", "-t", "mangle", "-A", "FAKESIP_D", "!", "-d",
-         "2000::/3", "-j", "RETURN", NULL},
-
+        "-A FAKESIP_D ! -d 2000::/3 -j RETURN\n"
+        /*
+            exclude the bypass list (from source and to destination)
+        */
+        "%s"
         /*
             exclude marked packets
         */
-        {"ip6tables", "-w", "-t", "mangle", "-A", "FAKESIP_R", "-m", "mark",
-         "--mark", xmark_str, "-j", "RETURN", NULL},
-
+        "-A FAKESIP_R -m mark --mark %" PRIu32 "/%" PRIu32 " -j RETURN\n"
         /*
-            send to nfqueue
+            exclude connections which have already been treated
         */
-        {"ip6tables",
-         "-w",
-         "-t",
-         "mangle",
-         "-A",
-         "FAKESIP_R",
-         "-p",
-         "udp",
-         "-m",
-         "connbytes",
-         "--connbytes",
-         "1:5",
-         "--connbytes-dir",
-         "both",
-         "--connbytes-mode",
-         "packets",
-         "-j",
-         "NFQUEUE",
-         "--queue-bypass",
-         "--queue-num",
-         nfqnum_str,
-         NULL}};
-
-    ipt_cmds_cnt = sizeof(ipt_cmds) / sizeof(*ipt_cmds);
-
-    res = snprintf(xmark_str, sizeof(xmark_str), "%" PRIu32 "/%" PRIu32,
-                   g_ctx.fwmark, g_ctx.fwmask);
-    if (res < 0 || (size_t) res >= sizeof(xmark_str)) {
+        "-A FAKESIP_R -m connmark --mark %" PRIu32 "/%" PRIu32
+        " -j RETURN\n"
+        /*
+            send to nfqueue (or, with -N, tag the flow)
+        */
+        "-A FAKESIP_R -p udp %s%s%s\n"
+        /*
+            interfaces
+        */
+        "%s"
+        "COMMIT\n";
+
+    if (g_ctx.probe_rate) {
+        res = snprintf(probe_rule, sizeof(probe_rule),
+                       "-A FAKESIP_S -p icmpv6 --icmpv6-type 3 "
+                       "-j NFQUEUE --queue-num %" PRIu32 "\n",
+                       g_ctx.nfqnum + 1);
+    } else {
+        res = snprintf(probe_rule, sizeof(probe_rule), "%s", "");
+    }
+    if (res < 0 || (size_t) res >= sizeof(probe_rule)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
     }
 
-    res = snprintf(nfqnum_str, sizeof(nfqnum_str), "%" PRIu32, g_ctx.nfqnum);
-    if (res < 0 || (size_t) res >= sizeof(nfqnum_str)) {
+    res = ipt6_ports_match(g_ctx.dports, "dports", dports_match,
+                           sizeof(dports_match));
+    if (res < 0) {
+        E(T(ipt6_ports_match));
+        return -1;
+    }
+
+    res = ipt6_ports_match(g_ctx.sports, "sports", sports_match,
+                           sizeof(sports_match));
+    if (res < 0) {
+        E(T(ipt6_ports_match));
+        return -1;
+    }
+
+    if (g_ctx.win_dir == FS_CT_DIR_ORIGINAL) {
+        win_dir = "original";
+    } else if (g_ctx.win_dir == FS_CT_DIR_REPLY) {
+        win_dir = "reply";
+    } else {
+        win_dir = "both";
+    }
+
+    if (g_ctx.ctevents) {
+        res = snprintf(queue_target, sizeof(queue_target),
+                       "-j CONNMARK --set-xmark %" PRIu32 "/%" PRIu32,
+                       g_ctx.fwmark, g_ctx.fwmask);
+    } else {
+        res = snprintf(queue_target, sizeof(queue_target),
+                       "-m connbytes --connbytes %" PRIu32 ":%" PRIu32
+                       " --connbytes-dir %s --connbytes-mode packets "
+                       "-j NFQUEUE --queue-bypass --queue-num %" PRIu32,
+                       g_ctx.win_first, g_ctx.win_last, win_dir,
+                       g_ctx.nfqnum);
+    }
+    if (res < 0 || (size_t) res >= sizeof(queue_target)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
     }
 
-    fs_ipt6_cleanup();
+    inbound_rule = g_ctx.pktring ? "-A FAKESIP_S -j RETURN\n" : "";
 
-    for (i = 0; i < ipt_cmds_cnt; i++) {
-        res = fs_execute_command(ipt_cmds[i], 0, NULL);
+    bypass_rules = "";
+    if (g_ctx.bypasspath) {
+        res = ipt6_ipset_update();
         if (res < 0) {
-            E(T(fs_execute_command));
+            E(T(ipt6_ipset_update));
             return -1;
         }
+        bypass_rules =
+            "-A FAKESIP_S -m set --match-set " IPT6_BYPASS_SET
+            " src -j RETURN\n"
+            "-A FAKESIP_D -m set --match-set " IPT6_BYPASS_SET
+            " dst -j RETURN\n";
     }
 
-    res = ipt6_iface_setup();
-    if (res < 0) {
-        E(T(ipt6_iface_setup));
+    iface_rules = ipt6_iface_rules();
+    if (!iface_rules) {
+        E(T(ipt6_iface_rules));
         return -1;
     }
 
-    return 0;
-}
+    ret = -1;
 
+    size = strlen(ipt_conf_fmt) + strlen(bypass_rules) + strlen(iface_rules) +
+           1024;
+    ipt_conf_buff = malloc(size);
+    if (!ipt_conf_buff) {
+        E("ERROR: malloc(): %s", strerror(errno));
+        goto free_iface_rules;
+    }
 
-void fs_ipt6_cleanup(void)
-{
-    size_t i, cnt;
-    char *ipt_cmds[][32] = {
-        {"ip6tables", "-w", "-t", "mangle", "-F", "FAKESIP_R", NULL},
+    /*
+        Replace the rules of a previous run, if any.
+    */
+    res = snprintf(ipt_conf_buff, size, ipt_conf_fmt,
+                   "-D PREROUTING -j FAKESIP_S\n"
+                   "-D POSTROUTING -j FAKESIP_D\n",
+                   probe_rule, inbound_rule, bypass_rules, g_ctx.fwmark,
+                   g_ctx.fwmask, g_ctx.fwmark, g_ctx.fwmask, dports_match,
+                   sports_match, queue_target, iface_rules);
+    if (res < 0 || (size_t) res >= size) {
+        E("ERROR: snprintf(): %s", "failure");
+        goto free_conf_buff;
+    }
+
+    res = ipt6_restore(ipt_conf_buff, 1);
+    if (!res) {
+        ret = 0;
+        goto free_conf_buff;
+    }
 
-        {"ip6tables", "-w", "-t", "mangle", "-F", "FAKESIP_S", NULL},
+    res = snprintf(ipt_conf_buff, size, ipt_conf_fmt, "", probe_rule,
+                   inbound_rule, bypass_rules, g_ctx.fwmark, g_ctx.fwmask,
+                   g_ctx.fwmark, g_ctx.fwmask, dports_match, sports_match,
+                   queue_target, iface_rules);
+    if (res < 0 || (size_t) res >= size) {
+        E("ERROR: snprintf(): %s", "failure");
+        goto free_conf_buff;
+    }
 
-        {"ip6tables", "-w", "-t", "mangle", "-F", "FAKESIP_D", NULL},
+    res = ipt6_restore(ipt_conf_buff, 0);
+    if (res < 0) {
+        E(T(ipt6_restore));
+        goto free_conf_buff;
+    }
 
-        {"ip6tables", "-w", "-t", "mangle", "-D", "PREROUTING", "-j",
-         "FAKESIP_S", NULL},
+    ret = 0;
 
-        {"ip6tables", "-w", "-t", "mangle", "-D", "POSTROUTING", "-j",
-         "FAKESIP_D", NULL},
+free_conf_buff:
+    free(ipt_conf_buff);
 
-        {"ip6tables", "-w", "-t", "mangle", "-X", "FAKESIP_R", NULL},
+free_iface_rules:
+    free(iface_rules);
 
-        {"ip6tables", "-w", "-t", "mangle", "-X", "FAKESIP_S", NULL},
+    return ret;
+}
 
-        {"ip6tables", "-w", "-t", "mangle", "-X", "FAKESIP_D", NULL}};
 
-    cnt = sizeof(ipt_cmds) / sizeof(*ipt_cmds);
-    for (i = 0; i < cnt; i++) {
-        fs_execute_command(ipt_cmds[i], 1, NULL);
+void fs_ipt6_cleanup(void)
+{
+    int res;
+    char *ipset_destroy_cmd[] = {"ipset", "destroy", IPT6_BYPASS_SET,
+                                 NULL};
+    char ipt_conf_buff[] = "*mangle\n"
+                           ":FAKESIP_S - [0:0]\n"
+                           ":FAKESIP_D - [0:0]\n"
+                           ":FAKESIP_R - [0:0]\n"
+                           "-D PREROUTING -j FAKESIP_S\n"
+                           "-D POSTROUTING -j FAKESIP_D\n"
+                           "-X FAKESIP_R\n"
+                           "-X FAKESIP_S\n"
+                           "-X FAKESIP_D\n"
+                           "COMMIT\n";
+    char ipt_chains_buff[] = "*mangle\n"
+                             ":FAKESIP_S - [0:0]\n"
+                             ":FAKESIP_D - [0:0]\n"
+                             ":FAKESIP_R - [0:0]\n"
+                             "-X FAKESIP_R\n"
+                             "-X FAKESIP_S\n"
+                             "-X FAKESIP_D\n"
+                             "COMMIT\n";
+
+    res = ipt6_restore(ipt_conf_buff, 1);
+    if (res < 0) {
+        ipt6_restore(ipt_chains_buff, 1);
+    }
+
+    if (g_ctx.bypasspath) {
+        fs_execute_command(ipset_destroy_cmd, 1, NULL);
     }
 }
+
+
+int fs_ipt6_reload(void)
+{
+    int res;
+
+    if (!g_ctx.bypasspath) {
+        return 0;
+    }
+
+    res = ipt6_ipset_update();
+    if (res < 0) {
+        E(T(ipt6_ipset_update));
+        return -1;
+    }
+
+    return 0;
+}
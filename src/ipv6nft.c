@@ -20,156 +20,413 @@
 #define _GNU_SOURCE
 #include "ipv6nft.h"
 
-#include <inttypes.h>
-#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/icmp6.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_conntrack_tuple_common.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter_ipv6.h>
 
+#include "bypass.h"
 #include "globvar.h"
+#include "ifmon.h"
 #include "logging.h"
-#include "process.h"
+#include "nfrules.h"
+#include "nftmsg.h"
 
-static int nft6_iface_setup(void)
+/*
+    Addresses in the bypass set, non-GUA addresses and the -B list, are
+    excluded from source (prerouting) and destination (postrouting).
+*/
+static void nft6_bypass_return(const char *chain, uint32_t offset)
 {
-    char nftstr[120];
-    size_t i;
-    int res;
-    char *nft_iface_cmd[] = {"nft", nftstr, NULL};
+    struct nlattr *exprs;
+    struct nlmsghdr *nlh;
 
-    if (g_ctx.alliface) {
-        res = snprintf(nftstr, sizeof(nftstr),
-                       "add rule ip6 fakesip fs_prerouting jump fs_rules");
-        if (res < 0 || (size_t) res >= sizeof(nftstr)) {
-            E("ERROR: snprintf(): %s", "failure");
-            return -1;
-        }
-        res = fs_execute_command(nft_iface_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
-        }
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, chain, &nlh);
+    fs_nftexpr_payload(nlh, NFT_PAYLOAD_NETWORK_HEADER, offset, 16);
+    fs_nftexpr_lookup(nlh, "fs_bypass", 0);
+    fs_nftexpr_verdict(nlh, NFT_RETURN, NULL);
+    fs_nftmsg_rule_end(nlh, exprs);
+}
 
-        res = snprintf(nftstr, sizeof(nftstr),
-                       "add rule ip6 fakesip fs_postrouting jump fs_rules");
-        if (res < 0 || (size_t) res >= sizeof(nftstr)) {
-            E("ERROR: snprintf(): %s", "failure");
-            return -1;
+
+static void nft6_bypass_elems(void)
+{
+    int j;
+    size_t i, cnt;
+    uint8_t end[16];
+    const struct fs_bypass_range *ranges;
+
+    fs_bypass_ranges(AF_INET6, &ranges, &cnt);
+    for (i = 0; i < cnt; i++) {
+        fs_nftmsg_setelem(NFPROTO_IPV6, "fs_bypass", ranges[i].start, 16, 0);
+
+        memcpy(end, ranges[i].end, sizeof(end));
+        j = 15;
+        while (j >= 0 && !++end[j]) {
+            j--;
         }
-        res = fs_execute_command(nft_iface_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
+        if (j >= 0) {
+            fs_nftmsg_setelem(NFPROTO_IPV6, "fs_bypass", end, 16, 1);
         }
+    }
+}
+
+
+static int nft6_ports_set(const char *name, const char *spec)
+{
+    int res;
+    size_t i;
+    uint16_t port;
+    struct fs_portset ports;
 
-        return 0;
+    res = fs_portset_parse(spec, &ports);
+    if (res < 0) {
+        E("ERROR: invalid port list: %s", spec);
+        return -1;
     }
 
-    for (i = 0; g_ctx.iface[i]; i++) {
-        res = snprintf(nftstr, sizeof(nftstr),
-                       "add rule ip6 fakesip fs_prerouting iifname \"%s\" "
-                       "jump fs_rules",
-                       g_ctx.iface[i]);
-        if (res < 0 || (size_t) res >= sizeof(nftstr)) {
-            E("ERROR: snprintf(): %s", "failure");
-            return -1;
+    fs_nftmsg_set(NFPROTO_IPV6, name, NFT_SET_INTERVAL, FS_NFT_TYPE_INETSRV,
+                  2);
+    for (i = 0; i < ports.cnt; i++) {
+        port = htons(ports.first[i]);
+        fs_nftmsg_setelem(NFPROTO_IPV6, name, &port, 2, 0);
+        if (ports.last[i] != UINT16_MAX) {
+            port = htons(ports.last[i] + 1);
+            fs_nftmsg_setelem(NFPROTO_IPV6, name, &port, 2, 1);
         }
-        res = fs_execute_command(nft_iface_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
+    }
+
+    return ports.invert;
+}
+
+
+/*
+    send to nfqueue: UDP packets within the window of each flow, to and
+    from the selected ports. With -N, the first one tags its flow instead.
+*/
+static int nft6_queue_rule(const char *chain)
+{
+    int dports_inv, sports_inv;
+    uint8_t l4proto;
+    struct nlattr *exprs;
+    struct nlmsghdr *nlh;
+
+    dports_inv = sports_inv = 0;
+
+    if (g_ctx.dports) {
+        dports_inv = nft6_ports_set("fs_dports", g_ctx.dports);
+        if (dports_inv < 0) {
+            E(T(nft6_ports_set));
             return -1;
         }
+    }
 
-        res = snprintf(nftstr, sizeof(nftstr),
-                       "add rule ip6 fakesip fs_postrouting oifname \"%s\" "
-                       "jump fs_rules",
-                       g_ctx.iface[i]);
-        if (res < 0 || (size_t) res >= sizeof(nftstr)) {
-            E("ERROR: snprintf(): %s", "failure");
+    if (g_ctx.sports) {
+        sports_inv = nft6_ports_set("fs_sports", g_ctx.sports);
+        if (sports_inv < 0) {
+            E(T(nft6_ports_set));
             return -1;
         }
-        res = fs_execute_command(nft_iface_cmd, 0, NULL);
-        if (res < 0) {
-            E(T(fs_execute_command));
-            return -1;
+    }
+
+    l4proto = IPPROTO_UDP;
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, chain, &nlh);
+    fs_nftexpr_meta(nlh, NFT_META_L4PROTO);
+    fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &l4proto, 1);
+    if (g_ctx.dports) {
+        fs_nftexpr_payload(nlh, NFT_PAYLOAD_TRANSPORT_HEADER, 2, 2);
+        fs_nftexpr_lookup(nlh, "fs_dports", dports_inv);
+    }
+    if (g_ctx.sports) {
+        fs_nftexpr_payload(nlh, NFT_PAYLOAD_TRANSPORT_HEADER, 0, 2);
+        fs_nftexpr_lookup(nlh, "fs_sports", sports_inv);
+    }
+    if (g_ctx.ctevents) {
+        fs_nftexpr_ctmark(nlh, g_ctx.fwmark, g_ctx.fwmask);
+    } else {
+        if (g_ctx.win_dir == FS_CT_DIR_ORIGINAL) {
+            fs_nftexpr_ctdir(nlh, NFT_CT_PKTS, IP_CT_DIR_ORIGINAL);
+        } else if (g_ctx.win_dir == FS_CT_DIR_REPLY) {
+            fs_nftexpr_ctdir(nlh, NFT_CT_PKTS, IP_CT_DIR_REPLY);
+        } else {
+            fs_nftexpr_ct(nlh, NFT_CT_PKTS);
         }
+        fs_nftexpr_range64(nlh, g_ctx.win_first, g_ctx.win_last);
+        fs_nftexpr_queue(nlh, g_ctx.nfqnum, 1);
     }
+    fs_nftmsg_rule_end(nlh, exprs);
+
     return 0;
 }
 
 
+/*
+    With -U or -C, only the traffic of the sockets in scope is queued. The
+    socket expression is not available at postrouting, so outbound packets
+    are taken at output instead, which only sees local traffic anyway.
+*/
+static int nft6_scoped(void)
+{
+    return g_ctx.uids || g_ctx.cgroups;
+}
+
+
+static const char *nft6_out_chain(void)
+{
+    return nft6_scoped() ? "fs_output" : "fs_postrouting";
+}
+
+
+static void nft6_scope_rules(void)
+{
+    size_t i;
+    const struct fs_scope *scope;
+    struct nlattr *exprs;
+    struct nlmsghdr *nlh;
+
+    scope = fs_nfrules_scope();
+
+    for (i = 0; i < scope->uid_cnt; i++) {
+        exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_scope", &nlh);
+        fs_nftexpr_meta(nlh, NFT_META_SKUID);
+        fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &scope->uid[i],
+                       sizeof(scope->uid[i]));
+        fs_nftexpr_verdict(nlh, NFT_JUMP, "fs_queue");
+        fs_nftmsg_rule_end(nlh, exprs);
+    }
+
+    for (i = 0; i < scope->cgroup_cnt; i++) {
+        exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_scope", &nlh);
+        fs_nftexpr_socket(nlh, NFT_SOCKET_CGROUPV2, scope->cgroup_level[i]);
+        fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &scope->cgroup_id[i],
+                       sizeof(scope->cgroup_id[i]));
+        fs_nftexpr_verdict(nlh, NFT_JUMP, "fs_queue");
+        fs_nftmsg_rule_end(nlh, exprs);
+    }
+}
+
+
+static void nft6_jump_rule(const char *chain, uint32_t key)
+{
+    struct nlattr *exprs;
+    struct nlmsghdr *nlh;
+
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, chain, &nlh);
+    if (key) {
+        fs_nftexpr_meta(nlh, key);
+        fs_nftexpr_lookup(nlh, "fs_ifaces", 0);
+    }
+    fs_nftexpr_verdict(nlh, NFT_JUMP, "fs_rules");
+    fs_nftmsg_rule_end(nlh, exprs);
+}
+
+
+static void nft6_iface_elem(const char *name)
+{
+    char ifname[IFNAMSIZ];
+
+    memset(ifname, 0, sizeof(ifname));
+    snprintf(ifname, sizeof(ifname), "%s", name);
+    fs_nftmsg_setelem(NFPROTO_IPV6, "fs_ifaces", ifname, sizeof(ifname), 0);
+}
+
+
+/*
+    One set holds the names of the interfaces: those given to -i, and the
+    ones currently matching its patterns, which are kept up to date with
+    fs_nft6_iface(). With -R, inbound packets are observed from a ring
+    instead, and nothing jumps from prerouting.
+*/
+static void nft6_iface_setup(void)
+{
+    size_t i, cnt;
+    const struct fs_iflink *links;
+
+    if (g_ctx.alliface) {
+        if (!g_ctx.pktring) {
+            nft6_jump_rule("fs_prerouting", 0);
+        }
+        nft6_jump_rule(nft6_out_chain(), 0);
+        return;
+    }
+
+    fs_nftmsg_set(NFPROTO_IPV6, "fs_ifaces", 0, FS_NFT_TYPE_IFNAME,
+                  IFNAMSIZ);
+    for (i = 0; g_ctx.iface[i]; i++) {
+        if (!fs_ifmon_is_pattern(g_ctx.iface[i])) {
+            nft6_iface_elem(g_ctx.iface[i]);
+        }
+    }
+
+    fs_ifmon_links(&links, &cnt);
+    for (i = 0; i < cnt; i++) {
+        nft6_iface_elem(links[i].name);
+    }
+
+    if (!g_ctx.pktring) {
+        nft6_jump_rule("fs_prerouting", NFT_META_IIFNAME);
+    }
+    nft6_jump_rule(nft6_out_chain(), NFT_META_OIFNAME);
+}
+
+
+/*
+    Appends the ruleset to the pending nf_tables batch, see nftmsg.c. It
+    takes effect with fs_nftmsg_commit(). The table of a previous run, if
+    any, is deleted within the same batch: packets see either the old rules
+    or the new ones, never none.
+*/
 int fs_nft6_setup(void)
 {
     int res;
-    char *nft_cmd[] = {"nft", "-f", "-", NULL};
-    char nft_conf_buff[2048];
-    char *nft_conf_fmt =
-        "table ip6 fakesip {\n"
-        "    chain fs_prerouting {\n"
-        "        type filter hook prerouting priority mangle - 5;\n"
-        "        policy accept;\n"
-        /*
-            drop time-exceeded ICMP packets
-        */
-        "        icmp type time-exceeded counter drop;\n"
-        /*
-            exclude non-GUA IPv6 addresses (from source)
-        */
-        "        ip6 saddr != 2000::/3 return;\n"
-        "    }\n"
-        "\n"
-        "    chain fs_postrouting {\n"
-        "        type filter hook postrouting priority mangle - 5;\n"
-        "        policy accept;\n"
-        /*
-            exclude non-GUA IPv6 addresses (to destination)
-        */
-        "        ip6 daddr != 2000::/3 return;\n"
-        "    }\n"
-        "\n"
-        "    chain fs_rules {\n"
-
-        /*
-            exclude marked packets
-        */
-        "        meta mark and %" PRIu32 " == %" PRIu32 " return;\n"
-
-        /*
-            send to nfqueue
-        */
-        "        meta l4proto udp ct packets 1-5 queue num %" PRIu32
-        " bypass;\n"
-
-        "    }\n"
-        "}\n";
+    uint8_t l4proto, icmp_type;
+    struct nlattr *exprs;
+    struct nlmsghdr *nlh;
 
     fs_nft6_cleanup();
 
-    res = snprintf(nft_conf_buff, sizeof(nft_conf_buff), nft_conf_fmt,
-                   g_ctx.fwmask, g_ctx.fwmark, g_ctx.nfqnum);
-    if (res < 0 || (size_t) res >= sizeof(nft_conf_buff)) {
-        E("ERROR: snprintf(): %s", "failure");
-        return -1;
+    fs_nftmsg_table(NFPROTO_IPV6, 1);
+    fs_nftmsg_chain(NFPROTO_IPV6, "fs_prerouting", NF_INET_PRE_ROUTING,
+                    NF_IP6_PRI_MANGLE - 5);
+    if (nft6_scoped()) {
+        fs_nftmsg_chain(NFPROTO_IPV6, "fs_output", NF_INET_LOCAL_OUT,
+                        NF_IP6_PRI_MANGLE - 5);
+    } else {
+        fs_nftmsg_chain(NFPROTO_IPV6, "fs_postrouting", NF_INET_POST_ROUTING,
+                        NF_IP6_PRI_MANGLE - 5);
+    }
+    fs_nftmsg_chain(NFPROTO_IPV6, "fs_rules", -1, 0);
+    if (nft6_scoped()) {
+        fs_nftmsg_chain(NFPROTO_IPV6, "fs_scope", -1, 0);
+        fs_nftmsg_chain(NFPROTO_IPV6, "fs_queue", -1, 0);
     }
 
-    res = fs_execute_command(nft_cmd, 0, nft_conf_buff);
-    if (res < 0) {
-        E(T(fs_execute_command));
-        return -1;
+    fs_nftmsg_set(NFPROTO_IPV6, "fs_bypass", NFT_SET_INTERVAL,
+                  FS_NFT_TYPE_IP6ADDR, 16);
+    nft6_bypass_elems();
+
+    /*
+        drop time-exceeded ICMP packets
+    */
+    l4proto = IPPROTO_ICMP;
+    icmp_type = ICMP_TIME_EXCEEDED;
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_prerouting", &nlh);
+    fs_nftexpr_meta(nlh, NFT_META_L4PROTO);
+    fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &l4proto, 1);
+    fs_nftexpr_payload(nlh, NFT_PAYLOAD_TRANSPORT_HEADER, 0, 1);
+    fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &icmp_type, 1);
+    fs_nftexpr_counter(nlh);
+    fs_nftexpr_verdict(nlh, NF_DROP, NULL);
+    fs_nftmsg_rule_end(nlh, exprs);
+
+    /*
+        divert time-exceeded ICMPv6 packets to the hop prober
+    */
+    if (g_ctx.probe_rate) {
+        l4proto = IPPROTO_ICMPV6;
+        icmp_type = ICMP6_TIME_EXCEEDED;
+        exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_prerouting", &nlh);
+        fs_nftexpr_meta(nlh, NFT_META_L4PROTO);
+        fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &l4proto, 1);
+        fs_nftexpr_payload(nlh, NFT_PAYLOAD_TRANSPORT_HEADER, 0, 1);
+        fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &icmp_type, 1);
+        fs_nftexpr_counter(nlh);
+        /* no bypass, dropped as without the prober if it is gone */
+        fs_nftexpr_queue(nlh, g_ctx.nfqnum + 1, 0);
+        fs_nftmsg_rule_end(nlh, exprs);
     }
 
-    fs_execute_command(nft_cmd, 0, nft_conf_buff);
+    /*
+        exclude bypassed IPs (from source, then to destination)
+    */
+    nft6_bypass_return("fs_prerouting", 8);
+    nft6_bypass_return(nft6_out_chain(), 24);
+
+    /*
+        exclude marked packets
+    */
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_rules", &nlh);
+    fs_nftexpr_meta(nlh, NFT_META_MARK);
+    fs_nftexpr_bitwise(nlh, &g_ctx.fwmask, sizeof(g_ctx.fwmask));
+    fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &g_ctx.fwmark, sizeof(g_ctx.fwmark));
+    fs_nftexpr_verdict(nlh, NFT_RETURN, NULL);
+    fs_nftmsg_rule_end(nlh, exprs);
 
-    res = nft6_iface_setup();
+    /*
+        exclude connections which have already been treated
+    */
+    exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_rules", &nlh);
+    fs_nftexpr_ct(nlh, NFT_CT_MARK);
+    fs_nftexpr_bitwise(nlh, &g_ctx.fwmask, sizeof(g_ctx.fwmask));
+    fs_nftexpr_cmp(nlh, NFT_CMP_EQ, &g_ctx.fwmark, sizeof(g_ctx.fwmark));
+    fs_nftexpr_verdict(nlh, NFT_RETURN, NULL);
+    fs_nftmsg_rule_end(nlh, exprs);
+
+    if (nft6_scoped()) {
+        exprs = fs_nftmsg_rule_start(NFPROTO_IPV6, "fs_rules", &nlh);
+        fs_nftexpr_verdict(nlh, NFT_JUMP, "fs_scope");
+        fs_nftmsg_rule_end(nlh, exprs);
+
+        nft6_scope_rules();
+
+        res = nft6_queue_rule("fs_queue");
+    } else {
+        res = nft6_queue_rule("fs_rules");
+    }
     if (res < 0) {
-        E(T(nft6_iface_setup));
+        E(T(nft6_queue_rule));
         return -1;
     }
 
+    nft6_iface_setup();
+
     return 0;
 }
 
 
-void fs_nft6_cleanup(void)
+/*
+    Replaces the content of the bypass set, and the rules of the scope,
+    within the pending batch.
+*/
+void fs_nft6_reload(void)
 {
-    char *nft_delete_cmd[] = {"nft", "delete table ip6 fakesip", NULL};
+    fs_nftmsg_setflush(NFPROTO_IPV6, "fs_bypass");
+    nft6_bypass_elems();
 
-    fs_execute_command(nft_delete_cmd, 1, NULL);
+    if (nft6_scoped()) {
+        fs_nftmsg_chainflush(NFPROTO_IPV6, "fs_scope");
+        nft6_scope_rules();
+    }
+}
+
+
+/*
+    Adds or removes one interface of the set, within the pending batch.
+*/
+void fs_nft6_iface(const char *name, int add)
+{
+    char ifname[IFNAMSIZ];
+
+    if (add) {
+        nft6_iface_elem(name);
+        return;
+    }
+
+    memset(ifname, 0, sizeof(ifname));
+    snprintf(ifname, sizeof(ifname), "%s", name);
+    fs_nftmsg_setdel(NFPROTO_IPV6, "fs_ifaces", ifname, sizeof(ifname));
+}
+
+
+void fs_nft6_cleanup(void)
+{
+    fs_nftmsg_table(NFPROTO_IPV6, 0);
 }
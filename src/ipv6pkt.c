@@ -28,8 +28,8 @@
 #include <netinet/udp.h>
 #include <sys/socket.h>
 #include <libnetfilter_queue/libnetfilter_queue_ipv6.h>
-#include <libnetfilter_queue/libnetfilter_queue_udp.h>
 
+#include "checksum.h"
 #include "globvar.h"
 #include "logging.h"
 
@@ -85,9 +85,11 @@ int fs_pkt6_parse(void *pkt_data, int pkt_len, struct sockaddr *saddr,
 int fs_pkt6_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
                  struct sockaddr *daddr, uint8_t ttl, uint16_t sport_be,
                  uint16_t dport_be, uint8_t *udp_payload,
-                 size_t udp_payload_size)
+                 size_t udp_payload_size, uint32_t udp_payload_sum)
 {
     size_t pkt_len;
+    uint16_t csum;
+    uint32_t sum;
     struct ip6_hdr *ip6h;
     struct udphdr *udph;
     uint8_t *udppl;
@@ -130,7 +132,18 @@ int fs_pkt6_make(uint8_t *buffer, size_t buffer_size, struct sockaddr *saddr,
         memcpy(udppl, udp_payload, udp_payload_size);
     }
 
-    nfq_udp_compute_checksum_ipv6(udph, ip6h);
+    /*
+        The sum of the payload is provided by the caller, only the pseudo
+        header and the UDP header are summed here.
+    */
+    sum = udp_payload_sum;
+    sum = fs_csum_partial(sum, 0, (uint8_t *) &ip6h->ip6_src,
+                          sizeof(ip6h->ip6_src) + sizeof(ip6h->ip6_dst));
+    sum += sizeof(*udph) + udp_payload_size;
+    sum += IPPROTO_UDP;
+    sum = fs_csum_partial(sum, 0, (uint8_t *) udph, sizeof(*udph));
+    csum = ~fs_csum_fold(sum);
+    udph->check = csum ? htons(csum) : 0xffff;
 
     return pkt_len;
 }
@@ -26,21 +26,29 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 
+#include "classify.h"
+#include "counters.h"
+#include "ctevent.h"
 #include "globvar.h"
+#include "hopcache.h"
 #include "logging.h"
 #include "nfqueue.h"
 #include "nfrules.h"
 #include "payload.h"
+#include "pktring.h"
+#include "probe.h"
 #include "process.h"
+#include "random.h"
+#include "ratelimit.h"
 #include "rawsend.h"
 #include "signals.h"
 #include "srcinfo.h"
+#include "tcbpf.h"
 
 #ifndef PROGNAME
 #define PROGNAME "fakesip"
@@ -60,8 +68,9 @@ static void print_usage(const char *name)
         "  -i <interface>     work on specified network interface\n"
         "\n"
         "Payload Options:\n"
-        "  -b <file>          use UDP payload from binary file\n"
+        "  -b <file>          use UDP payload from binary file or directory\n"
         "  -u <uri>           use specified SIP URI\n"
+        "  -e <match>         apply next -b/-u to <port>[-<port>][@<prefix>]\n"
         "\n"
         "General Options:\n"
         "  -0                 process inbound packets\n"
@@ -70,20 +79,42 @@ static void print_usage(const char *name)
         "  -6                 process IPv6 connections\n"
         "  -d                 run as a daemon\n"
         "  -k                 kill the running process\n"
+        "  -P                 print the counters of the running process\n"
         "  -s                 enable silent mode\n"
         "  -w <file>          write log to <file> instead of stderr\n"
         "\n"
         "Advanced Options:\n"
+        "  -B <file>          never queue traffic of the prefixes in <file>\n"
+        "  -c <file>          keep the peer cache in <file> across restarts\n"
+        "  -C <cgroups>       only queue traffic of sockets in <cgroups>\n"
+        "  -D <ports>         only queue UDP packets to <ports>\n"
+        "  -E                 inject from a tc-BPF program, without a queue\n"
         "  -f                 skip firewall rules\n"
         "  -g                 disable hop count estimation\n"
+        "  -K                 keep firewall rules in place on exit\n"
+        "  -l <rate>          inject fakes into up to <rate> flows per "
+        "second\n"
+        "  -L <rate>          same as -l, but per /24 (IPv4) or /48 (IPv6) "
+        "prefix\n"
         "  -m <mark>          fwmark for bypassing the queue\n"
         "  -n <number>        netfilter queue number\n"
+        "  -N                 inject on conntrack events, without a queue\n"
+        "  -o <protos>        only inject before handshakes of <protos>\n"
+        "  -p <rate>          probe hops of up to <rate> new destinations per "
+        "second\n"
+        "  -q <pkts>          pass packets untreated while <pkts> are queued\n"
         "  -r <repeat>        duplicate generated packets for <repeat> times\n"
+        "  -R                 observe inbound packets from a ring, not the "
+        "queue\n"
+        "  -S <ports>         only queue UDP packets from <ports>\n"
         "  -t <ttl>           TTL for generated packets\n"
+        "  -U <users>         only queue outbound traffic of <users>\n"
+        "  -W <win>           queue packets <first>-<last>[:<dir>] of each "
+        "flow\n"
         "  -x <mask>          set the mask for fwmark\n"
         "  -y <pct>           raise TTL dynamically to <pct>%% of estimated "
         "hops\n"
-        "  -z                 use iptables commands instead of nft\n"
+        "  -z                 use iptables commands instead of nftables\n"
         "\n"
         "FakeSIP version " VERSION "\n";
 
@@ -91,9 +122,51 @@ static void print_usage(const char *name)
 }
 
 
+/*
+    -W <first>-<last>[:<dir>], where <dir> is original, reply or both.
+*/
+static int parse_window(const char *str)
+{
+    char *end;
+    const char *dir;
+    unsigned long long first, last;
+
+    errno = 0;
+    first = last = strtoull(str, &end, 10);
+    if (*end == '-') {
+        str = end + 1;
+        last = strtoull(str, &end, 10);
+    }
+    if (errno || end == str || !first || last < first || last > 1000) {
+        return -1;
+    }
+
+    g_ctx.win_dir = FS_CT_DIR_BOTH;
+    if (*end == ':') {
+        dir = end + 1;
+        if (strcmp(dir, "original") == 0) {
+            g_ctx.win_dir = FS_CT_DIR_ORIGINAL;
+        } else if (strcmp(dir, "reply") == 0) {
+            g_ctx.win_dir = FS_CT_DIR_REPLY;
+        } else if (strcmp(dir, "both") != 0) {
+            return -1;
+        }
+    } else if (*end) {
+        return -1;
+    }
+
+    g_ctx.win_first = first;
+    g_ctx.win_last = last;
+
+    return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
     unsigned long long tmp;
+    struct fs_portset portset;
+    struct fs_scope scope;
     int res, opt, exitcode;
     size_t plinfo_cap, iface_cap, plinfo_cnt, iface_cnt;
     const char *iface_info, *direction_info, *ipproto_info;
@@ -124,8 +197,9 @@ int main(int argc, char *argv[])
 
     plinfo_cnt = iface_cnt = 0;
 
-    while ((opt = getopt(argc, argv, "0146ab:dfgi:km:n:r:st:u:w:x:y:z")) !=
-           -1) {
+    while ((opt = getopt(argc, argv,
+                         "0146B:C:D:EKL:NPRS:U:W:ab:c:de:fgi:kl:m:n:o:"
+                         "p:q:r:st:u:w:x:y:z")) != -1) {
         switch (opt) {
             case '0':
                 g_ctx.inbound = 1;
@@ -148,6 +222,7 @@ int main(int argc, char *argv[])
                 break;
 
             case 'b':
+            case 'e':
             case 'u':
                 if (!optarg[0]) {
                     fprintf(stderr, "%s: value of -%c cannot be empty.\n",
@@ -170,16 +245,66 @@ int main(int argc, char *argv[])
                     plinfo_cap *= 2;
                 }
 
-                g_ctx.plinfo[plinfo_cnt - 1].type = opt == 'b'
-                                                        ? FS_PAYLOAD_CUSTOM
-                                                        : FS_PAYLOAD_SIP;
+                switch (opt) {
+                    case 'b':
+                        g_ctx.plinfo[plinfo_cnt - 1].type = FS_PAYLOAD_CUSTOM;
+                        break;
+                    case 'e':
+                        g_ctx.plinfo[plinfo_cnt - 1].type = FS_PAYLOAD_MATCH;
+                        break;
+                    default:
+                        g_ctx.plinfo[plinfo_cnt - 1].type = FS_PAYLOAD_SIP;
+                }
                 g_ctx.plinfo[plinfo_cnt - 1].info = optarg;
                 break;
 
+            case 'B':
+                g_ctx.bypasspath = optarg;
+                break;
+
+            case 'C':
+                if (!optarg[0]) {
+                    fprintf(stderr, "%s: invalid value for -C.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.cgroups = optarg;
+                break;
+
+            case 'c':
+                g_ctx.cachepath = optarg;
+                if (strlen(g_ctx.cachepath) > PATH_MAX - 1) {
+                    fprintf(stderr, "%s: path of cache file is too long.\n",
+                            argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                break;
+
             case 'd':
                 g_ctx.daemon = 1;
                 break;
 
+            case 'D':
+            case 'S':
+                res = fs_portset_parse(optarg, &portset);
+                if (res < 0) {
+                    fprintf(stderr, "%s: invalid value for -%c.\n", argv[0],
+                            opt);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                if (opt == 'D') {
+                    g_ctx.dports = optarg;
+                } else {
+                    g_ctx.sports = optarg;
+                }
+                break;
+
+            case 'E':
+                g_ctx.use_bpf = 1;
+                break;
+
             case 'f':
                 g_ctx.skipfw = 1;
                 break;
@@ -224,6 +349,26 @@ int main(int argc, char *argv[])
                 g_ctx.killproc = 1;
                 break;
 
+            case 'K':
+                g_ctx.keeprules = 1;
+                break;
+
+            case 'l':
+            case 'L':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > 1000000) {
+                    fprintf(stderr, "%s: invalid value for -%c.\n", argv[0],
+                            opt);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                if (opt == 'l') {
+                    g_ctx.rate_global = tmp;
+                } else {
+                    g_ctx.rate_prefix = tmp;
+                }
+                break;
+
             case 'm':
                 tmp = strtoull(optarg, NULL, 0);
                 if (!tmp || tmp > UINT32_MAX) {
@@ -236,7 +381,7 @@ int main(int argc, char *argv[])
 
             case 'n':
                 tmp = strtoull(optarg, NULL, 0);
-                if (!tmp || tmp > UINT32_MAX) {
+                if (!tmp || tmp > UINT16_MAX) {
                     fprintf(stderr, "%s: invalid value for -n.\n", argv[0]);
                     print_usage(argv[0]);
                     goto free_mem;
@@ -244,6 +389,38 @@ int main(int argc, char *argv[])
                 g_ctx.nfqnum = tmp;
                 break;
 
+            case 'N':
+                g_ctx.ctevents = 1;
+                break;
+
+            case 'o':
+                g_ctx.protos = optarg;
+                break;
+
+            case 'p':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > 1000) {
+                    fprintf(stderr, "%s: invalid value for -p.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.probe_rate = tmp;
+                break;
+
+            case 'P':
+                g_ctx.showcounters = 1;
+                break;
+
+            case 'q':
+                tmp = strtoull(optarg, NULL, 0);
+                if (!tmp || tmp > UINT32_MAX) {
+                    fprintf(stderr, "%s: invalid value for -q.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.shed_pkts = tmp;
+                break;
+
             case 'r':
                 tmp = strtoull(optarg, NULL, 0);
                 if (!tmp || tmp > 10) {
@@ -254,6 +431,10 @@ int main(int argc, char *argv[])
                 g_ctx.repeat = tmp;
                 break;
 
+            case 'R':
+                g_ctx.pktring = 1;
+                break;
+
             case 's':
                 g_ctx.silent = 1;
                 break;
@@ -278,6 +459,25 @@ int main(int argc, char *argv[])
                 }
                 break;
 
+            case 'U':
+                res = fs_scope_uids(optarg, &scope);
+                if (res < 0) {
+                    fprintf(stderr, "%s: invalid value for -U.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                g_ctx.uids = optarg;
+                break;
+
+            case 'W':
+                res = parse_window(optarg);
+                if (res < 0) {
+                    fprintf(stderr, "%s: invalid value for -W.\n", argv[0]);
+                    print_usage(argv[0]);
+                    goto free_mem;
+                }
+                break;
+
             case 'x':
                 tmp = strtoull(optarg, NULL, 0);
                 if (!tmp || tmp > UINT32_MAX) {
@@ -320,6 +520,18 @@ int main(int argc, char *argv[])
         return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
+    if (g_ctx.showcounters) {
+        res = fs_logger_setup();
+        if (res < 0) {
+            EE(T(fs_logger_setup));
+            goto free_mem;
+        }
+        res = fs_counters_print();
+        fs_logger_cleanup();
+
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     if (!g_ctx.inbound && !g_ctx.outbound) {
         g_ctx.inbound = g_ctx.outbound = 1;
     }
@@ -354,6 +566,54 @@ int main(int argc, char *argv[])
         goto free_mem;
     }
 
+    if ((g_ctx.uids || g_ctx.cgroups) && g_ctx.use_iptables) {
+        fprintf(stderr, "%s: options -C and -U cannot be used with -z.\n",
+                argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
+    if (g_ctx.use_bpf &&
+        (g_ctx.use_iptables || g_ctx.probe_rate || g_ctx.dynamic_pct ||
+         g_ctx.uids || g_ctx.cgroups || g_ctx.dports || g_ctx.sports)) {
+        fprintf(stderr,
+                "%s: option -E cannot be used with -C, -D, -p, -S, -U, -y "
+                "or -z.\n",
+                argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
+    if (g_ctx.ctevents &&
+        (g_ctx.use_bpf || g_ctx.protos || g_ctx.probe_rate ||
+         g_ctx.shed_pkts)) {
+        fprintf(stderr,
+                "%s: option -N cannot be used with -E, -o, -p or -q.\n",
+                argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
+    if (g_ctx.pktring && (g_ctx.use_bpf || g_ctx.ctevents)) {
+        fprintf(stderr, "%s: option -R cannot be used with -E or -N.\n",
+                argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
+    if (g_ctx.probe_rate && g_ctx.nohopest) {
+        fprintf(stderr, "%s: option -p cannot be used with -g.\n", argv[0]);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
+    if (g_ctx.probe_rate && g_ctx.nfqnum >= UINT16_MAX) {
+        fprintf(stderr, "%s: option -p requires -n below %d.\n", argv[0],
+                UINT16_MAX);
+        print_usage(argv[0]);
+        goto free_mem;
+    }
+
     if (g_ctx.daemon) {
         res = daemon(0, 0);
         if (res < 0) {
@@ -367,8 +627,6 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand(time(NULL));
-
     res = fs_logger_setup();
     if (res < 0) {
         EE(T(fs_logger_setup));
@@ -383,10 +641,27 @@ int main(int argc, char *argv[])
     E("Home page: https://github.com/MikeWang000000/FakeSIP");
     E("");
 
+    res = fs_counters_setup();
+    if (res < 0) {
+        EE("WARNING: counters are not available to -P");
+    }
+
+    res = fs_random_setup();
+    if (res < 0) {
+        EE(T(fs_random_setup));
+        goto cleanup_counters;
+    }
+
+    res = fs_classify_setup();
+    if (res < 0) {
+        EE(T(fs_classify_setup));
+        goto cleanup_counters;
+    }
+
     res = fs_payload_setup();
     if (res < 0) {
         EE(T(fs_payload_setup));
-        goto cleanup_logger;
+        goto cleanup_counters;
     }
 
     res = fs_srcinfo_setup();
@@ -395,28 +670,70 @@ int main(int argc, char *argv[])
         goto cleanup_payload;
     }
 
+    res = fs_hopcache_setup();
+    if (res < 0) {
+        EE(T(fs_hopcache_setup));
+        goto cleanup_srcinfo;
+    }
+
+    res = fs_ratelimit_setup();
+    if (res < 0) {
+        EE(T(fs_ratelimit_setup));
+        goto cleanup_hopcache;
+    }
+
     res = fs_rawsend_setup();
     if (res < 0) {
         EE(T(fs_rawsend_setup));
-        goto cleanup_srcinfo;
+        goto cleanup_ratelimit;
     }
 
-    res = fs_nfq_setup();
+    res = fs_probe_setup();
     if (res < 0) {
-        EE(T(fs_nfq_setup));
+        EE(T(fs_probe_setup));
         goto cleanup_rawsend;
     }
 
-    res = fs_nfrules_setup();
-    if (res < 0) {
-        EE(T(fs_nfrules_setup));
-        goto cleanup_nfq;
+    if (g_ctx.use_bpf) {
+        res = fs_tcbpf_setup();
+        if (res < 0) {
+            EE(T(fs_tcbpf_setup));
+            goto cleanup_probe;
+        }
+    } else {
+        if (g_ctx.ctevents) {
+            res = fs_ctevent_setup();
+            if (res < 0) {
+                EE(T(fs_ctevent_setup));
+                goto cleanup_probe;
+            }
+        } else {
+            res = fs_nfq_setup();
+            if (res < 0) {
+                EE(T(fs_nfq_setup));
+                goto cleanup_probe;
+            }
+        }
+
+        if (g_ctx.pktring) {
+            res = fs_pktring_setup();
+            if (res < 0) {
+                EE(T(fs_pktring_setup));
+                goto cleanup_nfq;
+            }
+        }
+
+        res = fs_nfrules_setup();
+        if (res < 0) {
+            EE(T(fs_nfrules_setup));
+            goto cleanup_pktring;
+        }
     }
 
     res = fs_signal_setup();
     if (res < 0) {
         EE(T(fs_signal_setup));
-        goto cleanup_nfrules;
+        goto cleanup_datapath;
     }
 
     res = setpriority(PRIO_PROCESS, getpid(), -20);
@@ -448,37 +765,82 @@ int main(int argc, char *argv[])
         direction_info = "";
     }
 
-    E("listening on %s%s%s, netfilter queue number %" PRIu32 "...", iface_info,
-      ipproto_info, direction_info, g_ctx.nfqnum);
+    if (g_ctx.use_bpf) {
+        E("listening on %s%s%s, tc-BPF datapath...", iface_info,
+          ipproto_info, direction_info);
+    } else if (g_ctx.ctevents) {
+        E("listening on %s%s%s, conntrack events...", iface_info,
+          ipproto_info, direction_info);
+    } else {
+        E("listening on %s%s%s, netfilter queue number %" PRIu32 "%s...",
+          iface_info, ipproto_info, direction_info, g_ctx.nfqnum,
+          g_ctx.pktring ? " and packet ring" : "");
+    }
 
     /*
         Main Loop
     */
-    res = fs_nfq_loop();
-    if (res < 0) {
-        EE(T(fs_nfq_loop));
-        goto cleanup_nfrules;
+    if (g_ctx.use_bpf) {
+        res = fs_tcbpf_loop();
+        if (res < 0) {
+            EE(T(fs_tcbpf_loop));
+            goto cleanup_datapath;
+        }
+    } else if (g_ctx.ctevents) {
+        res = fs_ctevent_loop();
+        if (res < 0) {
+            EE(T(fs_ctevent_loop));
+            goto cleanup_datapath;
+        }
+    } else {
+        res = fs_nfq_loop();
+        if (res < 0) {
+            EE(T(fs_nfq_loop));
+            goto cleanup_datapath;
+        }
     }
 
     E("exiting normally...");
     exitcode = EXIT_SUCCESS;
 
-cleanup_nfrules:
+cleanup_datapath:
+    if (g_ctx.use_bpf) {
+        fs_tcbpf_cleanup();
+        goto cleanup_probe;
+    }
+
     fs_nfrules_cleanup();
 
+cleanup_pktring:
+    fs_pktring_cleanup();
+
 cleanup_nfq:
-    fs_nfq_cleanup();
+    if (g_ctx.ctevents) {
+        fs_ctevent_cleanup();
+    } else {
+        fs_nfq_cleanup();
+    }
+
+cleanup_probe:
+    fs_probe_cleanup();
 
 cleanup_rawsend:
     fs_rawsend_cleanup();
 
+cleanup_ratelimit:
+    fs_ratelimit_cleanup();
+
+cleanup_hopcache:
+    fs_hopcache_cleanup();
+
 cleanup_srcinfo:
     fs_srcinfo_cleanup();
 
 cleanup_payload:
     fs_payload_cleanup();
 
-cleanup_logger:
+cleanup_counters:
+    fs_counters_cleanup();
     fs_logger_cleanup();
 
 free_mem:
@@ -20,10 +20,15 @@
 #define _GNU_SOURCE
 #include "nfqueue.h"
 
+#include <endian.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
@@ -31,49 +36,337 @@
 #include <sys/socket.h>
 #include <linux/if_packet.h>
 #include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
 #include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/sock_diag.h>
+#include <libmnl/libmnl.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
+#include "counters.h"
 #include "globvar.h"
+#include "hopcache.h"
+#include "ifmon.h"
 #include "logging.h"
+#include "nfrules.h"
+#include "payload.h"
+#include "pktring.h"
+#include "probe.h"
+#include "ratelimit.h"
 #include "rawsend.h"
 #include "signals.h"
+#include "srcinfo.h"
 
 static int fd = -1;
+static int ct_enabled = 0;
 static struct nfq_handle *h = NULL;
 static struct nfq_q_handle *qh = NULL;
+static struct nfq_q_handle *probe_qh = NULL;
 
-static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
-                    struct nfq_data *nfa, void *data)
+/*
+    Load shedding (-q): when the kernel queue holds at least g_ctx.shed_pkts
+    packets or the socket receive buffer is half full, new packets get an
+    ACCEPT verdict right away, without parsing or fake injection. The
+    verdict marks their connection as treated, so that a flow shed once
+    never comes back to the queue with its handshake already gone. Normal
+    processing resumes once the backlog drops below a quarter of both
+    thresholds, but not before SHED_HOLD_MS. Packets which waited in the
+    queue for more than SHED_DEADLINE_MS are passed the same way, if the
+    kernel provides their timestamp. Only inbound packets are checked: on
+    the way out, the timestamp may be a delivery time set with SO_TXTIME,
+    on another clock. An age beyond SHED_AGE_MAX_MS is taken as such a
+    foreign timestamp, not as a late packet.
+*/
+
+#define SHED_SAMPLE_MS   50
+#define SHED_HOLD_MS     1000
+#define SHED_DEADLINE_MS 50
+#define SHED_AGE_MAX_MS  5000
+#define SHED_RCVBUF_PCT  50
+
+static int shedding = 0;
+static uint64_t shed_sampled_ms = 0;
+static uint64_t shed_since_ms = 0;
+static uint64_t shed_pkts = 0;
+static uint64_t shed_late_pkts = 0;
+static uint64_t shed_events = 0;
+
+struct ct_info {
+    int available;
+    uint32_t id;
+    uint32_t mark;
+    uint32_t state;
+};
+
+static int ct_attr_cb(const struct nlattr *attr, void *data)
+{
+    struct ct_info *ct;
+
+    ct = data;
+
+    switch (mnl_attr_get_type(attr)) {
+        case CTA_ID:
+            if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
+                return MNL_CB_ERROR;
+            }
+            ct->id = ntohl(mnl_attr_get_u32(attr));
+            break;
+        case CTA_MARK:
+            if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
+                return MNL_CB_ERROR;
+            }
+            ct->mark = ntohl(mnl_attr_get_u32(attr));
+            break;
+        default:
+            break;
+    }
+
+    return MNL_CB_OK;
+}
+
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static long queue_backlog(void)
+{
+    FILE *fp;
+    unsigned long num, portid, total;
+
+    fp = fopen("/proc/net/netfilter/nfnetlink_queue", "r");
+    if (!fp) {
+        return -1;
+    }
+
+    /* queue_number peer_portid queue_total copy_mode ... */
+    while (fscanf(fp, "%lu %lu %lu%*[^\n]", &num, &portid, &total) == 3) {
+        if (num == g_ctx.nfqnum) {
+            fclose(fp);
+            return total;
+        }
+    }
+
+    fclose(fp);
+
+    return -1;
+}
+
+
+static int rcvbuf_usage(void)
+{
+#ifdef SO_MEMINFO
+    int res;
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len;
+
+    len = sizeof(meminfo);
+    res = getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len);
+    if (res < 0 || !meminfo[SK_MEMINFO_RCVBUF]) {
+        return -1;
+    }
+
+    return (uint64_t) meminfo[SK_MEMINFO_RMEM_ALLOC] * 100 /
+           meminfo[SK_MEMINFO_RCVBUF];
+#else
+    return -1;
+#endif
+}
+
+
+static void shed_update(void)
+{
+    long backlog;
+    int usage;
+    uint64_t now;
+
+    now = now_ms();
+    if (now - shed_sampled_ms < SHED_SAMPLE_MS) {
+        return;
+    }
+    shed_sampled_ms = now;
+
+    backlog = queue_backlog();
+    usage = rcvbuf_usage();
+
+    if (!shedding) {
+        if (backlog >= (long) g_ctx.shed_pkts || usage >= SHED_RCVBUF_PCT) {
+            shedding = 1;
+            shed_since_ms = now;
+            shed_events++;
+            E("WARNING: queue backlog %ld, receive buffer %d%% used, "
+              "passing new packets untreated",
+              backlog, usage);
+        }
+    } else if (now - shed_since_ms >= SHED_HOLD_MS &&
+               backlog <= (long) g_ctx.shed_pkts / 4 &&
+               usage <= SHED_RCVBUF_PCT / 4) {
+        shedding = 0;
+        E("queue backlog %ld, receive buffer %d%% used, resuming", backlog,
+          usage);
+    }
+}
+
+
+static int packet_late(struct nlattr *attr)
+{
+    int64_t age_ms;
+    struct timespec ts;
+    struct nfqnl_msg_packet_timestamp *pts;
+
+    if (!attr || mnl_attr_get_payload_len(attr) < sizeof(*pts)) {
+        return 0;
+    }
+
+    pts = mnl_attr_get_payload(attr);
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    age_ms = ((int64_t) ts.tv_sec - (int64_t) be64toh(pts->sec)) * 1000 +
+             ((int64_t) ts.tv_nsec / 1000 - (int64_t) be64toh(pts->usec)) /
+                 1000;
+
+    return age_ms > SHED_DEADLINE_MS && age_ms <= SHED_AGE_MAX_MS;
+}
+
+
+static int send_verdict(uint16_t queue_num, uint32_t pkt_id, int verdict,
+                        int set_ctmark, uint8_t *pkt_data, int pkt_len)
 {
+    static char buff[UINT16_MAX + MNL_SOCKET_BUFFER_SIZE];
+
+    ssize_t nbytes;
+    struct nlmsghdr *nlh;
+    struct nlattr *nest;
+
+    nlh = nfq_nlmsg_put(buff, NFQNL_MSG_VERDICT, queue_num);
+    nfq_nlmsg_verdict_put(nlh, pkt_id, verdict);
+
+    if (pkt_data) {
+        nfq_nlmsg_verdict_put_pkt(nlh, pkt_data, pkt_len);
+    }
+
+    /*
+        Mark the connection as treated, so that the following packets of the
+        same flow are skipped by the firewall rules and never reach the
+        queue again.
+    */
+    if (set_ctmark) {
+        nest = mnl_attr_nest_start(nlh, NFQA_CT);
+        mnl_attr_put_u32(nlh, CTA_MARK, htonl(g_ctx.fwmark));
+        mnl_attr_put_u32(nlh, CTA_MARK_MASK, htonl(g_ctx.fwmask));
+        mnl_attr_nest_end(nlh, nest);
+    }
+
+    nbytes = send(fd, nlh, nlh->nlmsg_len, 0);
+    if (nbytes < 0) {
+        E("ERROR: send(): %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int process_packet(const struct nlmsghdr *nlh)
+{
+    uint16_t queue_num;
     uint32_t pkt_id, iifindex, oifindex;
-    int verdict, pkt_len, modified;
+    int res, verdict, pkt_len, modified, treated;
     struct nfqnl_msg_packet_hdr *ph;
     unsigned char *pkt_data;
     struct nfqnl_msg_packet_hw *hwph;
+    struct nfgenmsg *nfmsg;
+    struct nlattr *attr[NFQA_MAX + 1];
     struct sockaddr_ll sll;
+    struct ct_info ct;
 
-    (void) nfmsg;
-    (void) data;
+    memset(attr, 0, sizeof(attr));
+    res = nfq_nlmsg_parse(nlh, attr);
+    if (res < 0) {
+        EE("ERROR: nfq_nlmsg_parse(): %s", "failure");
+        return MNL_CB_ERROR;
+    }
 
-    ph = nfq_get_msg_packet_hdr(nfa);
-    if (!ph) {
-        EE("ERROR: nfq_get_msg_packet_hdr(): %s", "failure");
-        return -1;
+    nfmsg = mnl_nlmsg_get_payload(nlh);
+    queue_num = ntohs(nfmsg->res_id);
+
+    if (!attr[NFQA_PACKET_HDR]) {
+        EE("ERROR: NFQA_PACKET_HDR: %s", "missing");
+        return MNL_CB_ERROR;
     }
+    ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
 
     pkt_id = ntohl(ph->packet_id);
 
-    iifindex = nfq_get_indev(nfa);
-    oifindex = nfq_get_outdev(nfa);
+    if (g_ctx.shed_pkts && queue_num == g_ctx.nfqnum) {
+        if (shedding) {
+            shed_pkts++;
+            goto ret_shed;
+        }
+        if (!attr[NFQA_IFINDEX_OUTDEV] &&
+            packet_late(attr[NFQA_TIMESTAMP])) {
+            shed_late_pkts++;
+            goto ret_shed;
+        }
+    }
+
+    memset(&ct, 0, sizeof(ct));
+    if (ct_enabled && attr[NFQA_CT]) {
+        res = mnl_attr_parse_nested(attr[NFQA_CT], &ct_attr_cb, &ct);
+        if (res < 0) {
+            EE("ERROR: mnl_attr_parse_nested(): NFQA_CT: %s", "failure");
+            goto ret_accept;
+        }
+        ct.available = 1;
+        if (attr[NFQA_CT_INFO]) {
+            ct.state = ntohl(mnl_attr_get_u32(attr[NFQA_CT_INFO]));
+        }
+    }
 
-    pkt_data = NULL;
-    pkt_len = nfq_get_payload(nfa, &pkt_data);
-    if (pkt_len < 0 || !pkt_data) {
-        EE("ERROR: nfq_get_payload(): %s", "failure");
+    /*
+        Packets which were already queued before the connection was marked
+        as treated.
+    */
+    if (ct.available && (ct.mark & g_ctx.fwmask) == g_ctx.fwmark) {
+        E_INFO("conntrack %" PRIu32 " (state %" PRIu32 ") already treated",
+               ct.id, ct.state);
         goto ret_accept;
     }
 
+    iifindex = attr[NFQA_IFINDEX_INDEV]
+                   ? ntohl(mnl_attr_get_u32(attr[NFQA_IFINDEX_INDEV]))
+                   : 0;
+    oifindex = attr[NFQA_IFINDEX_OUTDEV]
+                   ? ntohl(mnl_attr_get_u32(attr[NFQA_IFINDEX_OUTDEV]))
+                   : 0;
+
+    if (!attr[NFQA_PAYLOAD]) {
+        EE("ERROR: NFQA_PAYLOAD: %s", "missing");
+        goto ret_accept;
+    }
+    pkt_data = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
+    pkt_len = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
+
+    if (queue_num != g_ctx.nfqnum) {
+        /*
+            ICMP time-exceeded packets diverted for the hop prober, which
+            would have been dropped by the firewall rules otherwise.
+        */
+        fs_probe_handle(ntohs(ph->hw_protocol), pkt_data, pkt_len);
+        res = send_verdict(queue_num, pkt_id, NF_DROP, 0, NULL, 0);
+        if (res < 0) {
+            EE(T(send_verdict));
+            return MNL_CB_ERROR;
+        }
+        return MNL_CB_OK;
+    }
+
     memset(&sll, 0, sizeof(sll));
     sll.sll_family = AF_PACKET;
     sll.sll_protocol = ph->hw_protocol;
@@ -88,9 +381,12 @@ static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
         goto ret_accept;
     }
 
+    /* counted here rather than in rawsend.c, which also sees -R packets */
+    FS_COUNT(pkts[!!oifindex][ntohs(ph->hw_protocol) == ETHERTYPE_IPV6]);
+
     /* hwph can be null on PPP interfaces or POSTROUTING packets */
-    hwph = nfq_get_packet_hw(nfa);
-    if (hwph) {
+    if (attr[NFQA_HWADDR]) {
+        hwph = mnl_attr_get_payload(attr[NFQA_HWADDR]);
         sll.sll_halen = sizeof(hwph->hw_addr);
         memcpy(sll.sll_addr, hwph->hw_addr, sizeof(hwph->hw_addr));
     } else {
@@ -98,20 +394,114 @@ static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
         memset(sll.sll_addr, 0, sizeof(sll.sll_addr));
     }
 
-    verdict = fs_rawsend_handle(&sll, pkt_data, pkt_len, &modified);
+    /* replies of a flow treated from its inbound side, see pktring.c */
+    if (oifindex && fs_pktring_treated(ntohs(ph->hw_protocol), pkt_data,
+                                       pkt_len)) {
+        res = send_verdict(queue_num, pkt_id, NF_ACCEPT, ct.available, NULL,
+                           0);
+        if (res < 0) {
+            EE(T(send_verdict));
+            return MNL_CB_ERROR;
+        }
+        return MNL_CB_OK;
+    }
+
+    verdict = fs_rawsend_handle(&sll, pkt_data, pkt_len, &modified, &treated);
     if (verdict < 0) {
         EE(T(fs_rawsend_handle));
         goto ret_accept;
     }
 
-    if (modified && verdict != NF_DROP) {
-        return nfq_set_verdict(qh, pkt_id, verdict, pkt_len, pkt_data);
+    if (oifindex && treated) {
+        fs_pktring_treat(ntohs(ph->hw_protocol), pkt_data, pkt_len);
+    }
+
+    res = send_verdict(queue_num, pkt_id, verdict, ct.available && treated,
+                       modified && verdict != NF_DROP ? pkt_data : NULL,
+                       pkt_len);
+    if (res < 0) {
+        EE(T(send_verdict));
+        return MNL_CB_ERROR;
     }
 
-    return nfq_set_verdict(qh, pkt_id, verdict, 0, NULL);
+    return MNL_CB_OK;
 
 ret_accept:
-    return nfq_set_verdict(qh, pkt_id, NF_ACCEPT, 0, NULL);
+    res = send_verdict(queue_num, pkt_id, NF_ACCEPT, 0, NULL, 0);
+    if (res < 0) {
+        EE(T(send_verdict));
+        return MNL_CB_ERROR;
+    }
+
+    return MNL_CB_OK;
+
+ret_shed:
+    res = send_verdict(queue_num, pkt_id, NF_ACCEPT, ct_enabled, NULL, 0);
+    if (res < 0) {
+        EE(T(send_verdict));
+        return MNL_CB_ERROR;
+    }
+
+    return MNL_CB_OK;
+}
+
+
+/*
+    The verdict latency counted is the time spent on a packet, from parsing
+    it to sending its verdict.
+*/
+static int callback(const struct nlmsghdr *nlh, void *data)
+{
+    int res;
+    struct timespec start;
+
+    (void) data;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = process_packet(nlh);
+    fs_counters_latency(&start);
+
+    return res;
+}
+
+
+static void show_stats(void)
+{
+    size_t peers, lowconf;
+    uint64_t evicted, failed;
+    uint64_t allowed, limited_global, limited_prefix;
+    uint64_t ring_pkts, ring_drops, ring_treated;
+
+    fs_srcinfo_stats(&peers, &lowconf);
+    E("statistics: %zu peers known, %zu with low-confidence hop estimation",
+      peers, lowconf);
+
+    if (!g_ctx.nohopest) {
+        fs_hopcache_stats(&evicted, &failed);
+        E("statistics: %" PRIu64 " prefixes evicted from the hop cache, "
+          "%" PRIu64 " failed inserts", evicted, failed);
+    }
+
+    if (g_ctx.rate_global || g_ctx.rate_prefix) {
+        fs_ratelimit_stats(&allowed, &limited_global, &limited_prefix);
+        E("statistics: %" PRIu64 " flows injected, %" PRIu64
+          " over the global limit, %" PRIu64 " over the prefix limit",
+          allowed, limited_global, limited_prefix);
+    }
+
+    if (g_ctx.shed_pkts) {
+        E("statistics: load shedding %s, entered %" PRIu64 " times, %" PRIu64
+          " packets passed on backlog, %" PRIu64 " on deadline",
+          shedding ? "active" : "inactive", shed_events, shed_pkts,
+          shed_late_pkts);
+    }
+
+    if (g_ctx.pktring) {
+        fs_pktring_stats(&ring_pkts, &ring_drops, &ring_treated);
+        E("statistics: %" PRIu64 " inbound packets from the ring, %" PRIu64
+          " dropped by the kernel, %" PRIu64 " flows treated",
+          ring_pkts, ring_drops, ring_treated);
+    }
 }
 
 
@@ -137,7 +527,11 @@ int fs_nfq_setup(void)
         return -1;
     }
 
-    qh = nfq_create_queue(h, g_ctx.nfqnum, &callback, NULL);
+    /*
+        Packets are parsed by callback() through libmnl, so no libnfnetlink
+        callback is registered here.
+    */
+    qh = nfq_create_queue(h, g_ctx.nfqnum, NULL, NULL);
     if (!qh) {
         switch (errno) {
             case EPERM:
@@ -172,6 +566,34 @@ int fs_nfq_setup(void)
         goto destroy_queue;
     }
 
+    /*
+        Let the kernel attach conntrack information, so that treated flows
+        can be marked in the verdict.
+    */
+    res = nfq_set_queue_flags(qh, NFQA_CFG_F_CONNTRACK, NFQA_CFG_F_CONNTRACK);
+    if (res < 0) {
+        E("WARNING: nfq_set_queue_flags(): NFQA_CFG_F_CONNTRACK: %s",
+          strerror(errno));
+        ct_enabled = 0;
+    } else {
+        ct_enabled = 1;
+    }
+
+    if (g_ctx.probe_rate) {
+        probe_qh = nfq_create_queue(h, g_ctx.nfqnum + 1, NULL, NULL);
+        if (!probe_qh) {
+            E("ERROR: nfq_create_queue(): %s", strerror(errno));
+            goto destroy_queue;
+        }
+
+        res = nfq_set_mode(probe_qh, NFQNL_COPY_PACKET, 0xffff);
+        if (res < 0) {
+            E("ERROR: nfq_set_mode(): NFQNL_COPY_PACKET: %s",
+              strerror(errno));
+            goto destroy_queue;
+        }
+    }
+
     fd = nfq_fd(h);
 
     opt_len = sizeof(opt);
@@ -193,10 +615,16 @@ int fs_nfq_setup(void)
     return 0;
 
 destroy_queue:
+    if (probe_qh) {
+        nfq_destroy_queue(probe_qh);
+        probe_qh = NULL;
+    }
     nfq_destroy_queue(qh);
+    qh = NULL;
 
 close_nfq:
     nfq_close(h);
+    h = NULL;
 
     return -1;
 }
@@ -204,6 +632,11 @@ close_nfq:
 
 void fs_nfq_cleanup(void)
 {
+    if (probe_qh) {
+        nfq_destroy_queue(probe_qh);
+        probe_qh = NULL;
+    }
+
     if (qh) {
         nfq_destroy_queue(qh);
         qh = NULL;
@@ -224,6 +657,7 @@ int fs_nfq_loop(void)
     int res, ret, err_cnt;
     ssize_t recv_len;
     char *buff;
+    struct pollfd pfd[4];
 
     buff = malloc(buffsize);
     if (!buff) {
@@ -240,6 +674,75 @@ int fs_nfq_loop(void)
             goto free_buff;
         }
 
+        if (g_ctx.showstats) {
+            g_ctx.showstats = 0;
+            show_stats();
+        }
+
+        if (g_ctx.reload) {
+            g_ctx.reload = 0;
+            res = fs_nfrules_reload();
+            if (res < 0) {
+                E(T(fs_nfrules_reload));
+            }
+        }
+
+        if (g_ctx.probe_rate) {
+            fs_probe_tick();
+        }
+
+        fs_srcinfo_sync();
+        fs_payload_quiesce();
+
+        /* poll() ignores the entries with a negative fd */
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+
+        /* payload files changed */
+        pfd[1].fd = fs_payload_watchfd();
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        /* interfaces matching -i patterns came or went */
+        pfd[2].fd = fs_ifmon_fd();
+        pfd[2].events = POLLIN;
+        pfd[2].revents = 0;
+
+        /* inbound packets, with -R */
+        pfd[3].fd = fs_pktring_fd();
+        pfd[3].events = POLLIN;
+        pfd[3].revents = 0;
+
+        res = poll(pfd, 4,
+                   g_ctx.probe_rate ? 100 : FS_SRCINFO_SYNC_SEC * 1000);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("ERROR: poll(): %s", strerror(errno));
+            ret = -1;
+            goto free_buff;
+        } else if (!res) {
+            continue;
+        }
+
+        if (pfd[1].revents) {
+            fs_payload_reload();
+        }
+
+        if (pfd[2].revents) {
+            fs_ifmon_update();
+        }
+
+        if (pfd[3].revents) {
+            fs_pktring_recv();
+        }
+
+        if (!pfd[0].revents) {
+            continue;
+        }
+
         recv_len = recv(fd, buff, buffsize, 0);
         if (recv_len < 0) {
             err_cnt++;
@@ -258,10 +761,14 @@ int fs_nfq_loop(void)
             }
         }
 
-        res = nfq_handle_packet(h, buff, recv_len);
+        if (g_ctx.shed_pkts) {
+            shed_update();
+        }
+
+        res = mnl_cb_run(buff, recv_len, 0, 0, &callback, NULL);
         if (res < 0) {
             err_cnt++;
-            E("ERROR: nfq_handle_packet(): %s", "failure");
+            E("ERROR: mnl_cb_run(): %s", strerror(errno));
             continue;
         }
 
@@ -20,21 +20,358 @@
 #define _GNU_SOURCE
 #include "nfrules.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <mntent.h>
+#include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
+#include "bypass.h"
 #include "globvar.h"
+#include "ifmon.h"
 #include "ipv4ipt.h"
 #include "ipv6ipt.h"
 #include "ipv4nft.h"
 #include "ipv6nft.h"
 #include "logging.h"
-#include "process.h"
+#include "nftmsg.h"
 
-static int nft_is_working(void)
+static struct fs_scope scope;
+
+/*
+    Parses a port list such as "5060,10000-20000", or "!53,5353" to match
+    every other port. Ranges are sorted and merged.
+*/
+int fs_portset_parse(const char *spec, struct fs_portset *set)
 {
-    char *nft_ver_cmd[] = {"nft", "--version", NULL};
+    size_t i, j, weight;
+    unsigned long first, last;
+    uint16_t tmp;
+    const char *p;
+    char *end;
+
+    memset(set, 0, sizeof(*set));
+
+    p = spec;
+    if (*p == '!') {
+        set->invert = 1;
+        p++;
+    }
+
+    for (;;) {
+        if (set->cnt >= FS_PORTSET_MAX) {
+            return -1;
+        }
+
+        errno = 0;
+        first = strtoul(p, &end, 10);
+        if (errno || end == p || first > UINT16_MAX) {
+            return -1;
+        }
+        last = first;
+
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (errno || end == p || last > UINT16_MAX || last < first) {
+                return -1;
+            }
+        }
 
-    return !fs_execute_command(nft_ver_cmd, 1, NULL);
+        set->first[set->cnt] = first;
+        set->last[set->cnt] = last;
+        set->cnt++;
+
+        if (!*end) {
+            break;
+        } else if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+
+    /* insertion sort by first port */
+    for (i = 1; i < set->cnt; i++) {
+        for (j = i; j > 0 && set->first[j - 1] > set->first[j]; j--) {
+            tmp = set->first[j];
+            set->first[j] = set->first[j - 1];
+            set->first[j - 1] = tmp;
+            tmp = set->last[j];
+            set->last[j] = set->last[j - 1];
+            set->last[j - 1] = tmp;
+        }
+    }
+
+    /* merge overlapping and adjacent ranges */
+    for (i = 0, j = 1; j < set->cnt; j++) {
+        if ((uint32_t) set->first[j] <= (uint32_t) set->last[i] + 1) {
+            if (set->last[j] > set->last[i]) {
+                set->last[i] = set->last[j];
+            }
+        } else {
+            i++;
+            set->first[i] = set->first[j];
+            set->last[i] = set->last[j];
+        }
+    }
+    set->cnt = i + 1;
+
+    weight = 0;
+    for (i = 0; i < set->cnt; i++) {
+        weight += set->first[i] == set->last[i] ? 1 : 2;
+    }
+    if (weight > FS_PORTSET_MAX) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Renders the ports for iptables multiport, e.g. "5060,10000:20000". The
+    inversion is left to the caller.
+*/
+int fs_portset_multiport(const struct fs_portset *set, char *buff,
+                         size_t size)
+{
+    int res;
+    size_t i, len;
+
+    len = 0;
+    buff[0] = '\0';
+    for (i = 0; i < set->cnt; i++) {
+        if (set->first[i] == set->last[i]) {
+            res = snprintf(buff + len, size - len, "%s%u", i ? "," : "",
+                           set->first[i]);
+        } else {
+            res = snprintf(buff + len, size - len, "%s%u:%u", i ? "," : "",
+                           set->first[i], set->last[i]);
+        }
+        if (res < 0 || (size_t) res >= size - len) {
+            E("ERROR: snprintf(): %s", "failure");
+            return -1;
+        }
+        len += res;
+    }
+
+    return 0;
+}
+
+
+/*
+    Whether a port (in host order) passes the set, for the packets which are
+    filtered outside of the firewall rules.
+*/
+int fs_portset_match(const struct fs_portset *set, uint16_t port)
+{
+    size_t i;
+
+    for (i = 0; i < set->cnt; i++) {
+        if (port >= set->first[i] && port <= set->last[i]) {
+            return !set->invert;
+        }
+    }
+
+    return set->invert;
+}
+
+
+/*
+    Parses a list of users such as "1000,www-data" into their UIDs.
+*/
+int fs_scope_uids(const char *spec, struct fs_scope *scope)
+{
+    size_t len;
+    unsigned long uid;
+    char name[256], *end;
+    const char *p;
+    struct passwd *pw;
+
+    scope->uid_cnt = 0;
+
+    for (p = spec; *p; p += len + (p[len] == ',')) {
+        len = strcspn(p, ",");
+        if (!len || len >= sizeof(name)) {
+            return -1;
+        }
+        if (scope->uid_cnt >= FS_SCOPE_MAX) {
+            return -1;
+        }
+
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        errno = 0;
+        uid = strtoul(name, &end, 10);
+        if (errno || *end || uid > UINT32_MAX - 1) {
+            pw = getpwnam(name);
+            if (!pw) {
+                return -1;
+            }
+            uid = pw->pw_uid;
+        }
+
+        scope->uid[scope->uid_cnt++] = uid;
+    }
+
+    return scope->uid_cnt ? 0 : -1;
+}
+
+
+static int cgroup2_root(char *buff, size_t size)
+{
+    int res, ret;
+    FILE *fp;
+    struct mntent *ent;
+
+    fp = setmntent("/proc/self/mounts", "r");
+    if (!fp) {
+        E("ERROR: setmntent(): %s", strerror(errno));
+        return -1;
+    }
+
+    ret = -1;
+    while ((ent = getmntent(fp))) {
+        if (strcmp(ent->mnt_type, "cgroup2") == 0) {
+            res = snprintf(buff, size, "%s", ent->mnt_dir);
+            if (res < 0 || (size_t) res >= size) {
+                E("ERROR: snprintf(): %s", "failure");
+                break;
+            }
+            ret = 0;
+            break;
+        }
+    }
+
+    endmntent(fp);
+
+    if (ret < 0) {
+        E("ERROR: cgroup v2 is not mounted");
+    }
+
+    return ret;
+}
+
+
+/*
+    Resolves a list of cgroup v2 paths, relative to the root of the
+    hierarchy, such as "system.slice/foo.service,user.slice", into their
+    ids and depths. Cgroups which do not exist (yet) are skipped with a
+    warning: they are looked up again on SIGHUP.
+*/
+static int scope_cgroups(const char *spec, struct fs_scope *scope)
+{
+    int res;
+    size_t len, seg;
+    uint32_t level;
+    char root[PATH_MAX], path[PATH_MAX];
+    const char *p, *q, *entry_end;
+    struct stat st;
+
+    scope->cgroup_cnt = 0;
+
+    res = cgroup2_root(root, sizeof(root));
+    if (res < 0) {
+        E(T(cgroup2_root));
+        return -1;
+    }
+
+    for (p = spec; *p; p = entry_end + (*entry_end == ',')) {
+        entry_end = p + strcspn(p, ",");
+        len = entry_end - p;
+        if (!len) {
+            E("ERROR: invalid cgroup list: %s", spec);
+            return -1;
+        }
+
+        level = 0;
+        for (q = p; q < entry_end; q += seg) {
+            if (*q == '/') {
+                seg = 1;
+                continue;
+            }
+            seg = strcspn(q, "/,");
+            if ((seg == 1 && q[0] == '.') ||
+                (seg == 2 && q[0] == '.' && q[1] == '.')) {
+                E("ERROR: invalid cgroup path: %.*s", (int) len, p);
+                return -1;
+            }
+            level++;
+        }
+        if (!level) {
+            E("ERROR: invalid cgroup path: %.*s", (int) len, p);
+            return -1;
+        }
+
+        res = snprintf(path, sizeof(path), "%s/%.*s", root, (int) len, p);
+        if (res < 0 || (size_t) res >= sizeof(path)) {
+            E("ERROR: snprintf(): %s", "failure");
+            return -1;
+        }
+
+        res = stat(path, &st);
+        if (res < 0 || !S_ISDIR(st.st_mode)) {
+            E("WARNING: cgroup %s is not found, skipped", path);
+            continue;
+        }
+
+        if (scope->cgroup_cnt >= FS_SCOPE_MAX) {
+            E("ERROR: too many cgroups: %s", spec);
+            return -1;
+        }
+
+        /* the id of a cgroup is the inode number of its directory */
+        scope->cgroup_id[scope->cgroup_cnt] = st.st_ino;
+        scope->cgroup_level[scope->cgroup_cnt] = level;
+        scope->cgroup_cnt++;
+    }
+
+    return 0;
+}
+
+
+/*
+    Resolves -U and -C, at setup and again on SIGHUP.
+*/
+static int scope_update(void)
+{
+    int res;
+
+    memset(&scope, 0, sizeof(scope));
+
+    if (g_ctx.uids) {
+        res = fs_scope_uids(g_ctx.uids, &scope);
+        if (res < 0) {
+            E("ERROR: invalid user list: %s", g_ctx.uids);
+            return -1;
+        }
+    }
+
+    if (g_ctx.cgroups) {
+        res = scope_cgroups(g_ctx.cgroups, &scope);
+        if (res < 0) {
+            E(T(scope_cgroups));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+const struct fs_scope *fs_nfrules_scope(void)
+{
+    return &scope;
+}
+
+
+static int nft_is_working(void)
+{
+    return fs_nftmsg_available();
 }
 
 
@@ -47,12 +384,37 @@ int fs_nfrules_setup(void)
         return 0;
     }
 
+    res = fs_bypass_setup();
+    if (res < 0) {
+        E(T(fs_bypass_setup));
+        return -1;
+    }
+
     if (!g_ctx.use_iptables && !nft_is_working()) {
-        E("WARNING: Falling back to iptables command, as nft command is not "
-          "working.");
+        E("WARNING: Falling back to iptables command, as nf_tables is not "
+          "available.");
         g_ctx.use_iptables = 1;
     }
 
+    if (!g_ctx.use_iptables) {
+        res = fs_ifmon_setup();
+        if (res < 0) {
+            E(T(fs_ifmon_setup));
+            return -1;
+        }
+    }
+
+    if (g_ctx.use_iptables && (g_ctx.uids || g_ctx.cgroups)) {
+        E("ERROR: -U and -C require nftables");
+        return -1;
+    }
+
+    res = scope_update();
+    if (res < 0) {
+        E(T(scope_update));
+        return -1;
+    }
+
     if (g_ctx.use_iptables) {
         if (g_ctx.use_ipv4) {
             res = fs_ipt4_setup();
@@ -70,6 +432,15 @@ int fs_nfrules_setup(void)
             }
         }
     } else {
+        /*
+            Both tables are replaced in a single nf_tables transaction.
+        */
+        res = fs_nftmsg_begin();
+        if (res < 0) {
+            E(T(fs_nftmsg_begin));
+            return -1;
+        }
+
         if (g_ctx.use_ipv4) {
             res = fs_nft4_setup();
             if (res < 0) {
@@ -85,19 +456,134 @@ int fs_nfrules_setup(void)
                 return -1;
             }
         }
+
+        res = fs_nftmsg_commit();
+        if (res < 0) {
+            E(T(fs_nftmsg_commit));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Reloads the bypass list into the running rules (SIGHUP), and with
+    nftables the cgroups of -C. Either way, the update is atomic: one
+    nf_tables transaction, or an ipset swap.
+*/
+int fs_nfrules_reload(void)
+{
+    int res;
+
+    if (g_ctx.skipfw) {
+        return 0;
+    }
+
+    res = fs_bypass_reload();
+    if (res < 0) {
+        E(T(fs_bypass_reload));
+        return -1;
+    }
+
+    if (g_ctx.use_iptables) {
+        if (g_ctx.use_ipv4) {
+            res = fs_ipt4_reload();
+            if (res < 0) {
+                E(T(fs_ipt4_reload));
+                return -1;
+            }
+        }
+
+        if (g_ctx.use_ipv6) {
+            res = fs_ipt6_reload();
+            if (res < 0) {
+                E(T(fs_ipt6_reload));
+                return -1;
+            }
+        }
+    } else {
+        res = scope_update();
+        if (res < 0) {
+            E(T(scope_update));
+            return -1;
+        }
+
+        res = fs_nftmsg_begin();
+        if (res < 0) {
+            E(T(fs_nftmsg_begin));
+            return -1;
+        }
+
+        if (g_ctx.use_ipv4) {
+            fs_nft4_reload();
+        }
+
+        if (g_ctx.use_ipv6) {
+            fs_nft6_reload();
+        }
+
+        res = fs_nftmsg_commit();
+        if (res < 0) {
+            E(T(fs_nftmsg_commit));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+    Adds or removes an interface matched by an -i pattern, see ifmon.c.
+*/
+int fs_nfrules_iface(const char *name, int add)
+{
+    int res;
+
+    if (g_ctx.skipfw || g_ctx.use_iptables) {
+        return 0;
+    }
+
+    res = fs_nftmsg_begin();
+    if (res < 0) {
+        E(T(fs_nftmsg_begin));
+        return -1;
+    }
+
+    if (g_ctx.use_ipv4) {
+        fs_nft4_iface(name, add);
+    }
+
+    if (g_ctx.use_ipv6) {
+        fs_nft6_iface(name, add);
+    }
+
+    res = fs_nftmsg_commit();
+    if (res < 0) {
+        E(T(fs_nftmsg_commit));
+        return -1;
     }
 
     return 0;
 }
 
 
+/*
+    With -K, the rules outlive the process. The queue rules are bypassed
+    while nothing is bound to the queue, and the next run replaces them in
+    one transaction, so traffic is never left without rules in between.
+*/
 void fs_nfrules_cleanup(void)
 {
     if (g_ctx.skipfw) {
         return;
     }
 
-    if (g_ctx.use_iptables) {
+    if (g_ctx.keeprules) {
+        E("Keep firewall rules as requested.");
+    } else if (g_ctx.use_iptables) {
         if (g_ctx.use_ipv4) {
             fs_ipt4_cleanup();
         }
@@ -105,7 +591,7 @@ void fs_nfrules_cleanup(void)
         if (g_ctx.use_ipv6) {
             fs_ipt6_cleanup();
         }
-    } else {
+    } else if (fs_nftmsg_begin() == 0) {
         if (g_ctx.use_ipv4) {
             fs_nft4_cleanup();
         }
@@ -113,5 +599,10 @@ void fs_nfrules_cleanup(void)
         if (g_ctx.use_ipv6) {
             fs_nft6_cleanup();
         }
+
+        fs_nftmsg_commit();
     }
+
+    fs_ifmon_cleanup();
+    fs_bypass_cleanup();
 }
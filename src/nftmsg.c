@@ -0,0 +1,738 @@
+/*
+ * nftmsg.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "nftmsg.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <libmnl/libmnl.h>
+
+#include "logging.h"
+
+/*
+    Firewall rules are programmed through nf_tables netlink directly. All
+    messages are collected into one batch between fs_nftmsg_begin() and
+    fs_nftmsg_commit(), which the kernel applies as a single transaction:
+    either the whole ruleset is in place or nothing changed.
+
+    The batch buffer grows as needed, so every message is started with at
+    least MSG_ROOM bytes available. No single message comes close to it:
+    set elements are split over as many messages as needed.
+
+    Messages are not flagged with NLM_F_ACK, so that large batches do not
+    flood the receive buffer. The kernel reports errors regardless.
+*/
+
+#define TABLE_NAME "fakesip"
+#define MSG_ROOM   4096
+#define ELEM_MAX   64
+
+static struct mnl_socket *nl = NULL;
+static uint8_t *batch = NULL;
+static size_t batch_cap = 0;
+static size_t batch_len = 0;
+static size_t cur_off = 0;
+static int cur_open = 0;
+static uint32_t seq = 0;
+static int batch_oom = 0;
+static uint8_t elem_family = 0;
+static const char *elem_set = NULL;
+static struct nlattr *elem_list = NULL;
+
+static struct nlmsghdr *msg_put(uint16_t type, uint8_t family, uint16_t res,
+                                uint16_t flags)
+{
+    size_t cap;
+    uint8_t *buf;
+    struct nlmsghdr *nlh;
+    struct nfgenmsg *nfg;
+
+    if (cur_open) {
+        nlh = (struct nlmsghdr *) (batch + cur_off);
+        if (elem_list) {
+            mnl_attr_nest_end(nlh, elem_list);
+            elem_list = NULL;
+        }
+        batch_len = cur_off + MNL_ALIGN(nlh->nlmsg_len);
+        cur_open = 0;
+    }
+
+    if (batch_cap - batch_len < MSG_ROOM) {
+        cap = batch_cap ? 2 * batch_cap : 4 * MSG_ROOM;
+        buf = realloc(batch, cap);
+        if (!buf) {
+            return NULL;
+        }
+        batch = buf;
+        batch_cap = cap;
+    }
+
+    cur_off = batch_len;
+    cur_open = 1;
+    memset(batch + cur_off, 0, MSG_ROOM);
+
+    nlh = mnl_nlmsg_put_header(batch + cur_off);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = ++seq;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(res);
+
+    return nlh;
+}
+
+
+static struct nlmsghdr *nft_put(uint16_t type, uint8_t family, uint16_t flags)
+{
+    struct nlmsghdr *nlh;
+    static uint8_t scratch[MSG_ROOM];
+
+    nlh = msg_put((NFNL_SUBSYS_NFTABLES << 8) | type, family, 0, flags);
+    if (!nlh) {
+        /*
+            Out of memory. Keep building into a scratch message, the batch
+            is refused by fs_nftmsg_commit().
+        */
+        batch_oom = 1;
+        elem_list = NULL;
+        memset(scratch, 0, sizeof(scratch));
+        nlh = mnl_nlmsg_put_header(scratch);
+        mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    }
+
+    return nlh;
+}
+
+
+static int open_socket(void)
+{
+    int res;
+
+    nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!nl) {
+        E("ERROR: mnl_socket_open(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID);
+    if (res < 0) {
+        E("ERROR: mnl_socket_bind(): %s", strerror(errno));
+        mnl_socket_close(nl);
+        nl = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void close_socket(void)
+{
+    if (nl) {
+        mnl_socket_close(nl);
+        nl = NULL;
+    }
+}
+
+
+static void free_batch(void)
+{
+    free(batch);
+    batch = NULL;
+    batch_cap = batch_len = cur_off = 0;
+    cur_open = batch_oom = 0;
+    elem_list = NULL;
+}
+
+
+/*
+    Collect the replies to everything sent so far. nfnetlink handles
+    requests synchronously, so all of them are queued once send returns.
+    Returns the first error reported by the kernel as a negative errno.
+*/
+static int read_replies(void)
+{
+    int res, err;
+    ssize_t recv_len;
+    static uint8_t buff[MNL_SOCKET_BUFFER_SIZE];
+
+    err = 0;
+    for (;;) {
+        recv_len = recv(mnl_socket_get_fd(nl), buff, sizeof(buff),
+                        MSG_DONTWAIT);
+        if (recv_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            E("ERROR: recv(): %s", strerror(errno));
+            return -errno;
+        }
+
+        res = mnl_cb_run(buff, recv_len, 0, mnl_socket_get_portid(nl), NULL,
+                         NULL);
+        if (res < 0 && !err) {
+            err = errno ? -errno : -EINVAL;
+        }
+    }
+
+    return err;
+}
+
+
+int fs_nftmsg_available(void)
+{
+    int res;
+    ssize_t nbytes;
+    struct nlmsghdr *nlh;
+
+    res = open_socket();
+    if (res < 0) {
+        E(T(open_socket));
+        return 0;
+    }
+
+    free_batch();
+    nlh = nft_put(NFT_MSG_GETGEN, AF_UNSPEC, 0);
+    if (batch_oom) {
+        E("ERROR: realloc(): %s", strerror(ENOMEM));
+        res = -1;
+        goto cleanup;
+    }
+
+    nbytes = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+    if (nbytes < 0) {
+        E("ERROR: mnl_socket_sendto(): %s", strerror(errno));
+        res = -1;
+        goto cleanup;
+    }
+
+    res = read_replies();
+
+cleanup:
+    free_batch();
+    close_socket();
+
+    return res == 0;
+}
+
+
+int fs_nftmsg_begin(void)
+{
+    struct nlmsghdr *nlh;
+
+    free_batch();
+    nlh = msg_put(NFNL_MSG_BATCH_BEGIN, AF_UNSPEC, NFNL_SUBSYS_NFTABLES, 0);
+    if (!nlh) {
+        E("ERROR: realloc(): %s", strerror(ENOMEM));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int fs_nftmsg_commit(void)
+{
+    int res, sndbuf;
+    ssize_t nbytes;
+    struct nlmsghdr *nlh;
+
+    nlh = msg_put(NFNL_MSG_BATCH_END, AF_UNSPEC, NFNL_SUBSYS_NFTABLES, 0);
+    if (!nlh || batch_oom) {
+        E("ERROR: realloc(): %s", strerror(ENOMEM));
+        res = -1;
+        goto cleanup_batch;
+    }
+    batch_len = cur_off + MNL_ALIGN(nlh->nlmsg_len);
+    cur_open = 0;
+
+    res = open_socket();
+    if (res < 0) {
+        E(T(open_socket));
+        goto cleanup_batch;
+    }
+
+    if (batch_len > MNL_SOCKET_BUFFER_SIZE) {
+        /* beyond net.core.wmem_max if needed */
+        sndbuf = batch_len;
+        res = setsockopt(mnl_socket_get_fd(nl), SOL_SOCKET, SO_SNDBUFFORCE,
+                         &sndbuf, sizeof(sndbuf));
+        if (res < 0) {
+            setsockopt(mnl_socket_get_fd(nl), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                       sizeof(sndbuf));
+        }
+    }
+
+    nbytes = mnl_socket_sendto(nl, batch, batch_len);
+    if (nbytes < 0) {
+        E("ERROR: mnl_socket_sendto(): %s", strerror(errno));
+        res = -1;
+        goto cleanup_socket;
+    }
+
+    res = read_replies();
+    if (res < 0) {
+        E("ERROR: nf_tables transaction: %s", strerror(-res));
+        res = -1;
+        goto cleanup_socket;
+    }
+
+    res = 0;
+
+cleanup_socket:
+    close_socket();
+
+cleanup_batch:
+    free_batch();
+
+    return res;
+}
+
+
+/*
+    Adding an existing table is not an error, so "add, then delete" removes
+    the table whether it existed or not. With create set, it is added again
+    afterwards, empty.
+*/
+void fs_nftmsg_table(uint8_t family, int create)
+{
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_NEWTABLE, family, NLM_F_CREATE);
+    mnl_attr_put_strz(nlh, NFTA_TABLE_NAME, TABLE_NAME);
+
+    nlh = nft_put(NFT_MSG_DELTABLE, family, 0);
+    mnl_attr_put_strz(nlh, NFTA_TABLE_NAME, TABLE_NAME);
+
+    if (create) {
+        nlh = nft_put(NFT_MSG_NEWTABLE, family, NLM_F_CREATE);
+        mnl_attr_put_strz(nlh, NFTA_TABLE_NAME, TABLE_NAME);
+    }
+}
+
+
+/*
+    A negative hooknum adds a regular chain, to be jumped to.
+*/
+void fs_nftmsg_chain(uint8_t family, const char *name, int hooknum,
+                     int priority)
+{
+    struct nlattr *nest;
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_NEWCHAIN, family, NLM_F_CREATE);
+    mnl_attr_put_strz(nlh, NFTA_CHAIN_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(nlh, NFTA_CHAIN_NAME, name);
+
+    if (hooknum >= 0) {
+        nest = mnl_attr_nest_start(nlh, NFTA_CHAIN_HOOK);
+        mnl_attr_put_u32(nlh, NFTA_HOOK_HOOKNUM, htonl(hooknum));
+        mnl_attr_put_u32(nlh, NFTA_HOOK_PRIORITY, htonl(priority));
+        mnl_attr_nest_end(nlh, nest);
+
+        mnl_attr_put_u32(nlh, NFTA_CHAIN_POLICY, htonl(NF_ACCEPT));
+        mnl_attr_put_strz(nlh, NFTA_CHAIN_TYPE, "filter");
+    }
+}
+
+
+static void data_put(struct nlmsghdr *nlh, uint16_t type, const void *data,
+                     size_t len)
+{
+    struct nlattr *nest;
+
+    nest = mnl_attr_nest_start(nlh, type);
+    mnl_attr_put(nlh, NFTA_DATA_VALUE, len, data);
+    mnl_attr_nest_end(nlh, nest);
+}
+
+
+/*
+    An interval set of addresses, of key_len bytes. The key type is the
+    one known to nft, so that the ruleset can be listed as usual.
+*/
+void fs_nftmsg_set(uint8_t family, const char *name, uint32_t flags,
+                   uint32_t key_type, uint32_t key_len)
+{
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_NEWSET, family, NLM_F_CREATE);
+    mnl_attr_put_strz(nlh, NFTA_SET_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(nlh, NFTA_SET_NAME, name);
+    mnl_attr_put_u32(nlh, NFTA_SET_FLAGS, htonl(flags));
+    mnl_attr_put_u32(nlh, NFTA_SET_KEY_TYPE, htonl(key_type));
+    mnl_attr_put_u32(nlh, NFTA_SET_KEY_LEN, htonl(key_len));
+    mnl_attr_put_u32(nlh, NFTA_SET_ID, htonl(seq));
+}
+
+
+void fs_nftmsg_setflush(uint8_t family, const char *name)
+{
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_DELSETELEM, family, 0);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, name);
+}
+
+
+/*
+    Consecutive elements of the same set share a message, up to ELEM_MAX.
+    Intervals are given as their start, and the address following their
+    end flagged with end.
+*/
+void fs_nftmsg_setelem(uint8_t family, const char *name, const void *key,
+                       size_t len, int end)
+{
+    struct nlattr *elem;
+    struct nlmsghdr *nlh;
+    static size_t elem_cnt = 0;
+
+    nlh = (struct nlmsghdr *) (batch + cur_off);
+    if (!elem_list || elem_family != family || strcmp(elem_set, name) != 0 ||
+        elem_cnt >= ELEM_MAX) {
+        nlh = nft_put(NFT_MSG_NEWSETELEM, family, NLM_F_CREATE);
+        mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME);
+        mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, name);
+        if (batch_oom) {
+            return;
+        }
+        elem_list = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+        elem_family = family;
+        elem_set = name;
+        elem_cnt = 0;
+    }
+
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    data_put(nlh, NFTA_SET_ELEM_KEY, key, len);
+    if (end) {
+        mnl_attr_put_u32(nlh, NFTA_SET_ELEM_FLAGS,
+                         htonl(NFT_SET_ELEM_INTERVAL_END));
+    }
+    mnl_attr_nest_end(nlh, elem);
+    elem_cnt++;
+}
+
+
+/*
+    Removes a single element, which must be in the set: otherwise the whole
+    batch is refused.
+*/
+void fs_nftmsg_setdel(uint8_t family, const char *name, const void *key,
+                      size_t len)
+{
+    struct nlattr *list, *elem;
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_DELSETELEM, family, 0);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, name);
+    list = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    data_put(nlh, NFTA_SET_ELEM_KEY, key, len);
+    mnl_attr_nest_end(nlh, elem);
+    mnl_attr_nest_end(nlh, list);
+}
+
+
+/*
+    Deletes all the rules of a chain, to be filled again.
+*/
+void fs_nftmsg_chainflush(uint8_t family, const char *name)
+{
+    struct nlmsghdr *nlh;
+
+    nlh = nft_put(NFT_MSG_DELRULE, family, 0);
+    mnl_attr_put_strz(nlh, NFTA_RULE_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(nlh, NFTA_RULE_CHAIN, name);
+}
+
+
+struct nlattr *fs_nftmsg_rule_start(uint8_t family, const char *chain,
+                                    struct nlmsghdr **nlh)
+{
+    *nlh = nft_put(NFT_MSG_NEWRULE, family, NLM_F_CREATE | NLM_F_APPEND);
+    mnl_attr_put_strz(*nlh, NFTA_RULE_TABLE, TABLE_NAME);
+    mnl_attr_put_strz(*nlh, NFTA_RULE_CHAIN, chain);
+
+    return mnl_attr_nest_start(*nlh, NFTA_RULE_EXPRESSIONS);
+}
+
+
+void fs_nftmsg_rule_end(struct nlmsghdr *nlh, struct nlattr *exprs)
+{
+    mnl_attr_nest_end(nlh, exprs);
+}
+
+
+static struct nlattr *expr_start(struct nlmsghdr *nlh, const char *name,
+                                 struct nlattr **data)
+{
+    struct nlattr *elem;
+
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, name);
+    *data = mnl_attr_nest_start(nlh, NFTA_EXPR_DATA);
+
+    return elem;
+}
+
+
+static void expr_end(struct nlmsghdr *nlh, struct nlattr *elem,
+                     struct nlattr *data)
+{
+    mnl_attr_nest_end(nlh, data);
+    mnl_attr_nest_end(nlh, elem);
+}
+
+
+/*
+    All expressions below load into, or compare against, register 1.
+*/
+void fs_nftexpr_payload(struct nlmsghdr *nlh, uint32_t base, uint32_t offset,
+                        uint32_t len)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "payload", &data);
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_BASE, htonl(base));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_OFFSET, htonl(offset));
+    mnl_attr_put_u32(nlh, NFTA_PAYLOAD_LEN, htonl(len));
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_meta(struct nlmsghdr *nlh, uint32_t key)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "meta", &data);
+    mnl_attr_put_u32(nlh, NFTA_META_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_META_KEY, htonl(key));
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_ct(struct nlmsghdr *nlh, uint32_t key)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "ct", &data);
+    mnl_attr_put_u32(nlh, NFTA_CT_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_CT_KEY, htonl(key));
+    expr_end(nlh, elem, data);
+}
+
+
+/*
+    Like fs_nftexpr_ct(), for keys counted per direction, such as
+    NFT_CT_PKTS. dir is IP_CT_DIR_ORIGINAL or IP_CT_DIR_REPLY.
+*/
+void fs_nftexpr_ctdir(struct nlmsghdr *nlh, uint32_t key, uint8_t dir)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "ct", &data);
+    mnl_attr_put_u32(nlh, NFTA_CT_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_CT_KEY, htonl(key));
+    mnl_attr_put_u8(nlh, NFTA_CT_DIRECTION, dir);
+    expr_end(nlh, elem, data);
+}
+
+
+/*
+    Sets the bits of mask in the ct mark to those of mark, like the
+    CTA_MARK/CTA_MARK_MASK pair of a queue verdict.
+*/
+void fs_nftexpr_ctmark(struct nlmsghdr *nlh, uint32_t mark, uint32_t mask)
+{
+    struct nlattr *elem, *data;
+
+    mask = ~mask;
+
+    fs_nftexpr_ct(nlh, NFT_CT_MARK);
+
+    elem = expr_start(nlh, "bitwise", &data);
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_LEN, htonl(sizeof(mask)));
+    data_put(nlh, NFTA_BITWISE_MASK, &mask, sizeof(mask));
+    data_put(nlh, NFTA_BITWISE_XOR, &mark, sizeof(mark));
+    expr_end(nlh, elem, data);
+
+    elem = expr_start(nlh, "ct", &data);
+    mnl_attr_put_u32(nlh, NFTA_CT_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_CT_KEY, htonl(NFT_CT_MARK));
+    expr_end(nlh, elem, data);
+}
+
+
+/*
+    Looks up the socket of the packet, such as NFT_SOCKET_CGROUPV2 with the
+    ancestor at level (0 is the root cgroup) for its 64-bit id.
+*/
+void fs_nftexpr_socket(struct nlmsghdr *nlh, uint32_t key, uint32_t level)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "socket", &data);
+    mnl_attr_put_u32(nlh, NFTA_SOCKET_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_SOCKET_KEY, htonl(key));
+    if (key == NFT_SOCKET_CGROUPV2) {
+        mnl_attr_put_u32(nlh, NFTA_SOCKET_LEVEL, htonl(level));
+    }
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_bitwise(struct nlmsghdr *nlh, const void *mask, size_t len)
+{
+    struct nlattr *elem, *data;
+    static const uint8_t zero[NFT_REG_SIZE];
+
+    elem = expr_start(nlh, "bitwise", &data);
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BITWISE_LEN, htonl(len));
+    data_put(nlh, NFTA_BITWISE_MASK, mask, len);
+    data_put(nlh, NFTA_BITWISE_XOR, zero, len);
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_cmp(struct nlmsghdr *nlh, uint32_t op, const void *value,
+                    size_t len)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "cmp", &data);
+    mnl_attr_put_u32(nlh, NFTA_CMP_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_CMP_OP, htonl(op));
+    data_put(nlh, NFTA_CMP_DATA, value, len);
+    expr_end(nlh, elem, data);
+}
+
+
+/*
+    Match a 64-bit host order value, such as a ct counter, against an
+    inclusive range. Ranges compare in network order, so swap it first.
+*/
+void fs_nftexpr_range64(struct nlmsghdr *nlh, uint64_t from, uint64_t to)
+{
+    uint64_t from_be, to_be;
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "byteorder", &data);
+    mnl_attr_put_u32(nlh, NFTA_BYTEORDER_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BYTEORDER_DREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_BYTEORDER_OP, htonl(NFT_BYTEORDER_HTON));
+    mnl_attr_put_u32(nlh, NFTA_BYTEORDER_LEN, htonl(sizeof(uint64_t)));
+    mnl_attr_put_u32(nlh, NFTA_BYTEORDER_SIZE, htonl(sizeof(uint64_t)));
+    expr_end(nlh, elem, data);
+
+    from_be = htobe64(from);
+    to_be = htobe64(to);
+
+    elem = expr_start(nlh, "range", &data);
+    mnl_attr_put_u32(nlh, NFTA_RANGE_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_u32(nlh, NFTA_RANGE_OP, htonl(NFT_RANGE_EQ));
+    data_put(nlh, NFTA_RANGE_FROM_DATA, &from_be, sizeof(from_be));
+    data_put(nlh, NFTA_RANGE_TO_DATA, &to_be, sizeof(to_be));
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_lookup(struct nlmsghdr *nlh, const char *set, int invert)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "lookup", &data);
+    mnl_attr_put_u32(nlh, NFTA_LOOKUP_SREG, htonl(NFT_REG_1));
+    mnl_attr_put_strz(nlh, NFTA_LOOKUP_SET, set);
+    if (invert) {
+        mnl_attr_put_u32(nlh, NFTA_LOOKUP_FLAGS, htonl(NFT_LOOKUP_F_INV));
+    }
+    expr_end(nlh, elem, data);
+}
+
+
+void fs_nftexpr_counter(struct nlmsghdr *nlh)
+{
+    struct nlattr *elem;
+
+    elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+    mnl_attr_put_strz(nlh, NFTA_EXPR_NAME, "counter");
+    mnl_attr_nest_end(nlh, elem);
+}
+
+
+/*
+    Verdicts: NF_ACCEPT, NF_DROP, NFT_RETURN, or NFT_JUMP to chain.
+*/
+void fs_nftexpr_verdict(struct nlmsghdr *nlh, int code, const char *chain)
+{
+    struct nlattr *elem, *data, *imm, *verdict;
+
+    elem = expr_start(nlh, "immediate", &data);
+    mnl_attr_put_u32(nlh, NFTA_IMMEDIATE_DREG, htonl(NFT_REG_VERDICT));
+    imm = mnl_attr_nest_start(nlh, NFTA_IMMEDIATE_DATA);
+    verdict = mnl_attr_nest_start(nlh, NFTA_DATA_VERDICT);
+    mnl_attr_put_u32(nlh, NFTA_VERDICT_CODE, htonl(code));
+    if (chain) {
+        mnl_attr_put_strz(nlh, NFTA_VERDICT_CHAIN, chain);
+    }
+    mnl_attr_nest_end(nlh, verdict);
+    mnl_attr_nest_end(nlh, imm);
+    expr_end(nlh, elem, data);
+}
+
+
+/*
+    With bypass, packets are accepted while no process listens on the queue,
+    otherwise they are dropped.
+*/
+void fs_nftexpr_queue(struct nlmsghdr *nlh, uint16_t num, int bypass)
+{
+    struct nlattr *elem, *data;
+
+    elem = expr_start(nlh, "queue", &data);
+    mnl_attr_put_u16(nlh, NFTA_QUEUE_NUM, htons(num));
+    mnl_attr_put_u16(nlh, NFTA_QUEUE_TOTAL, htons(1));
+    if (bypass) {
+        mnl_attr_put_u16(nlh, NFTA_QUEUE_FLAGS, htons(NFT_QUEUE_FLAG_BYPASS));
+    }
+    expr_end(nlh, elem, data);
+}
@@ -20,30 +20,94 @@
 #define _GNU_SOURCE
 #include "payload.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
+#include "checksum.h"
 #include "logging.h"
 #include "globvar.h"
+#include "random.h"
 
-#define BUFFLEN 1200
 #define SET_BE16(a, u16)         \
     do {                         \
         (a)[0] = (u16) >> (8);   \
         (a)[1] = (u16) & (0xff); \
     } while (0)
 
+/*
+    SIP payloads are built once as templates. The fields which identify a
+    message (branch, tag, Call-ID, SDP session, example addresses) are
+    written as runs of placeholder bytes of fixed width, then recorded as
+    slots and zeroed. th_payload_get() copies the template and fills the
+    slots with fresh random values, so that every packet is unique while
+    the length never changes. The checksum of the template is computed once
+    and only the slots are added per packet.
+*/
+
+#define MAX_SLOTS  32
+#define POOL_ALIGN 64
+#define MAX_RULES  32
+#define MAX_GROUPS (MAX_RULES + 1)
+#define TRIE_ROOT4 0
+#define TRIE_ROOT6 1
+
+/* placeholder bytes, never valid in a SIP URI */
+#define SLOT_HEX    '\1' /* 16 hex digits */
+#define SLOT_DEC    '\2' /* 10 decimal digits */
+#define SLOT_LOCAL  '\3' /* last octet of the local example address */
+#define SLOT_REMOTE '\4' /* last octet of the remote example address */
+
+#define HEX_PH    "\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1"
+#define DEC_PH    "\2\2\2\2\2\2\2\2\2\2"
+#define LOCAL_PH  "198.51.100.\3\3\3"
+#define REMOTE_PH "sip:user@203.0.113.\4\4\4"
+
+struct payload_slot {
+    uint16_t offset;
+    uint8_t type;
+    uint8_t width;
+};
+
+/*
+    A payload set stores all payloads in one contiguous pool, each node
+    aligned to a cache line and starting with the fields read per packet.
+    Every thread rotates through the pool with its own cursor.
+
+    Payload files (-b) are watched with inotify. On change, a new set is
+    built by fs_payload_reload() and published with an atomic pointer
+    swap. Readers only use a set within a single call of th_payload_get(),
+    so the previous set is put on a retired list, which is freed by
+    fs_payload_quiesce() once the loop is between two packets again.
+
+    Every -e starts a group of payloads, used for flows whose peer matches
+    its port range and prefix. Payloads given before any -e form the default
+    group 0. Rule i (group i + 1) is bit i of a mask: port_groups[] holds
+    the rules matching each port, a binary trie holds the rules matching
+    each prefix. The lowest bit set in both masks selects the group.
+*/
+
 struct payload_node {
-    uint8_t payload[BUFFLEN];
     size_t payload_len;
-    struct payload_node *next;
-};
+    uint32_t payload_sum;
+    size_t nslots;
+    struct payload_slot slots[MAX_SLOTS];
+    uint8_t payload[FS_PAYLOAD_MAX];
+} __attribute__((aligned(POOL_ALIGN)));
 
 static const char *sdp_fmt = "v=0\r\n"
-                             "o=Admin %lu %lu IN IP4 %s\r\n"
+                             "o=Admin %s %s IN IP4 %s\r\n"
                              "s=-\r\n"
                              "c=IN IP4 %s\r\n"
                              "t=0 0\r\n"
@@ -51,10 +115,10 @@ static const char *sdp_fmt = "v=0\r\n"
                              "a=rtpmap:0 PCMU/8000\r\n";
 
 static const char *sip_fmt = "INVITE %s SIP/2.0\r\n"
-                             "Via: SIP/2.0/UDP %s;branch=%lx\r\n"
-                             "From: <sip:%s>;tag=%lx\r\n"
+                             "Via: SIP/2.0/UDP %s;branch=%s\r\n"
+                             "From: <sip:%s>;tag=%s\r\n"
                              "To: \"%s\" <%s>\r\n"
-                             "Call-ID: %lx@%s\r\n"
+                             "Call-ID: %s@%s\r\n"
                              "CSeq: 1 INVITE\r\n"
                              "Contact: <sip:%s>\r\n"
                              "Content-Type: application/sdp\r\n"
@@ -62,17 +126,45 @@ static const char *sip_fmt = "INVITE %s SIP/2.0\r\n"
                              "\r\n"
                              "%s";
 
-static struct payload_node *current_node;
+struct payload_group {
+    size_t start;
+    size_t cnt;
+};
+
+struct payload_set {
+    struct payload_set *next; /* on the retired list */
+    size_t cnt;
+    size_t cap;
+    struct payload_node *nodes;
+    struct payload_group groups[MAX_GROUPS];
+};
+
+struct trie_node {
+    uint32_t child[2];
+    uint32_t rules;
+};
+
+struct payload_watch {
+    int wd;
+    char *name; /* NULL to match every file in the directory */
+};
+
+static struct payload_set *current_set = NULL;
+static struct payload_set *retired_set = NULL;
+static __thread size_t pool_cursor[MAX_GROUPS];
+static size_t rule_cnt = 0;
+static uint32_t *port_rules = NULL;
+static size_t trie_cnt = 0;
+static struct trie_node *trie = NULL;
+static int inotify_fd = -1;
+static size_t watch_cnt = 0;
+static struct payload_watch *watches = NULL;
 
 static int make_sip_invite(uint8_t *buffer, size_t *len, char *sip_uri)
 {
-    int i, len_, buffsize;
-    char sip_uri_random[64], local[64], sdp_buf[180], *username;
-    unsigned long rand_ul[5], content_length;
-
-    for (i = 0; i < 5; i++) {
-        rand_ul[i] = rand() * (ULONG_MAX / RAND_MAX);
-    }
+    int len_, buffsize;
+    char sdp_buf[180], *username, *p;
+    unsigned long content_length;
 
     if (sip_uri) {
         if (strncmp("sip:", sip_uri, 4) != 0) {
@@ -80,25 +172,19 @@ static int make_sip_invite(uint8_t *buffer, size_t *len, char *sip_uri)
               sip_uri);
             return -1;
         }
-    } else {
-        len_ = snprintf(sip_uri_random, sizeof(sip_uri_random),
-                        "sip:user@203.0.113.%d", rand() % UINT8_MAX);
-        if (len_ < 0 || (size_t) len_ >= sizeof(sip_uri_random)) {
-            E("ERROR: snprintf(): %s", "failure");
-            return -1;
+        for (p = sip_uri; *p; p++) {
+            if ((unsigned char) *p < 0x20) {
+                E("ERROR: Invalid SIP URI (control character): %s", sip_uri);
+                return -1;
+            }
         }
-        sip_uri = sip_uri_random;
+    } else {
+        sip_uri = REMOTE_PH;
     }
     username = sip_uri + 4;
 
-    len_ = snprintf(local, sizeof(local), "198.51.100.%d", rand() % UINT8_MAX);
-    if (len_ < 0 || (size_t) len_ >= sizeof(local)) {
-        E("ERROR: snprintf(): %s", "failure");
-        return -1;
-    }
-
-    len_ = snprintf(sdp_buf, sizeof(sdp_buf), sdp_fmt, rand_ul[0] & UINT32_MAX,
-                    rand_ul[1] & UINT32_MAX, local, local);
+    len_ = snprintf(sdp_buf, sizeof(sdp_buf), sdp_fmt, DEC_PH, DEC_PH,
+                    LOCAL_PH, LOCAL_PH);
     if (len_ < 0 || (size_t) len_ >= sizeof(sdp_buf)) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
@@ -107,9 +193,9 @@ static int make_sip_invite(uint8_t *buffer, size_t *len, char *sip_uri)
     content_length = len_;
 
     buffsize = *len;
-    len_ = snprintf((char *) buffer, buffsize, sip_fmt, sip_uri, local,
-                    rand_ul[2], local, rand_ul[3], username, sip_uri,
-                    rand_ul[4], local, local, content_length, sdp_buf);
+    len_ = snprintf((char *) buffer, buffsize, sip_fmt, sip_uri, LOCAL_PH,
+                    HEX_PH, LOCAL_PH, HEX_PH, username, sip_uri, HEX_PH,
+                    LOCAL_PH, LOCAL_PH, content_length, sdp_buf);
     if (len_ < 0) {
         E("ERROR: snprintf(): %s", "failure");
         return -1;
@@ -124,105 +210,710 @@ static int make_sip_invite(uint8_t *buffer, size_t *len, char *sip_uri)
 }
 
 
-static int make_custom(uint8_t *buffer, size_t *len, char *filepath)
+static int compile_slots(struct payload_node *node)
+{
+    size_t i, j;
+    uint8_t type;
+
+    node->nslots = 0;
+
+    for (i = 0; i < node->payload_len; i = j) {
+        type = node->payload[i];
+        for (j = i; j < node->payload_len && node->payload[j] == type; j++) {
+            /* find the end of the run */
+        }
+
+        if (type < SLOT_HEX || type > SLOT_REMOTE) {
+            continue;
+        }
+
+        if (node->nslots >= MAX_SLOTS) {
+            E("ERROR: Too many slots in the template");
+            return -1;
+        }
+
+        node->slots[node->nslots].offset = i;
+        node->slots[node->nslots].type = type;
+        node->slots[node->nslots].width = j - i;
+        node->nslots++;
+
+        memset(&node->payload[i], 0, j - i);
+    }
+
+    return 0;
+}
+
+
+static void fill_octet(uint8_t *p, int octet)
 {
-    int res, len_, buffsize;
-    FILE *fp;
+    p[0] = '0' + octet / 100;
+    p[1] = '0' + octet / 10 % 10;
+    p[2] = '0' + octet % 10;
+}
+
+
+static void fill_slot(uint8_t *p, struct payload_slot *slot, int local,
+                      int remote)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    int i;
+    uint64_t r;
+
+    switch (slot->type) {
+        case SLOT_HEX:
+            r = fs_random_u64();
+            for (i = 0; i < slot->width; i++) {
+                p[i] = hex[r & 0xf];
+                r >>= 4;
+            }
+            break;
+
+        case SLOT_DEC:
+            r = fs_random_u64();
+            p[0] = '1' + r % 9;
+            r /= 9;
+            for (i = 1; i < slot->width; i++) {
+                p[i] = '0' + r % 10;
+                r /= 10;
+            }
+            break;
+
+        case SLOT_LOCAL:
+            fill_octet(p, local);
+            break;
+
+        case SLOT_REMOTE:
+            fill_octet(p, remote);
+            break;
+    }
+}
+
+
+/*
+    The file is read rather than mapped: a writer may truncate it at any
+    time, and touching a mapped page past the new end raises SIGBUS.
+*/
+static int make_custom(uint8_t *buffer, size_t *len, const char *filepath)
+{
+    int fd;
+    size_t len_;
+    ssize_t nbytes;
+    uint8_t extra;
+
+    fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        E("ERROR: open(): %s: %s", filepath, strerror(errno));
+        return -1;
+    }
 
     len_ = 0;
-    buffsize = *len;
+    while (len_ < *len) {
+        nbytes = read(fd, buffer + len_, *len - len_);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("ERROR: read(): %s: %s", filepath, strerror(errno));
+            goto close_file;
+        } else if (!nbytes) {
+            break;
+        }
+        len_ += nbytes;
+    }
+
+    if (len_ == *len) {
+        do {
+            nbytes = read(fd, &extra, 1);
+        } while (nbytes < 0 && errno == EINTR);
+        if (nbytes < 0) {
+            E("ERROR: read(): %s: %s", filepath, strerror(errno));
+            goto close_file;
+        } else if (nbytes) {
+            E("ERROR: %s: Data too long. Maximum length is %zu", filepath,
+              *len);
+            goto close_file;
+        }
+    }
 
-    fp = fopen(filepath, "rb");
-    if (!fp) {
-        E("ERROR: fopen(): %s: %s", filepath, strerror(errno));
+    /* most likely caught in the middle of being rewritten */
+    if (!len_) {
+        E("ERROR: %s: %s", filepath, "empty file");
+        goto close_file;
+    }
+
+    close(fd);
+
+    *len = len_;
+
+    return 0;
+
+close_file:
+    close(fd);
+
+    return -1;
+}
+
+
+static int parse_match(const char *str, unsigned long *port_lo,
+                       unsigned long *port_hi, int *family, uint8_t addr[16],
+                       unsigned long *prefix_len)
+{
+    char buff[INET6_ADDRSTRLEN + 8], *end, *slash;
+    const char *at;
+    size_t len;
+
+    *port_lo = 0;
+    *port_hi = UINT16_MAX;
+    *family = 0;
+    *prefix_len = 0;
+    memset(addr, 0, 16);
+
+    at = strchr(str, '@');
+    len = at ? (size_t) (at - str) : strlen(str);
+
+    if (len) {
+        *port_lo = strtoul(str, &end, 10);
+        *port_hi = *port_lo;
+        if (*end == '-') {
+            *port_hi = strtoul(end + 1, &end, 10);
+        }
+        if (end != str + len || *port_lo > *port_hi ||
+            *port_hi > UINT16_MAX) {
+            return -1;
+        }
+    }
+
+    if (!at) {
+        return 0;
+    }
+
+    if (strlen(at + 1) >= sizeof(buff)) {
         return -1;
     }
+    strcpy(buff, at + 1);
 
-    while (!feof(fp) && !ferror(fp) && len_ < buffsize) {
-        len_ += fread(buffer + len_, 1, buffsize - len_, fp);
+    slash = strchr(buff, '/');
+    if (slash) {
+        *slash = '\0';
     }
 
-    if (ferror(fp)) {
-        E("ERROR: fread(): %s: %s", filepath, "failure");
-        fclose(fp);
+    if (inet_pton(AF_INET, buff, addr) == 1) {
+        *family = AF_INET;
+        *prefix_len = 32;
+    } else if (inet_pton(AF_INET6, buff, addr) == 1) {
+        *family = AF_INET6;
+        *prefix_len = 128;
+    } else {
         return -1;
     }
 
-    if (!feof(fp)) {
-        E("ERROR: %s: Data too long. Maximum length is %d", filepath,
-          buffsize);
-        fclose(fp);
+    if (slash) {
+        len = *prefix_len;
+        *prefix_len = strtoul(slash + 1, &end, 10);
+        if (!slash[1] || *end || *prefix_len > len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void trie_insert(uint32_t root, uint8_t addr[16],
+                        unsigned long prefix_len, uint32_t rule_bit)
+{
+    unsigned long i;
+    uint32_t node;
+    int bit;
+
+    node = root;
+    for (i = 0; i < prefix_len; i++) {
+        bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+        if (!trie[node].child[bit]) {
+            trie[node].child[bit] = trie_cnt++;
+        }
+        node = trie[node].child[bit];
+    }
+
+    trie[node].rules |= rule_bit;
+}
+
+
+static int match_setup(void)
+{
+    int res, family;
+    size_t trie_cap;
+    unsigned long port, port_lo, port_hi, prefix_len;
+    uint8_t addr[16];
+    uint32_t rule_bit;
+    struct payload_info *pinfo;
+
+    rule_cnt = 0;
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        if (pinfo->type == FS_PAYLOAD_MATCH) {
+            rule_cnt++;
+        }
+    }
+
+    if (!rule_cnt) {
+        return 0;
+    }
+
+    if (rule_cnt > MAX_RULES) {
+        E("ERROR: Too many -e options. Maximum is %d", MAX_RULES);
         return -1;
     }
 
-    res = fclose(fp);
-    if (res < 0) {
-        E("ERROR: fclose(): %s", strerror(errno));
+    port_rules = calloc(UINT16_MAX + 1, sizeof(*port_rules));
+    if (!port_rules) {
+        E("ERROR: calloc(): %s", strerror(errno));
         return -1;
     }
 
-    *len = len_;
+    /* two roots plus at most one node per prefix bit */
+    trie_cap = 2 + rule_cnt * 128;
+    trie = calloc(trie_cap, sizeof(*trie));
+    if (!trie) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+    trie_cnt = 2;
+
+    rule_bit = 1;
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        if (pinfo->type != FS_PAYLOAD_MATCH) {
+            continue;
+        }
+
+        res = parse_match(pinfo->info, &port_lo, &port_hi, &family, addr,
+                          &prefix_len);
+        if (res < 0) {
+            E("ERROR: Invalid match (should be <port>[-<port>][@<prefix>]): "
+              "%s",
+              pinfo->info);
+            return -1;
+        }
+
+        for (port = port_lo; port <= port_hi; port++) {
+            port_rules[port] |= rule_bit;
+        }
+
+        if (family != AF_INET6) {
+            trie_insert(TRIE_ROOT4, addr, family ? prefix_len : 0,
+                        rule_bit);
+        }
+        if (family != AF_INET) {
+            trie_insert(TRIE_ROOT6, addr, family ? prefix_len : 0,
+                        rule_bit);
+        }
+
+        rule_bit <<= 1;
+    }
 
     return 0;
 }
 
 
-int fs_payload_setup(void)
+static void match_cleanup(void)
+{
+    free(port_rules);
+    port_rules = NULL;
+
+    free(trie);
+    trie = NULL;
+
+    rule_cnt = trie_cnt = 0;
+}
+
+
+static size_t match_group(struct sockaddr *peer, uint16_t port)
+{
+    size_t i, bits;
+    uint8_t *addr;
+    uint32_t rules, prefix_rules, node;
+
+    if (!rule_cnt) {
+        return 0;
+    }
+
+    rules = port_rules[port];
+    if (!rules) {
+        return 0;
+    }
+
+    if (peer->sa_family == AF_INET) {
+        addr = (uint8_t *) &((struct sockaddr_in *) peer)->sin_addr;
+        bits = 32;
+        node = TRIE_ROOT4;
+    } else {
+        addr = (uint8_t *) &((struct sockaddr_in6 *) peer)->sin6_addr;
+        bits = 128;
+        node = TRIE_ROOT6;
+    }
+
+    prefix_rules = trie[node].rules;
+    for (i = 0; i < bits; i++) {
+        node = trie[node].child[(addr[i / 8] >> (7 - i % 8)) & 1];
+        if (!node) {
+            break;
+        }
+        prefix_rules |= trie[node].rules;
+    }
+
+    rules &= prefix_rules;
+    if (!rules) {
+        return 0;
+    }
+
+    return __builtin_ctz(rules) + 1;
+}
+
+
+static void set_free(struct payload_set *set)
+{
+    if (set) {
+        free(set->nodes);
+        free(set);
+    }
+}
+
+
+static struct payload_node *set_add(struct payload_set *set)
+{
+    int res;
+    size_t cap;
+    struct payload_node *nodes;
+
+    if (set->cnt >= set->cap) {
+        cap = set->cap ? 2 * set->cap : 4;
+        res = posix_memalign((void **) &nodes, POOL_ALIGN,
+                             cap * sizeof(*nodes));
+        if (res) {
+            E("ERROR: posix_memalign(): %s", strerror(res));
+            return NULL;
+        }
+        if (set->cnt) {
+            memcpy(nodes, set->nodes, set->cnt * sizeof(*nodes));
+        }
+        free(set->nodes);
+        set->nodes = nodes;
+        set->cap = cap;
+    }
+
+    return &set->nodes[set->cnt++];
+}
+
+
+static int add_custom(struct payload_set *set, const char *filepath)
 {
     int res;
     size_t len;
-    struct payload_info *pinfo;
-    struct payload_node *node, *next;
+    struct payload_node *node;
 
-    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
-        node = malloc(sizeof(*node));
-        if (!node) {
-            E("ERROR: malloc(): %s", strerror(errno));
-            goto cleanup;
+    node = set_add(set);
+    if (!node) {
+        E(T(set_add));
+        return -1;
+    }
+
+    node->nslots = 0;
+    len = sizeof(node->payload);
+    res = make_custom(node->payload, &len, filepath);
+    if (res < 0) {
+        E(T(make_custom));
+        return -1;
+    }
+    node->payload_len = len;
+
+    return 0;
+}
+
+
+static int add_custom_dir(struct payload_set *set, const char *dirpath)
+{
+    int i, n, res, ret;
+    char filepath[PATH_MAX];
+    struct dirent **list;
+    struct stat st;
+
+    n = scandir(dirpath, &list, NULL, alphasort);
+    if (n < 0) {
+        E("ERROR: scandir(): %s: %s", dirpath, strerror(errno));
+        return -1;
+    }
+
+    ret = 0;
+    for (i = 0; i < n; i++) {
+        if (ret < 0 || list[i]->d_name[0] == '.') {
+            continue;
         }
 
-        if (current_node) {
-            next = current_node->next;
-            current_node->next = node;
-            node->next = next;
-        } else {
-            current_node = node;
-            node->next = node;
+        res = snprintf(filepath, sizeof(filepath), "%s/%s", dirpath,
+                       list[i]->d_name);
+        if (res < 0 || (size_t) res >= sizeof(filepath)) {
+            E("ERROR: snprintf(): %s", "failure");
+            ret = -1;
+            continue;
+        }
+
+        res = stat(filepath, &st);
+        if (res < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        res = add_custom(set, filepath);
+        if (res < 0) {
+            E(T(add_custom));
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        free(list[i]);
+    }
+    free(list);
+
+    return ret;
+}
+
+
+static int add_sip(struct payload_set *set, char *sip_uri)
+{
+    int res;
+    size_t len;
+    struct payload_node *node;
+
+    node = set_add(set);
+    if (!node) {
+        E(T(set_add));
+        return -1;
+    }
+
+    len = sizeof(node->payload);
+    res = make_sip_invite(node->payload, &len, sip_uri);
+    if (res < 0) {
+        E(T(make_sip_invite));
+        return -1;
+    }
+    node->payload_len = len;
+
+    res = compile_slots(node);
+    if (res < 0) {
+        E(T(compile_slots));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static struct payload_set *build_set(void)
+{
+    int res;
+    size_t g;
+    const char *match;
+    struct stat st;
+    struct payload_info *pinfo;
+    struct payload_node *node;
+    struct payload_set *set;
+
+    set = calloc(1, sizeof(*set));
+    if (!set) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return NULL;
+    }
+
+    g = 0;
+    match = NULL;
+
+    for (pinfo = g_ctx.plinfo;; pinfo++) {
+        if (!pinfo->type || pinfo->type == FS_PAYLOAD_MATCH) {
+            /* close the current group */
+            set->groups[g].cnt = set->cnt - set->groups[g].start;
+            if (match && !set->groups[g].cnt) {
+                E("ERROR: No payload is available for -e %s", match);
+                goto free_set;
+            }
+
+            if (!pinfo->type) {
+                break;
+            }
+
+            g++;
+            set->groups[g].start = set->cnt;
+            match = pinfo->info;
+            continue;
         }
 
         switch (pinfo->type) {
             case FS_PAYLOAD_CUSTOM:
-                len = sizeof(node->payload);
-                res = make_custom(node->payload, &len, pinfo->info);
-                if (res < 0) {
-                    E(T(make_custom));
-                    goto cleanup;
+                res = stat(pinfo->info, &st);
+                if (res == 0 && S_ISDIR(st.st_mode)) {
+                    res = add_custom_dir(set, pinfo->info);
+                    if (res < 0) {
+                        E(T(add_custom_dir));
+                        goto free_set;
+                    }
+                } else {
+                    res = add_custom(set, pinfo->info);
+                    if (res < 0) {
+                        E(T(add_custom));
+                        goto free_set;
+                    }
                 }
-                node->payload_len = len;
                 break;
 
             case FS_PAYLOAD_SIP:
-                len = sizeof(node->payload);
-                res = make_sip_invite(node->payload, &len, pinfo->info);
+                res = add_sip(set, pinfo->info);
                 if (res < 0) {
-                    E(T(make_sip_invite));
-                    goto cleanup;
+                    E(T(add_sip));
+                    goto free_set;
                 }
-                node->payload_len = len;
                 break;
 
             default:
                 E("ERROR: Unknown payload type");
-                goto cleanup;
+                goto free_set;
+        }
+    }
+
+    /* flows matching no -e get a random SIP payload by default */
+    if (!set->groups[0].cnt) {
+        set->groups[0].start = set->cnt;
+        res = add_sip(set, NULL);
+        if (res < 0) {
+            E(T(add_sip));
+            goto free_set;
+        }
+        set->groups[0].cnt = 1;
+    }
+
+    for (node = set->nodes; node < set->nodes + set->cnt; node++) {
+        node->payload_sum = fs_csum_partial(0, 0, node->payload,
+                                            node->payload_len);
+    }
+
+    return set;
+
+free_set:
+    set_free(set);
+
+    return NULL;
+}
+
+
+static int watch_setup(void)
+{
+    int wd;
+    size_t cnt;
+    char dirpath[PATH_MAX], *slash;
+    struct stat st;
+    struct payload_info *pinfo;
+    struct payload_watch *watch;
+
+    cnt = 0;
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        cnt++;
+    }
+
+    watches = calloc(cnt, sizeof(*watches));
+    if (!watches) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        E("ERROR: inotify_init1(): %s", strerror(errno));
+        return -1;
+    }
+
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        if (pinfo->type != FS_PAYLOAD_CUSTOM) {
+            continue;
         }
+
+        watch = &watches[watch_cnt];
+
+        /*
+            Files are usually replaced rather than rewritten, so watch the
+            directory which contains them. Only complete files trigger a
+            rebuild: closed after writing, or moved in. A file just created
+            may still be empty.
+        */
+        if (stat(pinfo->info, &st) == 0 && S_ISDIR(st.st_mode)) {
+            snprintf(dirpath, sizeof(dirpath), "%s", pinfo->info);
+            watch->name = NULL;
+        } else {
+            slash = strrchr(pinfo->info, '/');
+            if (slash) {
+                snprintf(dirpath, sizeof(dirpath), "%.*s",
+                         (int) (slash - pinfo->info + 1), pinfo->info);
+                watch->name = slash + 1;
+            } else {
+                snprintf(dirpath, sizeof(dirpath), ".");
+                watch->name = pinfo->info;
+            }
+        }
+
+        wd = inotify_add_watch(inotify_fd, dirpath,
+                               IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            E("ERROR: inotify_add_watch(): %s: %s", dirpath,
+              strerror(errno));
+            return -1;
+        }
+
+        watch->wd = wd;
+        watch_cnt++;
     }
 
-    if (!current_node) {
-        E("ERROR: No payload is available");
+    return 0;
+}
+
+
+static void watch_cleanup(void)
+{
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    free(watches);
+    watches = NULL;
+    watch_cnt = 0;
+}
+
+
+int fs_payload_setup(void)
+{
+    int res;
+    struct payload_info *pinfo;
+
+    res = match_setup();
+    if (res < 0) {
+        E(T(match_setup));
         goto cleanup;
     }
 
-    current_node = current_node->next;
+    current_set = build_set();
+    if (!current_set) {
+        E(T(build_set));
+        goto cleanup;
+    }
+
+    for (pinfo = g_ctx.plinfo; pinfo->type; pinfo++) {
+        if (pinfo->type == FS_PAYLOAD_CUSTOM) {
+            res = watch_setup();
+            if (res < 0) {
+                E(T(watch_setup));
+                E("WARNING: payload files will not be reloaded");
+                watch_cleanup();
+            }
+            break;
+        }
+    }
 
     return 0;
 
@@ -235,23 +926,129 @@ cleanup:
 
 void fs_payload_cleanup(void)
 {
-    struct payload_node *node, *next_node;
+    watch_cleanup();
+    match_cleanup();
+
+    set_free(current_set);
+    current_set = NULL;
 
-    node = current_node;
-    while (node) {
-        next_node = node->next;
-        free(node);
-        if (next_node == current_node) {
+    fs_payload_quiesce();
+}
+
+
+int fs_payload_watchfd(void)
+{
+    return inotify_fd;
+}
+
+
+void fs_payload_reload(void)
+{
+    char buff[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    size_t i;
+    int changed;
+    ssize_t nbytes;
+    struct inotify_event *ev;
+    struct payload_set *set;
+    char *p;
+
+    if (inotify_fd < 0) {
+        return;
+    }
+
+    changed = 0;
+    for (;;) {
+        nbytes = read(inotify_fd, buff, sizeof(buff));
+        if (nbytes <= 0) {
             break;
         }
-        node = next_node;
+
+        for (p = buff; p < buff + nbytes; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+                continue;
+            }
+            for (i = 0; i < watch_cnt; i++) {
+                if (watches[i].wd == ev->wd &&
+                    (!watches[i].name ||
+                     (ev->len && strcmp(ev->name, watches[i].name) == 0))) {
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    set = build_set();
+    if (!set) {
+        E(T(build_set));
+        E("WARNING: failed to reload payloads, keeping the previous ones");
+        return;
     }
+
+    set = __atomic_exchange_n(&current_set, set, __ATOMIC_ACQ_REL);
+    set->next = retired_set;
+    retired_set = set;
+
+    E("reloaded %zu payloads", current_set->cnt);
 }
 
 
-void th_payload_get(uint8_t **payload_ptr, size_t *payload_len)
+/*
+    Called by the loops where no th_payload_get() is running, which is a
+    quiescent point for the sets retired before.
+*/
+void fs_payload_quiesce(void)
 {
-    *payload_ptr = current_node->payload;
-    *payload_len = current_node->payload_len;
-    current_node = current_node->next;
+    struct payload_set *set;
+
+    while (retired_set) {
+        set = retired_set;
+        retired_set = set->next;
+        set_free(set);
+    }
+}
+
+
+void th_payload_get(struct sockaddr *peer, uint16_t port, uint8_t *buffer,
+                    size_t *payload_len, uint32_t *payload_sum)
+{
+    size_t i, g;
+    int local, remote;
+    uint32_t sum;
+    struct payload_set *set;
+    struct payload_group *group;
+    struct payload_node *node;
+    struct payload_slot *slot;
+
+    set = __atomic_load_n(&current_set, __ATOMIC_ACQUIRE);
+
+    g = match_group(peer, port);
+    group = &set->groups[g];
+
+    if (pool_cursor[g] >= group->cnt) {
+        pool_cursor[g] = 0;
+    }
+    node = &set->nodes[group->start + pool_cursor[g]++];
+
+    memcpy(buffer, node->payload, node->payload_len);
+    sum = node->payload_sum;
+
+    local = 100 + fs_random_range(155);
+    remote = 100 + fs_random_range(155);
+
+    for (i = 0; i < node->nslots; i++) {
+        slot = &node->slots[i];
+        fill_slot(buffer + slot->offset, slot, local, remote);
+        sum = fs_csum_partial(sum, slot->offset, buffer + slot->offset,
+                              slot->width);
+    }
+
+    *payload_len = node->payload_len;
+    *payload_sum = sum;
 }
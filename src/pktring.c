@@ -0,0 +1,593 @@
+/*
+ * pktring.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "pktring.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <linux/netfilter.h>
+
+#include "bypass.h"
+#include "globvar.h"
+#include "ipv4pkt.h"
+#include "ipv6pkt.h"
+#include "logging.h"
+#include "nfrules.h"
+#include "random.h"
+#include "rawsend.h"
+
+/*
+    -R: inbound packets are never queued. The inbound path only learns the
+    TTL of the peer and sends fakes back, the packet itself is passed
+    untouched, so it is observed from a TPACKET_V3 receive ring instead, and
+    the queue only carries outbound traffic.
+
+    Without the firewall rules in front of it, the ring applies their
+    filters itself: a classic BPF program keeps the UDP packets for this
+    host which do not carry the fwmark, and the interfaces, the bypass list
+    and the -D/-S ports are checked here. What the conntrack mark did is
+    kept in a table of flows, direct-mapped by a keyed hash: a flow treated
+    on either side is left alone by the other one, and the -W window counts
+    the packets seen by the ring.
+
+    The socket joins a PACKET_FANOUT group in hash mode, keyed by the queue
+    number, so that the packets of one flow always reach the same reader.
+    Fragmented packets are reassembled first, and a SIP request which
+    exceeds the MTU is classified as a whole.
+*/
+
+#define RING_BLOCK_SIZE 262144 /* 256 KB */
+#define RING_BLOCK_NR   16
+#define RING_FRAME_SIZE 2048
+#define RING_RETIRE_MS  10
+#define FLOW_CAP        65536
+#define FLOW_IDLE_SEC   180
+#define IFACE_CAP       256
+#define IFACE_REFRESH   1 /* seconds */
+
+struct flow_key {
+    uint8_t addr[2][16];
+    uint16_t port_be[2];
+    uint8_t family;
+};
+
+struct flow {
+    struct flow_key key;
+    time_t seen;
+    uint32_t pkts;
+    int treated;
+};
+
+struct iface {
+    int index;
+    int allowed;
+};
+
+static int fd = -1;
+static uint8_t *ring = NULL;
+static size_t block_cur = 0;
+static struct flow *flows = NULL;
+static uint64_t flow_seed = 0;
+static struct fs_portset dports;
+static struct fs_portset sports;
+static struct iface ifaces[IFACE_CAP];
+static time_t ifaces_time = 0;
+static uint64_t stat_pkts = 0;
+static uint64_t stat_drops = 0;
+static uint64_t stat_treated = 0;
+
+/*
+    The offsets are relative to the network header (SOCK_DGRAM).
+*/
+static struct sock_filter filter_code[] = {
+    /* only packets addressed to this host */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 13),
+    /* without the fwmark, patched in by fs_pktring_setup() */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_MARK),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 10, 0),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 4),
+    /* IPv4: UDP, and not a fragment */
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 4, 3),
+    /* IPv6: UDP right after the fixed header */
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 3),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, UINT16_MAX),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+#define FILTER_MARK_MASK 3
+#define FILTER_MARK_CMP  4
+
+static int iface_allowed(int index, time_t now)
+{
+    size_t i;
+    char name[IF_NAMESIZE];
+    struct iface *entry;
+
+    if (g_ctx.alliface) {
+        return 1;
+    }
+
+    /* interfaces come and go, and indexes are reused */
+    if (now - ifaces_time >= IFACE_REFRESH) {
+        memset(ifaces, 0, sizeof(ifaces));
+        ifaces_time = now;
+    }
+
+    entry = &ifaces[(unsigned int) index % IFACE_CAP];
+    if (entry->index == index) {
+        return entry->allowed;
+    }
+
+    entry->index = index;
+    entry->allowed = 0;
+    if (!if_indextoname(index, name)) {
+        return 0;
+    }
+
+    /* a plain name matches itself only */
+    for (i = 0; g_ctx.iface[i]; i++) {
+        if (fnmatch(g_ctx.iface[i], name, 0) == 0) {
+            entry->allowed = 1;
+            break;
+        }
+    }
+
+    return entry->allowed;
+}
+
+
+static int parse(uint16_t ethertype, uint8_t *pkt_data, int pkt_len,
+                 struct sockaddr *saddr, struct sockaddr *daddr,
+                 struct udphdr **udph, int *payload_len)
+{
+    uint8_t ttl;
+
+    if (g_ctx.use_ipv4 && ethertype == ETHERTYPE_IP) {
+        return fs_pkt4_parse(pkt_data, pkt_len, saddr, daddr, &ttl, udph,
+                             payload_len);
+    } else if (g_ctx.use_ipv6 && ethertype == ETHERTYPE_IPV6) {
+        return fs_pkt6_parse(pkt_data, pkt_len, saddr, daddr, &ttl, udph,
+                             payload_len);
+    }
+
+    return -1;
+}
+
+
+static const uint8_t *addr_bytes(const struct sockaddr *addr, size_t *len)
+{
+    if (addr->sa_family == AF_INET) {
+        *len = sizeof(struct in_addr);
+        return (const uint8_t *) &((const struct sockaddr_in *) addr)
+            ->sin_addr;
+    }
+
+    *len = sizeof(struct in6_addr);
+    return (const uint8_t *) &((const struct sockaddr_in6 *) addr)->sin6_addr;
+}
+
+
+/*
+    The same key for both directions: the lower end comes first.
+*/
+static void flow_key(const struct sockaddr *saddr,
+                     const struct sockaddr *daddr, const struct udphdr *udph,
+                     struct flow_key *key)
+{
+    int cmp, swap;
+    size_t len;
+    const uint8_t *a, *b;
+
+    memset(key, 0, sizeof(*key));
+    key->family = saddr->sa_family;
+
+    a = addr_bytes(saddr, &len);
+    b = addr_bytes(daddr, &len);
+    cmp = memcmp(a, b, len);
+    swap = cmp > 0 || (cmp == 0 && ntohs(udph->source) > ntohs(udph->dest));
+
+    memcpy(key->addr[swap], a, len);
+    memcpy(key->addr[!swap], b, len);
+    key->port_be[swap] = udph->source;
+    key->port_be[!swap] = udph->dest;
+}
+
+
+/*
+    Returns the entry of the flow, or NULL if it is not known. With create,
+    a new entry takes over the slot.
+*/
+static struct flow *flow_get(const struct flow_key *key, time_t now,
+                             int create)
+{
+    size_t i;
+    uint64_t hash;
+    const uint8_t *p;
+    struct flow *flow;
+
+    /* FNV-1a, keyed */
+    hash = 14695981039346656037u ^ flow_seed;
+    p = (const uint8_t *) key;
+    for (i = 0; i < sizeof(*key); i++) {
+        hash = (hash ^ p[i]) * 1099511628211u;
+    }
+
+    flow = &flows[hash % FLOW_CAP];
+    if (flow->seen && now - flow->seen <= FLOW_IDLE_SEC &&
+        memcmp(&flow->key, key, sizeof(*key)) == 0) {
+        flow->seen = now;
+        return flow;
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    memset(flow, 0, sizeof(*flow));
+    flow->key = *key;
+    flow->seen = now;
+
+    return flow;
+}
+
+
+static void handle(struct tpacket3_hdr *tp, time_t now)
+{
+    int res, pkt_len, payload_len, modified, treated;
+    uint8_t *pkt_data;
+    struct sockaddr_ll sll;
+    struct sockaddr_storage saddr_store, daddr_store;
+    struct sockaddr *saddr, *daddr;
+    struct udphdr *udph;
+    struct flow_key key;
+    struct flow *flow;
+
+    saddr = (struct sockaddr *) &saddr_store;
+    daddr = (struct sockaddr *) &daddr_store;
+
+    memcpy(&sll, (uint8_t *) tp + TPACKET_ALIGN(sizeof(*tp)), sizeof(sll));
+    pkt_data = (uint8_t *) tp + tp->tp_net;
+    pkt_len = tp->tp_snaplen;
+
+    if (!iface_allowed(sll.sll_ifindex, now)) {
+        return;
+    }
+
+    res = parse(ntohs(sll.sll_protocol), pkt_data, pkt_len, saddr, daddr,
+                &udph, &payload_len);
+    if (res < 0) {
+        return;
+    }
+
+    if (fs_bypass_match(saddr)) {
+        return;
+    }
+
+    if ((dports.cnt && !fs_portset_match(&dports, ntohs(udph->dest))) ||
+        (sports.cnt && !fs_portset_match(&sports, ntohs(udph->source)))) {
+        return;
+    }
+
+    flow_key(saddr, daddr, udph, &key);
+    flow = flow_get(&key, now, 1);
+    if (flow->treated) {
+        return;
+    }
+
+    flow->pkts++;
+    if (flow->pkts < g_ctx.win_first || flow->pkts > g_ctx.win_last) {
+        return;
+    }
+
+    res = fs_rawsend_handle(&sll, pkt_data, pkt_len, &modified, &treated);
+    if (res < 0) {
+        E(T(fs_rawsend_handle));
+        return;
+    }
+
+    if (treated) {
+        flow->treated = 1;
+        stat_treated++;
+    }
+}
+
+
+int fs_pktring_setup(void)
+{
+    int res, opt;
+    const char *err_hint;
+    struct sock_fprog prog;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+
+    memset(&dports, 0, sizeof(dports));
+    memset(&sports, 0, sizeof(sports));
+    if (g_ctx.dports && fs_portset_parse(g_ctx.dports, &dports) < 0) {
+        E("ERROR: invalid port list: %s", g_ctx.dports);
+        return -1;
+    }
+    if (g_ctx.sports && fs_portset_parse(g_ctx.sports, &sports) < 0) {
+        E("ERROR: invalid port list: %s", g_ctx.sports);
+        return -1;
+    }
+
+    flows = calloc(FLOW_CAP, sizeof(*flows));
+    if (!flows) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+    flow_seed = fs_random_u64();
+
+    /* no protocol until the filter is attached */
+    fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        switch (errno) {
+            case EPERM:
+                err_hint = " (Are you root?)";
+                break;
+            default:
+                err_hint = "";
+        }
+        E("ERROR: socket(): %s%s", strerror(errno), err_hint);
+        goto free_flows;
+    }
+
+    filter_code[FILTER_MARK_MASK].k = g_ctx.fwmask;
+    filter_code[FILTER_MARK_CMP].k = g_ctx.fwmark;
+    memset(&prog, 0, sizeof(prog));
+    prog.len = sizeof(filter_code) / sizeof(filter_code[0]);
+    prog.filter = filter_code;
+    res = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_ATTACH_FILTER: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    opt = TPACKET_V3;
+    res = setsockopt(fd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): PACKET_VERSION: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_NR;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_NR;
+    req.tp_retire_blk_tov = RING_RETIRE_MS;
+    res = setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+    if (res < 0) {
+        E("ERROR: setsockopt(): PACKET_RX_RING: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    ring = mmap(NULL, (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (ring == MAP_FAILED) {
+        /* RLIMIT_MEMLOCK */
+        ring = mmap(NULL, (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        E("ERROR: mmap(): %s", strerror(errno));
+        ring = NULL;
+        goto close_socket;
+    }
+    block_cur = 0;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    res = bind(fd, (struct sockaddr *) &sll, sizeof(sll));
+    if (res < 0) {
+        E("ERROR: bind(): %s", strerror(errno));
+        goto unmap_ring;
+    }
+
+    opt = (g_ctx.nfqnum & 0xffff) |
+          (uint32_t) (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16;
+    res = setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): PACKET_FANOUT: %s", strerror(errno));
+        goto unmap_ring;
+    }
+
+    return 0;
+
+unmap_ring:
+    munmap(ring, (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR);
+    ring = NULL;
+
+close_socket:
+    close(fd);
+    fd = -1;
+
+free_flows:
+    free(flows);
+    flows = NULL;
+
+    return -1;
+}
+
+
+void fs_pktring_cleanup(void)
+{
+    if (ring) {
+        munmap(ring, (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR);
+        ring = NULL;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    free(flows);
+    flows = NULL;
+}
+
+
+int fs_pktring_fd(void)
+{
+    return fd;
+}
+
+
+/*
+    Hands the filled blocks back to the kernel, up to one ring at a time so
+    that the queue is not starved.
+*/
+void fs_pktring_recv(void)
+{
+    size_t i;
+    uint32_t j, status;
+    time_t now;
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *tp;
+
+    if (!ring) {
+        return;
+    }
+
+    now = time(NULL);
+
+    for (i = 0; i < RING_BLOCK_NR; i++) {
+        bd = (struct tpacket_block_desc *) (ring +
+                                            block_cur * RING_BLOCK_SIZE);
+        status = __atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+        if (!(status & TP_STATUS_USER)) {
+            break;
+        }
+
+        tp = (struct tpacket3_hdr *) ((uint8_t *) bd +
+                                      bd->hdr.bh1.offset_to_first_pkt);
+        for (j = 0; j < bd->hdr.bh1.num_pkts; j++) {
+            stat_pkts++;
+            handle(tp, now);
+            tp = (struct tpacket3_hdr *) ((uint8_t *) tp + tp->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                         __ATOMIC_RELEASE);
+        block_cur = (block_cur + 1) % RING_BLOCK_NR;
+    }
+}
+
+
+/*
+    For the outbound packets of the queue: whether the flow was treated
+    from the ring already, so that its replies are not treated again.
+*/
+int fs_pktring_treated(uint16_t ethertype, uint8_t *pkt_data, int pkt_len)
+{
+    int res, payload_len;
+    struct sockaddr_storage saddr, daddr;
+    struct udphdr *udph;
+    struct flow_key key;
+    struct flow *flow;
+
+    if (!flows) {
+        return 0;
+    }
+
+    res = parse(ethertype, pkt_data, pkt_len, (struct sockaddr *) &saddr,
+                (struct sockaddr *) &daddr, &udph, &payload_len);
+    if (res < 0) {
+        return 0;
+    }
+
+    flow_key((struct sockaddr *) &saddr, (struct sockaddr *) &daddr, udph,
+             &key);
+    flow = flow_get(&key, time(NULL), 0);
+
+    return flow && flow->treated;
+}
+
+
+/*
+    Records a flow treated from the queue, so that the ring leaves its
+    inbound packets alone.
+*/
+void fs_pktring_treat(uint16_t ethertype, uint8_t *pkt_data, int pkt_len)
+{
+    int res, payload_len;
+    struct sockaddr_storage saddr, daddr;
+    struct udphdr *udph;
+    struct flow_key key;
+    struct flow *flow;
+
+    if (!flows) {
+        return;
+    }
+
+    res = parse(ethertype, pkt_data, pkt_len, (struct sockaddr *) &saddr,
+                (struct sockaddr *) &daddr, &udph, &payload_len);
+    if (res < 0) {
+        return;
+    }
+
+    flow_key((struct sockaddr *) &saddr, (struct sockaddr *) &daddr, udph,
+             &key);
+    flow = flow_get(&key, time(NULL), 1);
+    flow->treated = 1;
+}
+
+
+void fs_pktring_stats(uint64_t *pkts, uint64_t *drops, uint64_t *treated)
+{
+    int res;
+    socklen_t len;
+    struct tpacket_stats_v3 st;
+
+    /* the kernel resets its counters on each read */
+    if (fd >= 0) {
+        len = sizeof(st);
+        res = getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+        if (res == 0) {
+            stat_drops += st.tp_drops;
+        }
+    }
+
+    *pkts = stat_pkts;
+    *drops = stat_drops;
+    *treated = stat_treated;
+}
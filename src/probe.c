@@ -0,0 +1,516 @@
+/*
+ * probe.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "probe.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include "globvar.h"
+#include "hopcache.h"
+#include "logging.h"
+#include "srcinfo.h"
+
+/*
+    Destinations with unknown hop counts are probed with TTL-stepped UDP
+    datagrams, traceroute style. The destination port encodes the TTL of
+    each probe. ICMP time-exceeded replies are diverted to the queue
+    (g_ctx.nfqnum + 1) by the firewall rules and handed to fs_probe_handle().
+    The highest TTL which triggered a reply within PROBE_TIMEOUT_MS is the
+    number of routers in between: the probe with one more reaches the
+    destination, which does not answer with time-exceeded. This is the same
+    count as hop_estimate() in rawsend.c gives for a received TTL, the TTL
+    a packet loses on its way, so no offset is applied.
+
+    The result is stored for the destination itself in the peer cache, as a
+    received TTL of 64 minus the hops, unless packets from the peer have
+    been seen meanwhile, and aggregated for its prefix in the hop cache.
+    A destination is not probed again within PROBE_RECENT_SEC, even without
+    a result.
+*/
+
+#define PROBE_MAX_TTL    32
+#define PROBE_PORT_BASE  33434
+#define PROBE_TIMEOUT_MS 2000
+#define PENDING_CAP      256
+#define INFLIGHT_CAP     64
+#define RECENT_CAP       4096
+#define PROBE_RECENT_SEC 600
+#define PROBE_BASE_TTL   64
+
+struct probe_recent {
+    uint32_t hash;
+    uint32_t sec;
+};
+
+struct probe_dest {
+    int active;
+    int max_ttl;
+    uint64_t sent_ms;
+    struct sockaddr_storage addr;
+};
+
+static int sock4fd = -1;
+static int sock6fd = -1;
+static uint16_t sport4_be = 0;
+static uint16_t sport6_be = 0;
+static uint64_t tokens_ms = 0;
+static uint64_t last_tick_ms = 0;
+static size_t pending_head = 0;
+static size_t pending_tail = 0;
+static struct probe_dest pending[PENDING_CAP];
+static struct probe_dest inflight[INFLIGHT_CAP];
+static struct probe_recent recent[RECENT_CAP];
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static uint32_t addr_hash(struct sockaddr *addr)
+{
+    size_t i, len;
+    uint8_t *p;
+    uint32_t hash;
+
+    if (addr->sa_family == AF_INET) {
+        p = (uint8_t *) &((struct sockaddr_in *) addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    } else {
+        p = (uint8_t *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    }
+
+    /* FNV-1a */
+    hash = 2166136261u;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    return hash | 1;
+}
+
+
+static int sameip(struct sockaddr *addr1, struct sockaddr *addr2)
+{
+    if (addr1->sa_family != addr2->sa_family) {
+        return 0;
+    }
+
+    if (addr1->sa_family == AF_INET) {
+        return ((struct sockaddr_in *) addr1)->sin_addr.s_addr ==
+               ((struct sockaddr_in *) addr2)->sin_addr.s_addr;
+    }
+
+    return memcmp(&((struct sockaddr_in6 *) addr1)->sin6_addr,
+                  &((struct sockaddr_in6 *) addr2)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+}
+
+
+static int sock_setup(int af, uint16_t *sport_be)
+{
+    int res, fd, opt;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    fd = socket(af, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    res = setsockopt(fd, SOL_SOCKET, SO_MARK, &g_ctx.fwmark,
+                     sizeof(g_ctx.fwmark));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_MARK: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    /*
+        Replies from the destination itself are never read.
+    */
+    opt = 128;
+    res = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+    if (res < 0) {
+        E("ERROR: setsockopt(): SO_RCVBUF: %s", strerror(errno));
+        goto close_socket;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = af;
+    addrlen = af == AF_INET ? sizeof(struct sockaddr_in)
+                            : sizeof(struct sockaddr_in6);
+
+    res = bind(fd, (struct sockaddr *) &addr, addrlen);
+    if (res < 0) {
+        E("ERROR: bind(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    res = getsockname(fd, (struct sockaddr *) &addr, &addrlen);
+    if (res < 0) {
+        E("ERROR: getsockname(): %s", strerror(errno));
+        goto close_socket;
+    }
+
+    if (af == AF_INET) {
+        *sport_be = ((struct sockaddr_in *) &addr)->sin_port;
+    } else {
+        *sport_be = ((struct sockaddr_in6 *) &addr)->sin6_port;
+    }
+
+    return fd;
+
+close_socket:
+    close(fd);
+
+    return -1;
+}
+
+
+static int send_probes(struct probe_dest *dest)
+{
+    int res, ttl, fd;
+    ssize_t nbytes;
+    socklen_t addrlen;
+    struct sockaddr_storage daddr;
+
+    memcpy(&daddr, &dest->addr, sizeof(daddr));
+
+    for (ttl = 1; ttl <= PROBE_MAX_TTL; ttl++) {
+        if (daddr.ss_family == AF_INET) {
+            fd = sock4fd;
+            addrlen = sizeof(struct sockaddr_in);
+            ((struct sockaddr_in *) &daddr)->sin_port =
+                htons(PROBE_PORT_BASE + ttl);
+            res = setsockopt(fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+        } else {
+            fd = sock6fd;
+            addrlen = sizeof(struct sockaddr_in6);
+            ((struct sockaddr_in6 *) &daddr)->sin6_port =
+                htons(PROBE_PORT_BASE + ttl);
+            res = setsockopt(fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl,
+                             sizeof(ttl));
+        }
+        if (res < 0) {
+            E("ERROR: setsockopt(): TTL: %s", strerror(errno));
+            return -1;
+        }
+
+        nbytes = sendto(fd, NULL, 0, 0, (struct sockaddr *) &daddr, addrlen);
+        if (nbytes < 0 && errno != EPERM && errno != ENETUNREACH &&
+            errno != EHOSTUNREACH) {
+            E("ERROR: sendto(): %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int fs_probe_setup(void)
+{
+    if (!g_ctx.probe_rate) {
+        return 0;
+    }
+
+    if (g_ctx.use_ipv4) {
+        sock4fd = sock_setup(AF_INET, &sport4_be);
+        if (sock4fd < 0) {
+            E(T(sock_setup));
+            goto cleanup;
+        }
+    }
+
+    if (g_ctx.use_ipv6) {
+        sock6fd = sock_setup(AF_INET6, &sport6_be);
+        if (sock6fd < 0) {
+            E(T(sock_setup));
+            goto cleanup;
+        }
+    }
+
+    memset(pending, 0, sizeof(pending));
+    memset(inflight, 0, sizeof(inflight));
+    memset(recent, 0, sizeof(recent));
+    pending_head = pending_tail = 0;
+    tokens_ms = 0;
+    last_tick_ms = now_ms();
+
+    return 0;
+
+cleanup:
+    fs_probe_cleanup();
+
+    return -1;
+}
+
+
+void fs_probe_cleanup(void)
+{
+    if (sock4fd >= 0) {
+        close(sock4fd);
+        sock4fd = -1;
+    }
+
+    if (sock6fd >= 0) {
+        close(sock6fd);
+        sock6fd = -1;
+    }
+}
+
+
+void fs_probe_enqueue(struct sockaddr *addr)
+{
+    uint32_t hash, sec;
+    size_t next;
+    struct probe_recent *rec;
+    struct probe_dest *dest;
+
+    if (!g_ctx.probe_rate) {
+        return;
+    }
+
+    if ((addr->sa_family == AF_INET && sock4fd < 0) ||
+        (addr->sa_family == AF_INET6 && sock6fd < 0)) {
+        return;
+    }
+
+    hash = addr_hash(addr);
+    sec = now_ms() / 1000;
+    rec = &recent[hash % RECENT_CAP];
+    if (rec->hash == hash && sec - rec->sec < PROBE_RECENT_SEC) {
+        return;
+    }
+
+    next = (pending_tail + 1) % PENDING_CAP;
+    if (next == pending_head) {
+        /* full, try again with a later packet */
+        return;
+    }
+
+    rec->hash = hash;
+    rec->sec = sec;
+
+    dest = &pending[pending_tail];
+    memset(dest, 0, sizeof(*dest));
+    if (addr->sa_family == AF_INET) {
+        memcpy(&dest->addr, addr, sizeof(struct sockaddr_in));
+    } else {
+        memcpy(&dest->addr, addr, sizeof(struct sockaddr_in6));
+    }
+    pending_tail = next;
+}
+
+
+static void store_result(struct probe_dest *dest)
+{
+    int res;
+    uint8_t ttl, hwaddr[8];
+    struct sockaddr *addr;
+
+    addr = (struct sockaddr *) &dest->addr;
+
+    /* the samples received from the peer are better than a probe */
+    if (fs_srcinfo_get(addr, &ttl, hwaddr)) {
+        memset(hwaddr, 0, sizeof(hwaddr));
+        res = fs_srcinfo_put(addr, PROBE_BASE_TTL - dest->max_ttl, hwaddr);
+        if (res < 0) {
+            E(T(fs_srcinfo_put));
+        }
+    }
+
+    res = fs_hopcache_put(addr, dest->max_ttl);
+    if (res < 0) {
+        E(T(fs_hopcache_put));
+    }
+}
+
+
+void fs_probe_tick(void)
+{
+    int res;
+    size_t i;
+    uint64_t now;
+    struct probe_dest *dest;
+
+    now = now_ms();
+
+    /*
+        Token bucket in units of (destinations * 1000), allowing a burst of
+        one second worth of probes.
+    */
+    tokens_ms += (now - last_tick_ms) * g_ctx.probe_rate;
+    if (tokens_ms > 1000 * (uint64_t) g_ctx.probe_rate) {
+        tokens_ms = 1000 * (uint64_t) g_ctx.probe_rate;
+    }
+    last_tick_ms = now;
+
+    for (i = 0; i < INFLIGHT_CAP; i++) {
+        dest = &inflight[i];
+
+        if (dest->active && now - dest->sent_ms >= PROBE_TIMEOUT_MS) {
+            if (dest->max_ttl > 0) {
+                store_result(dest);
+            }
+            dest->active = 0;
+        }
+
+        if (dest->active || pending_head == pending_tail ||
+            tokens_ms < 1000) {
+            continue;
+        }
+
+        memcpy(dest, &pending[pending_head], sizeof(*dest));
+        pending_head = (pending_head + 1) % PENDING_CAP;
+        tokens_ms -= 1000;
+
+        dest->active = 1;
+        dest->max_ttl = 0;
+        dest->sent_ms = now;
+
+        res = send_probes(dest);
+        if (res < 0) {
+            E(T(send_probes));
+            dest->active = 0;
+        }
+    }
+}
+
+
+void fs_probe_handle(uint16_t ethertype, uint8_t *pkt_data, int pkt_len)
+{
+    int ttl, len;
+    size_t i;
+    struct iphdr *iph, *inner_iph;
+    struct ip6_hdr *ip6h, *inner_ip6h;
+    struct icmphdr *icmph;
+    struct icmp6_hdr *icmp6h;
+    struct udphdr *udph;
+    struct sockaddr_storage addr_store;
+    struct sockaddr_in *addr_in;
+    struct sockaddr_in6 *addr_in6;
+    uint8_t *p;
+
+    memset(&addr_store, 0, sizeof(addr_store));
+    p = pkt_data;
+    len = pkt_len;
+
+    if (ethertype == ETHERTYPE_IP) {
+        iph = (struct iphdr *) p;
+        if (len < (int) sizeof(*iph) || len < iph->ihl * 4) {
+            return;
+        }
+        len -= iph->ihl * 4;
+        p += iph->ihl * 4;
+
+        icmph = (struct icmphdr *) p;
+        if (iph->protocol != IPPROTO_ICMP || len < (int) sizeof(*icmph) ||
+            icmph->type != ICMP_TIME_EXCEEDED) {
+            return;
+        }
+        len -= sizeof(*icmph);
+        p += sizeof(*icmph);
+
+        inner_iph = (struct iphdr *) p;
+        if (len < (int) sizeof(*inner_iph) ||
+            inner_iph->protocol != IPPROTO_UDP) {
+            return;
+        }
+        if (len < inner_iph->ihl * 4 + (int) sizeof(*udph)) {
+            return;
+        }
+        udph = (struct udphdr *) (p + inner_iph->ihl * 4);
+        if (udph->source != sport4_be) {
+            return;
+        }
+
+        addr_in = (struct sockaddr_in *) &addr_store;
+        addr_in->sin_family = AF_INET;
+        addr_in->sin_addr.s_addr = inner_iph->daddr;
+    } else if (ethertype == ETHERTYPE_IPV6) {
+        ip6h = (struct ip6_hdr *) p;
+        if (len < (int) sizeof(*ip6h)) {
+            return;
+        }
+        len -= sizeof(*ip6h);
+        p += sizeof(*ip6h);
+
+        icmp6h = (struct icmp6_hdr *) p;
+        if (ip6h->ip6_nxt != IPPROTO_ICMPV6 || len < (int) sizeof(*icmp6h) ||
+            icmp6h->icmp6_type != ICMP6_TIME_EXCEEDED) {
+            return;
+        }
+        len -= sizeof(*icmp6h);
+        p += sizeof(*icmp6h);
+
+        inner_ip6h = (struct ip6_hdr *) p;
+        if (len < (int) (sizeof(*inner_ip6h) + sizeof(*udph)) ||
+            inner_ip6h->ip6_nxt != IPPROTO_UDP) {
+            return;
+        }
+        udph = (struct udphdr *) (p + sizeof(*inner_ip6h));
+        if (udph->source != sport6_be) {
+            return;
+        }
+
+        addr_in6 = (struct sockaddr_in6 *) &addr_store;
+        addr_in6->sin6_family = AF_INET6;
+        memcpy(&addr_in6->sin6_addr, &inner_ip6h->ip6_dst,
+               sizeof(struct in6_addr));
+    } else {
+        return;
+    }
+
+    ttl = ntohs(udph->dest) - PROBE_PORT_BASE;
+    if (ttl < 1 || ttl > PROBE_MAX_TTL) {
+        return;
+    }
+
+    for (i = 0; i < INFLIGHT_CAP; i++) {
+        if (inflight[i].active &&
+            sameip((struct sockaddr *) &inflight[i].addr,
+                   (struct sockaddr *) &addr_store)) {
+            if (ttl > inflight[i].max_ttl) {
+                inflight[i].max_ttl = ttl;
+            }
+            return;
+        }
+    }
+}
@@ -0,0 +1,165 @@
+/*
+ * random.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "random.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "logging.h"
+
+/*
+    xoshiro256** with one state per thread, so that no locking is needed.
+    Each state is seeded from getrandom() on first use.
+
+    IPv4 IDs are taken from IPID_BUCKETS counters selected by a keyed hash
+    of the destination, like the kernel does, so that consecutive packets
+    to the same host get consecutive IDs.
+*/
+
+#define IPID_BUCKETS_BITS 11
+#define IPID_BUCKETS      (1 << IPID_BUCKETS_BITS)
+
+static __thread int rng_seeded = 0;
+static __thread uint64_t rng_state[4];
+static uint32_t ipid_key = 0;
+static uint16_t ipid_counters[IPID_BUCKETS];
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z;
+
+    z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+
+/*
+    Returns 0 when seeded from getrandom(), 1 when the entropy pool is not
+    initialized yet and a seed derived from the clock is used instead, and
+    -1 with errno set when getrandom() fails otherwise. The state is seeded
+    in every case, since it must never be run as all zeros.
+*/
+static int rng_seed(void)
+{
+    int i, res, err;
+    ssize_t nbytes;
+    uint64_t seed;
+    struct timespec ts;
+
+    nbytes = getrandom(rng_state, sizeof(rng_state), GRND_NONBLOCK);
+    if (nbytes == sizeof(rng_state)) {
+        rng_seeded = 1;
+        return 0;
+    }
+
+    /*
+        errno is stale after a short read, which getrandom() only returns
+        when interrupted by a signal, like EINTR.
+    */
+    err = errno;
+    res = nbytes >= 0 || err == EAGAIN || err == EINTR ? 1 : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    seed ^= (uint64_t) (uintptr_t) &rng_state;
+    for (i = 0; i < 4; i++) {
+        rng_state[i] = splitmix64(&seed);
+    }
+    rng_seeded = 1;
+
+    errno = err;
+
+    return res;
+}
+
+
+int fs_random_setup(void)
+{
+    int res;
+    size_t i;
+
+    res = rng_seed();
+    if (res < 0) {
+        E("ERROR: getrandom(): %s", strerror(errno));
+        return -1;
+    } else if (res > 0) {
+        E("WARNING: getrandom(): %s, seeding from the clock",
+          "entropy not available yet");
+    }
+
+    ipid_key = fs_random_u64();
+    for (i = 0; i < IPID_BUCKETS; i++) {
+        ipid_counters[i] = fs_random_u64();
+    }
+
+    return 0;
+}
+
+
+uint64_t fs_random_u64(void)
+{
+    uint64_t result, t;
+
+    if (!rng_seeded) {
+        rng_seed();
+    }
+
+    result = rotl(rng_state[1] * 5, 7) * 9;
+    t = rng_state[1] << 17;
+
+    rng_state[2] ^= rng_state[0];
+    rng_state[3] ^= rng_state[1];
+    rng_state[1] ^= rng_state[2];
+    rng_state[0] ^= rng_state[3];
+    rng_state[2] ^= t;
+    rng_state[3] = rotl(rng_state[3], 45);
+
+    return result;
+}
+
+
+uint32_t fs_random_range(uint32_t n)
+{
+    /* Lemire's multiply-shift, the bias is negligible for small n */
+    return ((fs_random_u64() >> 32) * n) >> 32;
+}
+
+
+uint16_t fs_random_ipid(uint32_t daddr_be)
+{
+    uint32_t idx;
+
+    idx = ((daddr_be ^ ipid_key) * 0x9e3779b1u) >> (32 - IPID_BUCKETS_BITS);
+
+    return __atomic_fetch_add(&ipid_counters[idx], 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,229 @@
+/*
+ * ratelimit.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "ratelimit.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "globvar.h"
+#include "logging.h"
+
+/*
+    Fake injection is limited by token buckets: one for all flows (-l) and
+    one per destination prefix (-L), a /24 for IPv4 and a /48 for IPv6.
+    Tokens are counted in units of (flows * 1000) and a bucket holds up to
+    one second of its rate as burst.
+
+    Prefix buckets live in a set-associative table indexed by a hash of the
+    prefix. When a set is full, the bucket used least recently is taken
+    over by the new prefix, which inherits its tokens: a bucket only refills
+    with time, never because two prefixes keep evicting each other. A flood
+    spread over many prefixes is left to the global limit.
+*/
+
+#define RL_SETS_BITS 10
+#define RL_SETS      (1 << RL_SETS_BITS)
+#define RL_WAYS      4
+#define RL_BUCKETS   (RL_SETS * RL_WAYS)
+
+struct rl_bucket {
+    uint64_t tag;
+    uint32_t tokens;
+    uint32_t last_ms;
+};
+
+static struct rl_bucket rl_global;
+static struct rl_bucket *rl_buckets = NULL;
+static uint64_t rl_allowed = 0;
+static uint64_t rl_limited_global = 0;
+static uint64_t rl_limited_prefix = 0;
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    /* wraps around, only differences are used */
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+static uint64_t prefix_tag(struct sockaddr *addr)
+{
+    int i;
+    uint8_t *p;
+    uint64_t tag;
+
+    if (addr->sa_family == AF_INET) {
+        p = (uint8_t *) &((struct sockaddr_in *) addr)->sin_addr;
+        tag = 4;
+        for (i = 0; i < 3; i++) {
+            tag = tag << 8 | p[i];
+        }
+    } else {
+        p = (uint8_t *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+        tag = 6;
+        for (i = 0; i < 6; i++) {
+            tag = tag << 8 | p[i];
+        }
+    }
+
+    return tag;
+}
+
+
+static void bucket_refill(struct rl_bucket *bucket, uint32_t rate,
+                          uint32_t now)
+{
+    uint64_t tokens;
+
+    tokens = bucket->tokens + (uint64_t) (now - bucket->last_ms) * rate;
+    if (tokens > 1000 * (uint64_t) rate) {
+        tokens = 1000 * (uint64_t) rate;
+    }
+
+    bucket->tokens = tokens;
+    bucket->last_ms = now;
+}
+
+
+static struct rl_bucket *prefix_bucket(struct sockaddr *addr, uint32_t now)
+{
+    int i;
+    uint64_t tag;
+    struct rl_bucket *set, *victim;
+
+    tag = prefix_tag(addr);
+
+    /* Fibonacci hashing */
+    set = &rl_buckets[((tag * 0x9e3779b97f4a7c15ull) >> (64 - RL_SETS_BITS)) *
+                      RL_WAYS];
+
+    victim = &set[0];
+    for (i = 0; i < RL_WAYS; i++) {
+        if (set[i].tag == tag) {
+            return &set[i];
+        }
+        if (now - set[i].last_ms > now - victim->last_ms) {
+            victim = &set[i];
+        }
+    }
+
+    /* tokens and last_ms are kept, bucket_refill() goes on from there */
+    victim->tag = tag;
+
+    return victim;
+}
+
+
+int fs_ratelimit_setup(void)
+{
+    int i;
+    uint32_t now;
+
+    if (!g_ctx.rate_global && !g_ctx.rate_prefix) {
+        return 0;
+    }
+
+    rl_buckets = calloc(RL_BUCKETS, sizeof(*rl_buckets));
+    if (!rl_buckets) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return -1;
+    }
+
+    now = now_ms();
+
+    rl_global.tag = 0;
+    rl_global.tokens = 1000 * g_ctx.rate_global;
+    rl_global.last_ms = now;
+
+    /* tag 0 matches no prefix, so every bucket starts free and full */
+    for (i = 0; i < RL_BUCKETS; i++) {
+        rl_buckets[i].tokens = 1000 * g_ctx.rate_prefix;
+        rl_buckets[i].last_ms = now;
+    }
+
+    rl_allowed = rl_limited_global = rl_limited_prefix = 0;
+
+    return 0;
+}
+
+
+void fs_ratelimit_cleanup(void)
+{
+    free(rl_buckets);
+    rl_buckets = NULL;
+}
+
+
+int fs_ratelimit_allow(struct sockaddr *addr)
+{
+    uint32_t now;
+    struct rl_bucket *bucket;
+
+    if (!rl_buckets) {
+        return 1;
+    }
+
+    now = now_ms();
+
+    if (g_ctx.rate_global) {
+        bucket_refill(&rl_global, g_ctx.rate_global, now);
+        if (rl_global.tokens < 1000) {
+            rl_limited_global++;
+            return 0;
+        }
+    }
+
+    if (g_ctx.rate_prefix) {
+        bucket = prefix_bucket(addr, now);
+        bucket_refill(bucket, g_ctx.rate_prefix, now);
+        if (bucket->tokens < 1000) {
+            rl_limited_prefix++;
+            return 0;
+        }
+        bucket->tokens -= 1000;
+    }
+
+    /* taken only once the flow passed all buckets */
+    if (g_ctx.rate_global) {
+        rl_global.tokens -= 1000;
+    }
+
+    rl_allowed++;
+
+    return 1;
+}
+
+
+void fs_ratelimit_stats(uint64_t *allowed, uint64_t *limited_global,
+                        uint64_t *limited_prefix)
+{
+    *allowed = rl_allowed;
+    *limited_global = rl_limited_global;
+    *limited_prefix = rl_limited_prefix;
+}
@@ -33,18 +33,24 @@
 #include <linux/netfilter.h>
 #include <libnetfilter_queue/libnetfilter_queue_udp.h>
 
+#include "classify.h"
+#include "counters.h"
 #include "globvar.h"
+#include "hopcache.h"
 #include "ipv4pkt.h"
 #include "ipv6pkt.h"
 #include "logging.h"
 #include "payload.h"
+#include "probe.h"
+#include "ratelimit.h"
 #include "srcinfo.h"
 
 #define NO_SNAT   0
 #define NEED_SNAT 1
 
-static uint8_t *payload = NULL;
+static uint8_t payload[FS_PAYLOAD_MAX];
 static size_t payload_len = 0;
+static uint32_t payload_sum = 0;
 static int sockfd = -1;
 static int sock4fd = -1;
 static int sock4if = -1;
@@ -130,6 +136,16 @@ static int bind_iface(int fd, int ifindex)
         }
     }
 
+    if (!ifindex) {
+        /* unbind, route by destination */
+        res = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, "", 0);
+        if (res < 0) {
+            E("ERROR: setsockopt(): SO_BINDTODEVICE: %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
     iface = if_indextoname(ifindex, iface_buf);
     if (!iface) {
         E("ERROR: if_indextoname(): %s", strerror(errno));
@@ -185,6 +201,7 @@ static int sendto_snat(struct sockaddr_ll *sll, struct sockaddr *daddr,
     nbytes = sendto(fd, pkt_buff, pkt_len, 0, daddr, daddrlen);
     if (nbytes < 0 && errno != EPERM) {
         E("ERROR: sendto(): %s", strerror(errno));
+        FS_COUNT(send_errors);
         return -1;
     }
 
@@ -202,14 +219,16 @@ static int send_payload(struct sockaddr_ll *sll, struct sockaddr *saddr,
 
     if (daddr->sa_family == AF_INET) {
         pkt_len = fs_pkt4_make(pkt_buff, sizeof(pkt_buff), saddr, daddr, ttl,
-                               sport_be, dport_be, payload, payload_len);
+                               sport_be, dport_be, payload, payload_len,
+                               payload_sum);
         if (pkt_len < 0) {
             E(T(fs_pkt4_make));
             return -1;
         }
     } else if (daddr->sa_family == AF_INET6) {
         pkt_len = fs_pkt6_make(pkt_buff, sizeof(pkt_buff), saddr, daddr, ttl,
-                               sport_be, dport_be, payload, payload_len);
+                               sport_be, dport_be, payload, payload_len,
+                               payload_sum);
         if (pkt_len < 0) {
             E(T(fs_pkt6_make));
             return -1;
@@ -230,10 +249,13 @@ static int send_payload(struct sockaddr_ll *sll, struct sockaddr *saddr,
                         sizeof(*sll));
         if (nbytes < 0) {
             E("ERROR: sendto(): %s", strerror(errno));
+            FS_COUNT(send_errors);
             return -1;
         }
     }
 
+    FS_COUNT(fakes);
+
     return 0;
 }
 
@@ -334,18 +356,19 @@ void fs_rawsend_cleanup(void)
 
 
 int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
-                      int *modified)
+                      int *modified, int *treated)
 {
     uint16_t ethertype;
     int res, i, src_payload_len, hop, srcinfo_unavail;
-    uint8_t src_ttl, snd_ttl;
+    uint8_t src_ttl, snd_ttl, hwaddr[8];
     struct udphdr *udph;
     char src_ip_str[INET6_ADDRSTRLEN], dst_ip_str[INET6_ADDRSTRLEN];
     struct sockaddr_storage saddr_store, daddr_store;
     struct sockaddr *saddr, *daddr;
     ssize_t nbytes;
 
-    *modified = 0;
+    *modified = *treated = 0;
+    hop = 0;
 
     saddr = (struct sockaddr *) &saddr_store;
     daddr = (struct sockaddr *) &daddr_store;
@@ -356,6 +379,7 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
                             &src_payload_len);
         if (res < 0) {
             E(T(fs_pkt4_parse));
+            FS_COUNT(parse_errors);
             return -1;
         }
     } else if (g_ctx.use_ipv6 && ethertype == ETHERTYPE_IPV6) {
@@ -363,10 +387,12 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
                             &src_payload_len);
         if (res < 0) {
             E(T(fs_pkt6_parse));
+            FS_COUNT(parse_errors);
             return -1;
         }
     } else {
         E("ERROR: unknown ethertype 0x%04x");
+        FS_COUNT(parse_errors);
         return -1;
     }
 
@@ -381,28 +407,68 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         */
         sll->sll_pkttype = 0;
 
+        if (!g_ctx.nohopest) {
+            res = fs_srcinfo_put(saddr, src_ttl, sll->sll_addr);
+            if (res < 0) {
+                E(T(fs_srcinfo_put));
+                return -1;
+            }
+
+            /*
+                Use the median TTL of the peer rather than the TTL of this
+                single packet.
+            */
+            fs_srcinfo_get(saddr, &src_ttl, hwaddr);
+            hop = hop_estimate(src_ttl);
+
+            res = fs_hopcache_put(saddr, hop);
+            if (res < 0) {
+                E(T(fs_hopcache_put));
+                return -1;
+            }
+        }
+
         if (!g_ctx.outbound) {
             E_INFO("%s:%u ===UDP(~)===> %s:%u", src_ip_str,
                    ntohs(udph->source), dst_ip_str, ntohs(udph->dest));
             return NF_ACCEPT;
         }
 
+        if (!fs_classify_match((uint8_t *) (udph + 1), src_payload_len)) {
+            /*
+                Not a handshake, leave the flow untreated so that fakes still
+                go before a handshake among its next queued packets.
+            */
+            E_INFO("%s:%u ===SKIP(~)===> %s:%u", src_ip_str,
+                   ntohs(udph->source), dst_ip_str, ntohs(udph->dest));
+            return NF_ACCEPT;
+        }
+
         E_INFO("%s:%u ===UDP===> %s:%u", src_ip_str, ntohs(udph->source),
                dst_ip_str, ntohs(udph->dest));
 
         snd_ttl = g_ctx.ttl;
 
         if (!g_ctx.nohopest) {
-            hop = hop_estimate(src_ttl);
             if (hop <= g_ctx.ttl) {
                 E_INFO("%s:%u ===LOCAL(~)===> %s:%u", src_ip_str,
                        ntohs(udph->source), dst_ip_str, ntohs(udph->dest));
+                FS_COUNT(local_skips);
+                *treated = 1;
                 return NF_ACCEPT;
             }
             snd_ttl = calc_snd_ttl(hop);
         }
 
-        th_payload_get(&payload, &payload_len);
+        if (!fs_ratelimit_allow(saddr)) {
+            E_INFO("%s:%u ===LIMIT(~)===> %s:%u", src_ip_str,
+                   ntohs(udph->source), dst_ip_str, ntohs(udph->dest));
+            *treated = 1;
+            return NF_ACCEPT;
+        }
+
+        th_payload_get(saddr, ntohs(udph->source), payload, &payload_len,
+                       &payload_sum);
 
         for (i = 0; i < g_ctx.repeat; i++) {
             res = send_payload(sll, daddr, saddr, snd_ttl, udph->dest,
@@ -415,6 +481,7 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         E_INFO("%s:%u <===FAKE(*)=== %s:%u", src_ip_str, ntohs(udph->source),
                dst_ip_str, ntohs(udph->dest));
 
+        *treated = 1;
         return NF_ACCEPT;
     } else if (sll->sll_pkttype == PACKET_OUTGOING) {
         /*
@@ -434,19 +501,46 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
             return NF_ACCEPT;
         }
 
+        if (!fs_classify_match((uint8_t *) (udph + 1), src_payload_len)) {
+            E_INFO("%s:%u <===SKIP(~)=== %s:%u", dst_ip_str,
+                   ntohs(udph->dest), src_ip_str, ntohs(udph->source));
+            return NF_ACCEPT;
+        }
+
         snd_ttl = g_ctx.ttl;
 
         if (!g_ctx.nohopest) {
             hop = hop_estimate(src_ttl);
+            if (srcinfo_unavail) {
+                /*
+                    Never received from this peer, fall back to the hop count
+                    learned for its prefix, or have it probed for the
+                    following flows.
+                */
+                res = fs_hopcache_get(daddr, &hop);
+                if (res) {
+                    fs_probe_enqueue(daddr);
+                }
+            }
             if (hop <= g_ctx.ttl) {
                 E_INFO("%s:%u <===LOCAL(~)=== %s:%u", src_ip_str,
                        ntohs(udph->source), dst_ip_str, ntohs(udph->dest));
+                FS_COUNT(local_skips);
+                *treated = 1;
                 return NF_ACCEPT;
             }
             snd_ttl = calc_snd_ttl(hop);
         }
 
-        th_payload_get(&payload, &payload_len);
+        if (!fs_ratelimit_allow(daddr)) {
+            E_INFO("%s:%u <===LIMIT(~)=== %s:%u", dst_ip_str,
+                   ntohs(udph->dest), src_ip_str, ntohs(udph->source));
+            *treated = 1;
+            return NF_ACCEPT;
+        }
+
+        th_payload_get(daddr, ntohs(udph->dest), payload, &payload_len,
+                       &payload_sum);
 
         for (i = 0; i < g_ctx.repeat; i++) {
             res = send_payload(sll, saddr, daddr, snd_ttl, udph->source,
@@ -468,6 +562,7 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         E_INFO("%s:%u <===UDP=== %s:%u", dst_ip_str, ntohs(udph->dest),
                src_ip_str, ntohs(udph->source));
 
+        *treated = 1;
         return NF_ACCEPT;
     } else {
         E_INFO("%s:%u ===(~)=== %s:%u", src_ip_str, ntohs(udph->source),
@@ -475,3 +570,73 @@ int fs_rawsend_handle(struct sockaddr_ll *sll, uint8_t *pkt_data, int pkt_len,
         return NF_ACCEPT;
     }
 }
+
+
+/*
+    Fakes for a flow learned from a conntrack event, see ctevent.c. None of
+    its packets is seen, so the hop count of the peer comes from the caches
+    only. saddr is the local end of the flow, daddr the peer. The packets
+    leave through the routing table, like the outbound ones above.
+
+    Returns 1 if fakes were sent, 0 if the flow was skipped.
+*/
+int fs_rawsend_flow(struct sockaddr *saddr, struct sockaddr *daddr,
+                    uint16_t sport_be, uint16_t dport_be)
+{
+    int res, i, hop, srcinfo_unavail;
+    uint8_t src_ttl, snd_ttl;
+    char src_ip_str[INET6_ADDRSTRLEN], dst_ip_str[INET6_ADDRSTRLEN];
+    struct sockaddr_ll sll;
+
+    memset(&sll, 0, sizeof(sll));
+
+    if (!g_ctx.silent) {
+        ipaddr_to_str(saddr, src_ip_str);
+        ipaddr_to_str(daddr, dst_ip_str);
+    }
+
+    snd_ttl = g_ctx.ttl;
+
+    if (!g_ctx.nohopest) {
+        srcinfo_unavail = fs_srcinfo_get(daddr, &src_ttl, sll.sll_addr);
+        if (srcinfo_unavail) {
+            src_ttl = 0;
+        }
+        hop = hop_estimate(src_ttl);
+        if (srcinfo_unavail) {
+            res = fs_hopcache_get(daddr, &hop);
+            if (res) {
+                fs_probe_enqueue(daddr);
+            }
+        }
+        if (hop <= g_ctx.ttl) {
+            E_INFO("%s:%u <===LOCAL(~)=== %s:%u", dst_ip_str, ntohs(dport_be),
+                   src_ip_str, ntohs(sport_be));
+            FS_COUNT(local_skips);
+            return 0;
+        }
+        snd_ttl = calc_snd_ttl(hop);
+    }
+
+    if (!fs_ratelimit_allow(daddr)) {
+        E_INFO("%s:%u <===LIMIT(~)=== %s:%u", dst_ip_str, ntohs(dport_be),
+               src_ip_str, ntohs(sport_be));
+        return 0;
+    }
+
+    th_payload_get(daddr, ntohs(dport_be), payload, &payload_len,
+                   &payload_sum);
+
+    for (i = 0; i < g_ctx.repeat; i++) {
+        res = send_payload(&sll, saddr, daddr, snd_ttl, sport_be, dport_be,
+                           NEED_SNAT);
+        if (res < 0) {
+            E(T(send_payload));
+            return -1;
+        }
+    }
+    E_INFO("%s:%u <===FAKE(*)=== %s:%u", dst_ip_str, ntohs(dport_be),
+           src_ip_str, ntohs(sport_be));
+
+    return 1;
+}
@@ -38,6 +38,12 @@ static void signal_handler(int sig)
         case SIGTERM:
             g_ctx.exit = 1;
             break;
+        case SIGUSR1:
+            g_ctx.showstats = 1;
+            break;
+        case SIGHUP:
+            g_ctx.reload = 1;
+            break;
         default:
             break;
     }
@@ -58,21 +64,27 @@ int fs_signal_setup(void)
         return -1;
     }
 
-    res = sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = signal_handler;
+
+    res = sigaction(SIGINT, &sa, NULL);
     if (res < 0) {
         E("ERROR: sigaction(): %s", strerror(errno));
         return -1;
     }
 
-    sa.sa_handler = signal_handler;
+    res = sigaction(SIGTERM, &sa, NULL);
+    if (res < 0) {
+        E("ERROR: sigaction(): %s", strerror(errno));
+        return -1;
+    }
 
-    res = sigaction(SIGINT, &sa, NULL);
+    res = sigaction(SIGUSR1, &sa, NULL);
     if (res < 0) {
         E("ERROR: sigaction(): %s", strerror(errno));
         return -1;
     }
 
-    res = sigaction(SIGTERM, &sa, NULL);
+    res = sigaction(SIGHUP, &sa, NULL);
     if (res < 0) {
         E("ERROR: sigaction(): %s", strerror(errno));
         return -1;
@@ -21,90 +21,546 @@
 #include "srcinfo.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
+#include "counters.h"
+#include "globvar.h"
 #include "logging.h"
 
-#define CAPACITY 500
+/*
+    Peers are kept in a set-associative table: each address hashes to a set
+    of SRCINFO_WAYS entries, the least recently used one is replaced.
+
+    Every entry keeps the last SRCINFO_SAMPLES TTLs observed from the peer.
+    The median of these samples is used as the TTL of the peer, so a single
+    spoofed or asymmetric-path packet cannot skew the hop estimation. The
+    estimation is considered confident when at least SRCINFO_MIN_SAMPLES are
+    available and at least 3/4 of them are within 1 of the median.
+
+    With -c, the table is a shared mapping of the cache file, so it is
+    loaded without parsing and written back by the kernel. Dirty pages are
+    additionally flushed every FS_SRCINFO_SYNC_SEC seconds.
+
+    Each set is guarded by a sequence lock kept outside of the mapping, one
+    per cache line. Writers take the set by moving its sequence from even
+    to odd and release it by making it even again; readers never write
+    shared memory, they copy the entry and retry if the sequence was odd or
+    changed meanwhile. For the same reason, lookups do not refresh the LRU
+    clock of an entry, only new samples do. The file format
+    (all multi-byte integers are big-endian):
+
+      header (64 bytes):
+        0   8   magic "FSPEERS\0"
+        8   4   version (1)
+        12  4   header size (64)
+        16  4   number of sets (256)
+        20  4   number of ways (4)
+        24  4   entry size (48)
+        28  4   LRU clock
+        32  32  reserved, zero
+
+      entries (sets * ways, 48 bytes each), set = FNV-1a(address) % sets:
+        0   1   initialized (0/1)
+        1   1   confident (0/1)
+        2   1   address family (4/6)
+        3   1   median TTL
+        4   1   number of samples
+        5   1   next sample slot
+        6   2   reserved, zero
+        8   8   TTL samples
+        16  8   hardware address
+        24  16  address (IPv4 in the first 4 bytes)
+        40  4   LRU clock of the last use
+        44  4   reserved, zero
+*/
+
+#define SRCINFO_SETS        256
+#define SRCINFO_WAYS        4
+#define SRCINFO_SAMPLES     8
+#define SRCINFO_MIN_SAMPLES 3
+#define SRCINFO_VERSION     1
+#define SRCINFO_LINE        64
+
+struct srcinfo_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdr_size;
+    uint32_t sets;
+    uint32_t ways;
+    uint32_t entry_size;
+    uint32_t clock;
+    uint8_t reserved[32];
+};
 
 struct srcinfo {
-    int initialized;
+    uint8_t initialized;
+    uint8_t confident;
+    uint8_t family;
     uint8_t ttl;
+    uint8_t nsamples;
+    uint8_t next_sample;
+    uint8_t reserved1[2];
+    uint8_t samples[SRCINFO_SAMPLES];
     uint8_t hwaddr[8];
-    struct sockaddr_storage addr;
+    uint8_t addr[16];
+    uint32_t last_used;
+    uint8_t reserved2[4];
+};
+
+struct srcinfo_lock {
+    uint32_t seq;
+    uint8_t pad[SRCINFO_LINE - sizeof(uint32_t)];
 };
 
+static const char srci_magic[8] = "FSPEERS";
+
+static int map_fd = -1;
+static void *map = NULL;
+static size_t map_len = 0;
+static size_t dirty_begin = SIZE_MAX;
+static size_t dirty_end = 0;
+static time_t last_sync = 0;
+static struct srcinfo_hdr *hdr = NULL;
 static struct srcinfo *srci = NULL;
-static size_t srci_end = 0;
+static struct srcinfo_lock *srci_lock = NULL;
+static uint32_t srci_clock = 0;
+static size_t srci_peers = 0;
+static size_t srci_lowconf = 0;
+static __thread uint64_t srci_retries = 0;
 
-static int sameip(struct sockaddr *addr1, struct sockaddr *addr2)
+static int addr_key(struct sockaddr *addr, uint8_t *family,
+                    uint8_t key[16])
 {
-    struct sockaddr_in *addr_in_1, *addr_in_2;
-    struct sockaddr_in6 *addr_in6_1, *addr_in6_2;
+    memset(key, 0, 16);
 
-    if (addr1->sa_family != addr2->sa_family) {
+    if (addr->sa_family == AF_INET) {
+        *family = 4;
+        memcpy(key, &((struct sockaddr_in *) addr)->sin_addr,
+               sizeof(struct in_addr));
+        return 0;
+    } else if (addr->sa_family == AF_INET6) {
+        *family = 6;
+        memcpy(key, &((struct sockaddr_in6 *) addr)->sin6_addr,
+               sizeof(struct in6_addr));
         return 0;
     }
 
-    if (addr1->sa_family == AF_INET) {
-        addr_in_1 = (struct sockaddr_in *) addr1;
-        addr_in_2 = (struct sockaddr_in *) addr2;
+    return -1;
+}
+
+
+static size_t find_set(uint8_t family, uint8_t key[16])
+{
+    size_t i, len;
+    uint32_t hash;
+
+    len = family == 4 ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+    /* FNV-1a */
+    hash = 2166136261u;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    return hash % SRCINFO_SETS;
+}
+
+
+static uint32_t set_lock(struct srcinfo_lock *lock)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) &&
+            __atomic_compare_exchange_n(&lock->seq, &seq, seq + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        srci_retries++;
+    }
+
+    /* the odd sequence must be visible before any change to the set */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return seq + 1;
+}
+
+
+static void set_unlock(struct srcinfo_lock *lock, uint32_t seq)
+{
+    __atomic_store_n(&lock->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+static void mark_dirty(struct srcinfo *info)
+{
+    size_t begin, end, cur;
+
+    begin = (uint8_t *) info - (uint8_t *) map;
+    end = begin + sizeof(*info);
+
+    cur = __atomic_load_n(&dirty_begin, __ATOMIC_RELAXED);
+    while (begin < cur &&
+           !__atomic_compare_exchange_n(&dirty_begin, &cur, begin, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* retry with the updated value */
+    }
+
+    cur = __atomic_load_n(&dirty_end, __ATOMIC_RELAXED);
+    while (end > cur &&
+           !__atomic_compare_exchange_n(&dirty_end, &cur, end, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* retry with the updated value */
+    }
+}
+
+
+static void update_estimate(struct srcinfo *info)
+{
+    int i, j, agree, diff;
+    uint8_t tmp, sorted[SRCINFO_SAMPLES];
+
+    memcpy(sorted, info->samples, info->nsamples);
+
+    /* insertion sort, at most SRCINFO_SAMPLES elements */
+    for (i = 1; i < info->nsamples; i++) {
+        tmp = sorted[i];
+        for (j = i; j > 0 && sorted[j - 1] > tmp; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = tmp;
+    }
+
+    info->ttl = sorted[info->nsamples / 2];
+
+    agree = 0;
+    for (i = 0; i < info->nsamples; i++) {
+        diff = (int) info->samples[i] - info->ttl;
+        if (diff >= -1 && diff <= 1) {
+            agree++;
+        }
+    }
+
+    info->confident = info->nsamples >= SRCINFO_MIN_SAMPLES &&
+                      agree * 4 >= info->nsamples * 3;
+}
+
+
+static int header_valid(void)
+{
+    return memcmp(hdr->magic, srci_magic, sizeof(srci_magic)) == 0 &&
+           ntohl(hdr->version) == SRCINFO_VERSION &&
+           ntohl(hdr->hdr_size) == sizeof(struct srcinfo_hdr) &&
+           ntohl(hdr->sets) == SRCINFO_SETS &&
+           ntohl(hdr->ways) == SRCINFO_WAYS &&
+           ntohl(hdr->entry_size) == sizeof(struct srcinfo);
+}
+
+
+static int entry_valid(struct srcinfo *info)
+{
+    if (!info->initialized) {
+        return 1;
+    }
+
+    return info->initialized == 1 && info->confident <= 1 &&
+           (info->family == 4 || info->family == 6) && info->nsamples &&
+           info->nsamples <= SRCINFO_SAMPLES &&
+           info->next_sample < SRCINFO_SAMPLES;
+}
+
+
+static void header_init(void)
+{
+    memset(map, 0, map_len);
+    memcpy(hdr->magic, srci_magic, sizeof(srci_magic));
+    hdr->version = htonl(SRCINFO_VERSION);
+    hdr->hdr_size = htonl(sizeof(struct srcinfo_hdr));
+    hdr->sets = htonl(SRCINFO_SETS);
+    hdr->ways = htonl(SRCINFO_WAYS);
+    hdr->entry_size = htonl(sizeof(struct srcinfo));
+    hdr->clock = 0;
+}
+
+
+static int map_file(void)
+{
+    int res;
+    struct stat st;
+
+    map_fd = open(g_ctx.cachepath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (map_fd < 0) {
+        E("ERROR: open(): %s: %s", g_ctx.cachepath, strerror(errno));
+        return -1;
+    }
 
-        return addr_in_1->sin_addr.s_addr == addr_in_2->sin_addr.s_addr;
-    } else if (addr1->sa_family == AF_INET6) {
-        addr_in6_1 = (struct sockaddr_in6 *) addr1;
-        addr_in6_2 = (struct sockaddr_in6 *) addr2;
+    res = fstat(map_fd, &st);
+    if (res < 0) {
+        E("ERROR: fstat(): %s: %s", g_ctx.cachepath, strerror(errno));
+        return -1;
+    }
 
-        return memcmp(&addr_in6_1->sin6_addr, &addr_in6_2->sin6_addr,
-                      sizeof(addr_in6_1->sin6_addr)) == 0;
+    if ((size_t) st.st_size != map_len) {
+        if (st.st_size) {
+            E("WARNING: %s: size mismatch, discarding the cache",
+              g_ctx.cachepath);
+        }
+        res = ftruncate(map_fd, map_len);
+        if (res < 0) {
+            E("ERROR: ftruncate(): %s: %s", g_ctx.cachepath,
+              strerror(errno));
+            return -1;
+        }
     }
+
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        E("ERROR: mmap(): %s: %s", g_ctx.cachepath, strerror(errno));
+        return -1;
+    }
+
     return 0;
 }
 
 
 int fs_srcinfo_setup(void)
 {
-    srci = calloc(CAPACITY, sizeof(*srci));
-    if (!srci) {
-        E("ERROR: calloc(): %s", strerror(errno));
-        return -1;
+    int res;
+    size_t i;
+
+    map_len = sizeof(struct srcinfo_hdr) +
+              SRCINFO_SETS * SRCINFO_WAYS * sizeof(struct srcinfo);
+
+    res = posix_memalign((void **) &srci_lock, SRCINFO_LINE,
+                         SRCINFO_SETS * sizeof(*srci_lock));
+    if (res) {
+        srci_lock = NULL;
+        E("ERROR: posix_memalign(): %s", strerror(res));
+        goto cleanup;
+    }
+    memset(srci_lock, 0, SRCINFO_SETS * sizeof(*srci_lock));
+
+    if (g_ctx.cachepath) {
+        res = map_file();
+        if (res < 0) {
+            E(T(map_file));
+            goto cleanup;
+        }
+    } else {
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            E("ERROR: mmap(): %s", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    hdr = map;
+    srci = (struct srcinfo *) (hdr + 1);
+
+    if (!header_valid()) {
+        if (g_ctx.cachepath && hdr->magic[0]) {
+            E("WARNING: %s: incompatible format, discarding the cache",
+              g_ctx.cachepath);
+        }
+        header_init();
+    }
+
+    srci_clock = ntohl(hdr->clock);
+    srci_peers = srci_lowconf = 0;
+    for (i = 0; i < SRCINFO_SETS * SRCINFO_WAYS; i++) {
+        if (!entry_valid(&srci[i])) {
+            memset(&srci[i], 0, sizeof(srci[i]));
+            continue;
+        }
+        if (srci[i].initialized) {
+            srci_peers++;
+            if (!srci[i].confident) {
+                srci_lowconf++;
+            }
+        }
     }
-    srci_end = 0;
+
+    if (g_ctx.cachepath) {
+        E("loaded %zu peers from %s", srci_peers, g_ctx.cachepath);
+    }
+
+    dirty_begin = SIZE_MAX;
+    dirty_end = 0;
+    last_sync = time(NULL);
 
     return 0;
+
+cleanup:
+    fs_srcinfo_cleanup();
+
+    return -1;
 }
 
 
 void fs_srcinfo_cleanup(void)
 {
-    free(srci);
+    int res;
+
+    if (map) {
+        if (map_fd >= 0) {
+            hdr->clock = htonl(__atomic_load_n(&srci_clock,
+                                               __ATOMIC_RELAXED));
+            res = msync(map, map_len, MS_SYNC);
+            if (res < 0) {
+                E("ERROR: msync(): %s", strerror(errno));
+            }
+        }
+        munmap(map, map_len);
+        map = NULL;
+        hdr = NULL;
+        srci = NULL;
+    }
+
+    if (map_fd >= 0) {
+        close(map_fd);
+        map_fd = -1;
+    }
+
+    free(srci_lock);
+    srci_lock = NULL;
 }
 
 
-int fs_srcinfo_put(struct sockaddr *addr, uint8_t ttl, uint8_t hwaddr[8])
+void fs_srcinfo_sync(void)
 {
-    struct srcinfo *info;
+    int res;
+    long pagesize;
+    size_t begin, end;
+    time_t now, prev;
 
-    info = &srci[srci_end];
+    if (map_fd < 0) {
+        return;
+    }
 
-    if (addr->sa_family == AF_INET) {
-        memcpy(&info->addr, addr, sizeof(struct sockaddr_in));
-    } else if (addr->sa_family == AF_INET6) {
-        memcpy(&info->addr, addr, sizeof(struct sockaddr_in6));
-    } else {
+    now = time(NULL);
+    prev = __atomic_load_n(&last_sync, __ATOMIC_RELAXED);
+    if (now - prev < FS_SRCINFO_SYNC_SEC) {
+        return;
+    }
+
+    /* only one worker flushes per period */
+    if (!__atomic_compare_exchange_n(&last_sync, &prev, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    begin = __atomic_exchange_n(&dirty_begin, SIZE_MAX, __ATOMIC_RELAXED);
+    end = __atomic_exchange_n(&dirty_end, 0, __ATOMIC_RELAXED);
+    if (begin >= end) {
+        return;
+    }
+
+    hdr->clock = htonl(__atomic_load_n(&srci_clock, __ATOMIC_RELAXED));
+
+    /*
+        Only flush the pages touched since the last sync (and the header).
+    */
+    pagesize = sysconf(_SC_PAGESIZE);
+    begin = begin / pagesize * pagesize;
+
+    res = msync(map, pagesize, MS_ASYNC);
+    if (res == 0) {
+        res = msync((uint8_t *) map + begin, end - begin, MS_ASYNC);
+    }
+    if (res < 0) {
+        E("ERROR: msync(): %s", strerror(errno));
+    }
+}
+
+
+int fs_srcinfo_put(struct sockaddr *addr, uint8_t ttl, uint8_t hwaddr[8])
+{
+    size_t i, idx;
+    uint32_t seq, clock;
+    uint8_t family, key[16];
+    struct srcinfo *set, *info;
+
+    if (addr_key(addr, &family, key) < 0) {
         E("ERROR: Unknown sa_family: %d", (int) addr->sa_family);
         return -1;
     }
 
-    info->ttl = ttl;
+    idx = find_set(family, key);
+    set = &srci[idx * SRCINFO_WAYS];
+    info = NULL;
+
+    seq = set_lock(&srci_lock[idx]);
+
+    for (i = 0; i < SRCINFO_WAYS; i++) {
+        if (set[i].initialized && set[i].family == family &&
+            memcmp(set[i].addr, key, sizeof(set[i].addr)) == 0) {
+            info = &set[i];
+            break;
+        }
+    }
+
+    if (!info) {
+        /* evict the least recently used entry of the set */
+        info = &set[0];
+        for (i = 0; i < SRCINFO_WAYS && info->initialized; i++) {
+            if (!set[i].initialized ||
+                ntohl(set[i].last_used) - ntohl(info->last_used) >
+                    UINT32_MAX / 2) {
+                info = &set[i];
+            }
+        }
+
+        if (info->initialized) {
+            __atomic_sub_fetch(&srci_peers, 1, __ATOMIC_RELAXED);
+            if (!info->confident) {
+                __atomic_sub_fetch(&srci_lowconf, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        memset(info, 0, sizeof(*info));
+        info->family = family;
+        memcpy(info->addr, key, sizeof(info->addr));
+        info->initialized = 1;
+        __atomic_add_fetch(&srci_peers, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&srci_lowconf, 1, __ATOMIC_RELAXED);
+    }
+
+    if (!info->confident) {
+        __atomic_sub_fetch(&srci_lowconf, 1, __ATOMIC_RELAXED);
+    }
+
+    info->samples[info->next_sample] = ttl;
+    info->next_sample = (info->next_sample + 1) % SRCINFO_SAMPLES;
+    if (info->nsamples < SRCINFO_SAMPLES) {
+        info->nsamples++;
+    }
+    update_estimate(info);
+
+    if (!info->confident) {
+        __atomic_add_fetch(&srci_lowconf, 1, __ATOMIC_RELAXED);
+    }
+
     memcpy(info->hwaddr, hwaddr, sizeof(info->hwaddr));
-    info->initialized = 1;
+    clock = __atomic_add_fetch(&srci_clock, 1, __ATOMIC_RELAXED);
+    info->last_used = htonl(clock);
+
+    set_unlock(&srci_lock[idx], seq);
 
-    srci_end = (srci_end + 1) % CAPACITY;
+    mark_dirty(info);
 
     return 0;
 }
@@ -112,19 +568,71 @@ int fs_srcinfo_put(struct sockaddr *addr, uint8_t ttl, uint8_t hwaddr[8])
 
 int fs_srcinfo_get(struct sockaddr *addr, uint8_t *ttl, uint8_t hwaddr[8])
 {
-    size_t i;
-    struct srcinfo *info;
+    int found;
+    size_t i, idx;
+    uint32_t seq;
+    uint8_t family, key[16], found_ttl, found_hwaddr[8];
+    struct srcinfo *set;
+
+    if (addr_key(addr, &family, key) < 0) {
+        return 1;
+    }
 
-    for (i = 0; i < CAPACITY; i++) {
-        info = &srci[(srci_end - i - 1) % CAPACITY];
-        if (!info->initialized) {
-            return 1;
+    idx = find_set(family, key);
+    set = &srci[idx * SRCINFO_WAYS];
+
+    for (;; srci_retries++) {
+        found = 0;
+        found_ttl = 0;
+
+        seq = __atomic_load_n(&srci_lock[idx].seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            /* a writer holds the set */
+            continue;
         }
-        if (sameip(addr, (struct sockaddr *) &info->addr)) {
-            *ttl = info->ttl;
-            memcpy(hwaddr, info->hwaddr, sizeof(info->hwaddr));
-            return 0;
+
+        for (i = 0; i < SRCINFO_WAYS; i++) {
+            if (set[i].initialized && set[i].family == family &&
+                memcmp(set[i].addr, key, sizeof(set[i].addr)) == 0) {
+                found = 1;
+                found_ttl = set[i].ttl;
+                memcpy(found_hwaddr, set[i].hwaddr, sizeof(found_hwaddr));
+                break;
+            }
+        }
+
+        /* the copies above must complete before the sequence is checked */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&srci_lock[idx].seq, __ATOMIC_RELAXED) == seq) {
+            break;
         }
     }
-    return 1;
+
+    if (!found) {
+        FS_COUNT(srcinfo_misses);
+        return 1;
+    }
+
+    FS_COUNT(srcinfo_hits);
+    *ttl = found_ttl;
+    memcpy(hwaddr, found_hwaddr, sizeof(found_hwaddr));
+
+    return 0;
+}
+
+
+void fs_srcinfo_stats(size_t *peers, size_t *lowconf)
+{
+    *peers = __atomic_load_n(&srci_peers, __ATOMIC_RELAXED);
+    *lowconf = __atomic_load_n(&srci_lowconf, __ATOMIC_RELAXED);
+}
+
+
+/*
+    Sequence lock retries of the calling thread, by readers and writers
+    alike. Read by tools/srcinfo_bench.c.
+*/
+uint64_t fs_srcinfo_retries(void)
+{
+    return srci_retries;
 }
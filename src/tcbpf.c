@@ -0,0 +1,731 @@
+/*
+ * tcbpf.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "tcbpf.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef FS_BPF
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#endif
+
+#include "bypass.h"
+#include "globvar.h"
+#include "ifmon.h"
+#include "logging.h"
+#include "payload.h"
+#include "tcinject.h"
+
+#ifdef FS_BPF
+
+#if FS_PAYLOAD_MAX > FS_TC_PAYLOAD_MAX
+#error "FS_TC_PAYLOAD_MAX is too small"
+#endif
+
+struct tc_link {
+    int ifindex;
+    int created;
+    uint32_t handle[2];
+    uint32_t priority[2];
+    char name[IFNAMSIZ];
+};
+
+/* bpf/tcinject.bpf.o, embedded by the Makefile */
+extern const char _binary_tcinject_bpf_o_start[];
+extern const char _binary_tcinject_bpf_o_end[];
+
+static const enum bpf_tc_attach_point attach_points[2] = {BPF_TC_INGRESS,
+                                                          BPF_TC_EGRESS};
+static const char *prog_names[2] = {"fs_tc_ingress", "fs_tc_egress"};
+
+static struct bpf_object *obj = NULL;
+static int prog_fd[2] = {-1, -1};
+static int map_config = -1, map_payload = -1, map_stats = -1;
+static int map_bypass4 = -1, map_bypass6 = -1;
+static struct fs_tc_config config;
+static struct tc_link *links = NULL;
+static size_t links_cnt = 0;
+static int bypass_ready = 0;
+static uint8_t bypass_gen = 0;
+
+
+static int libbpf_log(enum libbpf_print_level level, const char *fmt,
+                      va_list args)
+{
+    char buff[512];
+    size_t len;
+
+    if (level == LIBBPF_DEBUG) {
+        return 0;
+    }
+
+    vsnprintf(buff, sizeof(buff), fmt, args);
+    len = strlen(buff);
+    if (len && buff[len - 1] == '\n') {
+        buff[len - 1] = '\0';
+    }
+    E("libbpf: %s", buff);
+
+    return 0;
+}
+
+
+static int map_fd(const char *name)
+{
+    int fd;
+
+    fd = bpf_object__find_map_fd_by_name(obj, name);
+    if (fd < 0) {
+        E("ERROR: BPF map %s not found", name);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static int config_update(void)
+{
+    int res;
+    uint32_t zero;
+
+    zero = 0;
+    res = bpf_map_update_elem(map_config, &zero, &config, BPF_ANY);
+    if (res < 0) {
+        E("ERROR: bpf_map_update_elem(): %s", strerror(-res));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    The BPF program cannot run the payload selection per flow, so the map
+    holds the default payload group. It is refreshed on every loop tick,
+    which rotates the pool and renews the random fields.
+
+    A map update is a plain copy, which a program running meanwhile could
+    see half done, so the map has two slots: the new payload goes to the
+    one not in use, then the config is pointed to it. A program still
+    holding the previous slot is done long before the next tick.
+*/
+static int payload_update(void)
+{
+    int res;
+    size_t len;
+    uint32_t slot, sum;
+    struct sockaddr_in peer;
+    static struct fs_tc_payload payload;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+
+    memset(&payload, 0, sizeof(payload));
+    th_payload_get((struct sockaddr *) &peer, 0, payload.data, &len, &sum);
+    payload.len = len;
+
+    slot = (config.payload_slot + 1) % FS_TC_PAYLOAD_SLOTS;
+    res = bpf_map_update_elem(map_payload, &slot, &payload, BPF_ANY);
+    if (res < 0) {
+        E("ERROR: bpf_map_update_elem(): %s", strerror(-res));
+        return -1;
+    }
+
+    config.payload_slot = slot;
+    res = config_update();
+    if (res < 0) {
+        E(T(config_update));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int addr_bit(const uint8_t *addr, int i)
+{
+    return addr[i / 8] & (0x80 >> (i % 8));
+}
+
+
+/* delete the entries not written by the current generation */
+static int bypass_prune(int fd)
+{
+    int res, found;
+    uint8_t gen;
+    size_t i, cnt, cap;
+    struct fs_tc_lpm6 key, *stale, *new_stale;
+
+    stale = NULL;
+    cnt = cap = 0;
+
+    /* deleting while iterating would restart the walk at every key */
+    for (found = bpf_map_get_next_key(fd, NULL, &key) == 0; found;
+         found = bpf_map_get_next_key(fd, &key, &key) == 0) {
+        res = bpf_map_lookup_elem(fd, &key, &gen);
+        if (res < 0 || gen == bypass_gen) {
+            continue;
+        }
+        if (cnt == cap) {
+            cap = cap ? cap * 2 : 256;
+            new_stale = realloc(stale, cap * sizeof(*stale));
+            if (!new_stale) {
+                E("ERROR: realloc(): %s", strerror(errno));
+                free(stale);
+                return -1;
+            }
+            stale = new_stale;
+        }
+        stale[cnt++] = key;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        bpf_map_delete_elem(fd, &stale[i]);
+    }
+
+    free(stale);
+
+    return 0;
+}
+
+
+/*
+    The program is attached while the list is reloaded, so the map never
+    goes through an empty or partial state: the new prefixes are written
+    first, tagged with a new generation, then the entries left from the
+    previous one are deleted. A prefix in both lists stays in place.
+*/
+static int bypass_fill(int fd, int family)
+{
+    int res, len, bits, host, i;
+    size_t j;
+    uint8_t cur[16], last[16];
+    struct fs_tc_lpm6 key;
+    const struct fs_bypass_range *ranges;
+    size_t cnt;
+
+    /* the IPv4 key is a prefix of the IPv6 one */
+    len = family == AF_INET ? 4 : 16;
+    bits = len * 8;
+
+    fs_bypass_ranges(family, &ranges, &cnt);
+    for (j = 0; j < cnt; j++) {
+        memcpy(cur, ranges[j].start, len);
+        for (;;) {
+            /* largest aligned block from cur that stays within the range */
+            for (host = 0; host < bits && !addr_bit(cur, bits - 1 - host);
+                 host++) {
+            }
+            for (;; host--) {
+                memcpy(last, cur, len);
+                for (i = bits - host; i < bits; i++) {
+                    last[i / 8] |= 0x80 >> (i % 8);
+                }
+                if (memcmp(last, ranges[j].end, len) <= 0) {
+                    break;
+                }
+            }
+
+            memset(&key, 0, sizeof(key));
+            key.plen = bits - host;
+            memcpy(key.addr, cur, len);
+            res = bpf_map_update_elem(fd, &key, &bypass_gen, BPF_ANY);
+            if (res < 0) {
+                E("ERROR: bpf_map_update_elem(): %s", strerror(-res));
+                return -1;
+            }
+
+            if (memcmp(last, ranges[j].end, len) == 0) {
+                break;
+            }
+
+            memcpy(cur, last, len);
+            for (i = len - 1; i >= 0 && !++cur[i]; i--) {
+            }
+        }
+    }
+
+    res = bypass_prune(fd);
+    if (res < 0) {
+        E(T(bypass_prune));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int bypass_update(void)
+{
+    int res;
+
+    bypass_gen++;
+
+    res = bypass_fill(map_bypass4, AF_INET);
+    if (res < 0) {
+        E(T(bypass_fill));
+        return -1;
+    }
+
+    res = bypass_fill(map_bypass6, AF_INET6);
+    if (res < 0) {
+        E(T(bypass_fill));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int iface_wanted(const char *name)
+{
+    size_t i;
+
+    if (g_ctx.alliface) {
+        return strcmp(name, "lo") != 0;
+    }
+
+    for (i = 0; g_ctx.iface[i]; i++) {
+        if (fs_ifmon_is_pattern(g_ctx.iface[i])) {
+            if (fnmatch(g_ctx.iface[i], name, 0) == 0) {
+                return 1;
+            }
+        } else if (strcmp(g_ctx.iface[i], name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* the program parses from the Ethernet header */
+static int iface_ethernet(const char *name)
+{
+    int sockfd, res;
+    struct ifreq ifr;
+
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        E("ERROR: socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    res = ioctl(sockfd, SIOCGIFHWADDR, &ifr);
+    close(sockfd);
+    if (res < 0) {
+        E("ERROR: ioctl(): %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    return ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER;
+}
+
+
+static int attach_iface(int ifindex, const char *name)
+{
+    int res, i;
+    struct tc_link *link, *new_links;
+    struct bpf_tc_hook hook;
+    struct bpf_tc_opts opts;
+
+    new_links = realloc(links, (links_cnt + 1) * sizeof(*links));
+    if (!new_links) {
+        E("ERROR: realloc(): %s", strerror(errno));
+        return -1;
+    }
+    links = new_links;
+
+    link = &links[links_cnt];
+    memset(link, 0, sizeof(*link));
+    link->ifindex = ifindex;
+    snprintf(link->name, sizeof(link->name), "%s", name);
+
+    memset(&hook, 0, sizeof(hook));
+    hook.sz = sizeof(hook);
+    hook.ifindex = ifindex;
+    hook.attach_point = BPF_TC_INGRESS | BPF_TC_EGRESS;
+
+    /* an existing clsact qdisc is shared and left in place on exit */
+    res = bpf_tc_hook_create(&hook);
+    if (res < 0 && res != -EEXIST) {
+        E("ERROR: bpf_tc_hook_create(): %s: %s", name, strerror(-res));
+        return -1;
+    }
+    link->created = res == 0;
+    links_cnt++;
+
+    for (i = 0; i < 2; i++) {
+        memset(&opts, 0, sizeof(opts));
+        opts.sz = sizeof(opts);
+        opts.prog_fd = prog_fd[i];
+
+        hook.attach_point = attach_points[i];
+        res = bpf_tc_attach(&hook, &opts);
+        if (res < 0) {
+            E("ERROR: bpf_tc_attach(): %s: %s", name, strerror(-res));
+            return -1;
+        }
+        link->handle[i] = opts.handle;
+        link->priority[i] = opts.priority;
+    }
+
+    E_INFO("tc-BPF attached to %s", name);
+
+    return 0;
+}
+
+
+static int attach_all(void)
+{
+    int res;
+    size_t cnt;
+    struct if_nameindex *list, *p;
+
+    list = if_nameindex();
+    if (!list) {
+        E("ERROR: if_nameindex(): %s", strerror(errno));
+        return -1;
+    }
+
+    cnt = 0;
+    for (p = list; p->if_index; p++) {
+        if (!iface_wanted(p->if_name)) {
+            continue;
+        }
+
+        res = iface_ethernet(p->if_name);
+        if (res < 0) {
+            E(T(iface_ethernet));
+            goto free_list;
+        } else if (!res) {
+            E("WARNING: %s is not an Ethernet interface, skipped",
+              p->if_name);
+            continue;
+        }
+
+        res = attach_iface(p->if_index, p->if_name);
+        if (res < 0) {
+            E(T(attach_iface));
+            goto free_list;
+        }
+        cnt++;
+    }
+
+    if (!cnt) {
+        E("ERROR: no matching interface to attach to");
+        res = -1;
+        goto free_list;
+    }
+
+    res = 0;
+
+free_list:
+    if_freenameindex(list);
+
+    return res;
+}
+
+
+static void detach_all(void)
+{
+    int i, res;
+    size_t j;
+    struct tc_link *link;
+    struct bpf_tc_hook hook;
+    struct bpf_tc_opts opts;
+
+    for (j = 0; j < links_cnt; j++) {
+        link = &links[j];
+
+        memset(&hook, 0, sizeof(hook));
+        hook.sz = sizeof(hook);
+        hook.ifindex = link->ifindex;
+        hook.attach_point = BPF_TC_INGRESS | BPF_TC_EGRESS;
+
+        if (link->created) {
+            /* removes our filters along with the qdisc */
+            res = bpf_tc_hook_destroy(&hook);
+            if (res < 0 && res != -ENOENT) {
+                E("ERROR: bpf_tc_hook_destroy(): %s: %s", link->name,
+                  strerror(-res));
+            }
+            continue;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (!link->handle[i]) {
+                continue;
+            }
+
+            memset(&opts, 0, sizeof(opts));
+            opts.sz = sizeof(opts);
+            opts.handle = link->handle[i];
+            opts.priority = link->priority[i];
+
+            hook.attach_point = attach_points[i];
+            res = bpf_tc_detach(&hook, &opts);
+            if (res < 0 && res != -ENOENT) {
+                E("ERROR: bpf_tc_detach(): %s: %s", link->name,
+                  strerror(-res));
+            }
+        }
+    }
+
+    free(links);
+    links = NULL;
+    links_cnt = 0;
+}
+
+
+static void show_stats(void)
+{
+    int res, ncpus, i;
+    uint32_t key;
+    uint64_t *values, sum[FS_TC_STAT_MAX];
+
+    ncpus = libbpf_num_possible_cpus();
+    if (ncpus < 1) {
+        E("ERROR: libbpf_num_possible_cpus(): %s", strerror(-ncpus));
+        return;
+    }
+
+    values = calloc(ncpus, sizeof(*values));
+    if (!values) {
+        E("ERROR: calloc(): %s", strerror(errno));
+        return;
+    }
+
+    for (key = 0; key < FS_TC_STAT_MAX; key++) {
+        sum[key] = 0;
+        res = bpf_map_lookup_elem(map_stats, &key, values);
+        if (res < 0) {
+            E("ERROR: bpf_map_lookup_elem(): %s", strerror(-res));
+            goto free_values;
+        }
+        for (i = 0; i < ncpus; i++) {
+            sum[key] += values[i];
+        }
+    }
+
+    E("statistics: tc-BPF saw %" PRIu64 " packets, %" PRIu64
+      " new flows, sent %" PRIu64 " fakes, %" PRIu64 " errors",
+      sum[FS_TC_STAT_PKTS], sum[FS_TC_STAT_FLOWS], sum[FS_TC_STAT_FAKES],
+      sum[FS_TC_STAT_ERRORS]);
+
+free_values:
+    free(values);
+}
+
+
+int fs_tcbpf_setup(void)
+{
+    int res, i;
+    struct bpf_program *prog;
+
+    libbpf_set_print(libbpf_log);
+
+    res = fs_bypass_setup();
+    if (res < 0) {
+        E(T(fs_bypass_setup));
+        return -1;
+    }
+    bypass_ready = 1;
+
+    obj = bpf_object__open_mem(
+        _binary_tcinject_bpf_o_start,
+        _binary_tcinject_bpf_o_end - _binary_tcinject_bpf_o_start, NULL);
+    if (!obj) {
+        E("ERROR: bpf_object__open_mem(): %s", strerror(errno));
+        goto cleanup;
+    }
+
+    res = bpf_object__load(obj);
+    if (res < 0) {
+        E("ERROR: bpf_object__load(): %s", strerror(-res));
+        goto cleanup;
+    }
+
+    for (i = 0; i < 2; i++) {
+        prog = bpf_object__find_program_by_name(obj, prog_names[i]);
+        if (!prog) {
+            E("ERROR: BPF program %s not found", prog_names[i]);
+            goto cleanup;
+        }
+        prog_fd[i] = bpf_program__fd(prog);
+    }
+
+    map_config = map_fd("fs_config");
+    map_payload = map_fd("fs_payload");
+    map_stats = map_fd("fs_stats");
+    map_bypass4 = map_fd("fs_bypass4");
+    map_bypass6 = map_fd("fs_bypass6");
+    if (map_config < 0 || map_payload < 0 || map_stats < 0 ||
+        map_bypass4 < 0 || map_bypass6 < 0) {
+        E(T(map_fd));
+        goto cleanup;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.fwmark = g_ctx.fwmark;
+    config.fwmask = g_ctx.fwmask;
+    config.ttl = g_ctx.ttl;
+    config.repeat = g_ctx.repeat;
+    config.inbound = !!g_ctx.inbound;
+    config.outbound = !!g_ctx.outbound;
+    config.use_ipv4 = !!g_ctx.use_ipv4;
+    config.use_ipv6 = !!g_ctx.use_ipv6;
+
+    /* also writes the config, with the first slot filled */
+    res = payload_update();
+    if (res < 0) {
+        E(T(payload_update));
+        goto cleanup;
+    }
+
+    res = bypass_update();
+    if (res < 0) {
+        E(T(bypass_update));
+        goto cleanup;
+    }
+
+    res = attach_all();
+    if (res < 0) {
+        E(T(attach_all));
+        goto cleanup;
+    }
+
+    return 0;
+
+cleanup:
+    fs_tcbpf_cleanup();
+
+    return -1;
+}
+
+
+void fs_tcbpf_cleanup(void)
+{
+    detach_all();
+
+    if (obj) {
+        bpf_object__close(obj);
+        obj = NULL;
+    }
+    prog_fd[0] = prog_fd[1] = -1;
+    map_config = map_payload = map_stats = -1;
+    map_bypass4 = map_bypass6 = -1;
+
+    if (bypass_ready) {
+        fs_bypass_cleanup();
+        bypass_ready = 0;
+    }
+}
+
+
+int fs_tcbpf_loop(void)
+{
+    int res;
+    struct pollfd pfd;
+
+    while (!g_ctx.exit) {
+        if (g_ctx.showstats) {
+            g_ctx.showstats = 0;
+            show_stats();
+        }
+
+        if (g_ctx.reload) {
+            g_ctx.reload = 0;
+            res = fs_bypass_reload();
+            if (res < 0) {
+                E(T(fs_bypass_reload));
+            } else {
+                res = bypass_update();
+                if (res < 0) {
+                    E(T(bypass_update));
+                }
+            }
+        }
+
+        fs_payload_quiesce();
+
+        /* payload files changed; poll() ignores a negative fd */
+        pfd.fd = fs_payload_watchfd();
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        res = poll(&pfd, 1, 1000);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            E("ERROR: poll(): %s", strerror(errno));
+            return -1;
+        }
+
+        if (pfd.revents) {
+            fs_payload_reload();
+        }
+
+        res = payload_update();
+        if (res < 0) {
+            E(T(payload_update));
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+int fs_tcbpf_setup(void)
+{
+    E("ERROR: built without tc-BPF support, rebuild with BPF=1");
+    return -1;
+}
+
+
+void fs_tcbpf_cleanup(void)
+{
+}
+
+
+int fs_tcbpf_loop(void)
+{
+    return -1;
+}
+
+#endif /* FS_BPF */
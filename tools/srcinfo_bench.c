@@ -0,0 +1,228 @@
+/*
+ * srcinfo_bench.c - FakeSIP: https://github.com/MikeWang000000/FakeSIP
+ *
+ * Copyright (C) 2025  MikeWang000000
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "logging.h"
+#include "srcinfo.h"
+
+/*
+    Contention benchmark of the peer cache (src/srcinfo.c). Every thread
+    looks up and updates random peers out of BENCH_PEERS, which spread over
+    all the sets of the table, for a fixed duration. Three workloads run at
+    1, 2, 4, 8 and 16 threads:
+
+      read    all threads only look up
+      mixed   thread 0 only updates, the others only look up
+      write   all threads only update
+
+    The retries are those of the sequence locks: readers which saw a set
+    held or changed, and writers which found a set held. On fewer cores
+    than threads, a lock holder preempted mid-update makes the others spin
+    for the rest of its time slice, which inflates them.
+
+    Usage: srcinfo_bench [milliseconds per run, default 500]
+*/
+
+#define BENCH_PEERS   1024
+#define BENCH_THREADS 16
+#define BENCH_LINE    64
+
+enum workload { WL_READ = 0, WL_MIXED, WL_WRITE, WL_MAX };
+
+struct worker {
+    pthread_t thread;
+    int writer;
+    uint64_t seed;
+    uint64_t ops;
+    uint64_t retries;
+} __attribute__((aligned(BENCH_LINE)));
+
+static const char *wl_names[WL_MAX] = {"read", "mixed", "write"};
+static const int thread_cnts[] = {1, 2, 4, 8, 16};
+
+static struct sockaddr_in peers[BENCH_PEERS];
+static struct worker workers[BENCH_THREADS];
+static int running = 0;
+static int stop = 0;
+
+static uint64_t xorshift64(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+
+    return *x;
+}
+
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t ops;
+    uint8_t ttl, hwaddr[8];
+    struct sockaddr *peer;
+
+    memset(hwaddr, 0, sizeof(hwaddr));
+
+    while (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        /* all threads start together */
+    }
+
+    for (ops = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); ops++) {
+        peer = (struct sockaddr *)
+            &peers[xorshift64(&w->seed) % BENCH_PEERS];
+        if (w->writer) {
+            ttl = 64 - xorshift64(&w->seed) % 16;
+            fs_srcinfo_put(peer, ttl, hwaddr);
+        } else {
+            fs_srcinfo_get(peer, &ttl, hwaddr);
+        }
+    }
+
+    w->ops = ops;
+    w->retries = fs_srcinfo_retries();
+
+    return NULL;
+}
+
+
+static int run(enum workload wl, int nthreads, long ms)
+{
+    int i, res;
+    uint64_t ops, retries;
+    double secs;
+    struct timespec start, end, wait;
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < nthreads; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].writer = wl == WL_WRITE || (wl == WL_MIXED && i == 0);
+        workers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        res = pthread_create(&workers[i].thread, NULL, &worker_run,
+                             &workers[i]);
+        if (res) {
+            E("ERROR: pthread_create(): %s", strerror(res));
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+            while (i--) {
+                pthread_join(workers[i].thread, NULL);
+            }
+            return -1;
+        }
+    }
+
+    wait.tv_sec = ms / 1000;
+    wait.tv_nsec = ms % 1000 * 1000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    while (nanosleep(&wait, &wait) < 0 && errno == EINTR) {
+        /* sleep the remaining time */
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    ops = retries = 0;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        retries += workers[i].retries;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-6s %7d %14.0f %14" PRIu64 " %12.3f\n", wl_names[wl], nthreads,
+           ops / secs, retries, ops ? (double) retries / ops : 0.0);
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int res, wl;
+    size_t i;
+    long ms;
+    uint8_t hwaddr[8];
+
+    ms = argc > 1 ? strtol(argv[1], NULL, 10) : 500;
+    if (ms <= 0) {
+        fprintf(stderr, "usage: %s [milliseconds per run]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    res = fs_logger_setup();
+    if (res < 0) {
+        return EXIT_FAILURE;
+    }
+
+    res = fs_srcinfo_setup();
+    if (res < 0) {
+        E(T(fs_srcinfo_setup));
+        goto cleanup_logger;
+    }
+
+    /* 10.0.0.0/22, every peer known before the first run */
+    memset(hwaddr, 0, sizeof(hwaddr));
+    for (i = 0; i < BENCH_PEERS; i++) {
+        peers[i].sin_family = AF_INET;
+        peers[i].sin_addr.s_addr = htonl(0x0a000000 + i);
+        fs_srcinfo_put((struct sockaddr *) &peers[i], 64, hwaddr);
+    }
+
+    printf("%-6s %7s %14s %14s %12s\n", "load", "threads", "ops/s", "retries",
+           "retries/op");
+
+    for (wl = 0; wl < WL_MAX; wl++) {
+        for (i = 0; i < sizeof(thread_cnts) / sizeof(*thread_cnts); i++) {
+            res = run(wl, thread_cnts[i], ms);
+            if (res < 0) {
+                E(T(run));
+                goto cleanup_srcinfo;
+            }
+        }
+    }
+
+    fs_srcinfo_cleanup();
+    fs_logger_cleanup();
+
+    return EXIT_SUCCESS;
+
+cleanup_srcinfo:
+    fs_srcinfo_cleanup();
+
+cleanup_logger:
+    fs_logger_cleanup();
+
+    return EXIT_FAILURE;
+}